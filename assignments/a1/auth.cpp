@@ -0,0 +1,84 @@
+#include "auth.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include "server_grp.h"
+
+// Workers are detached and a process may exit with them still waiting, so the state they wait on
+// is never destroyed (destroying a condition variable with waiters blocks)
+struct AuthPool {
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::condition_variable exited;
+    std::deque<AuthRequest> queue;
+    int threads = 0;  // Running workers
+    bool stopping = false;
+};
+
+static AuthPool &pool = *new AuthPool;
+
+static void auth_worker() {
+    while (true) {
+        AuthRequest request;
+        {
+            std::unique_lock<std::mutex> lock(pool.mutex);
+            pool.ready.wait(lock, [] { return pool.stopping || !pool.queue.empty(); });
+            if (pool.queue.empty()) {
+                pool.threads--;
+                pool.exited.notify_all();
+                return;
+            }
+            request = std::move(pool.queue.front());
+            pool.queue.pop_front();
+            stats.auth_queue_depth.store(pool.queue.size(), std::memory_order_relaxed);
+        }
+
+        bool ok = check_credentials(request.username, request.password);
+        uint64_t latency_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                                  std::chrono::steady_clock::now() - request.queued).count();
+        stats.logins.fetch_add(1, std::memory_order_relaxed);
+        stats.login_latency_us.fetch_add(latency_us, std::memory_order_relaxed);
+        uint64_t max = stats.login_latency_max_us.load(std::memory_order_relaxed);
+        while (latency_us > max && !stats.login_latency_max_us.compare_exchange_weak(max, latency_us)) {
+        }
+        request.done(ok);
+    }
+}
+
+bool auth_submit(AuthRequest request) {
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    if (pool.stopping || pool.queue.size() >= config.auth_queue) {
+        stats.auth_rejected.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    while (pool.threads < std::max(1, config.auth_workers)) {
+        std::thread(auth_worker).detach();
+        pool.threads++;
+    }
+    request.queued = std::chrono::steady_clock::now();
+    pool.queue.push_back(std::move(request));
+    size_t depth = pool.queue.size();
+    stats.auth_queue_depth.store(depth, std::memory_order_relaxed);
+    if (depth > stats.auth_queue_peak.load(std::memory_order_relaxed)) {
+        stats.auth_queue_peak.store(depth, std::memory_order_relaxed);
+    }
+    pool.ready.notify_one();
+    return true;
+}
+
+void auth_shutdown() {
+    std::deque<AuthRequest> abandoned;
+    {
+        std::unique_lock<std::mutex> lock(pool.mutex);
+        pool.stopping = true;
+        abandoned.swap(pool.queue);
+        stats.auth_queue_depth = 0;
+        pool.ready.notify_all();
+        pool.exited.wait(lock, [] { return pool.threads == 0; });
+    }
+    for (auto &request : abandoned) request.done(false);
+}
@@ -0,0 +1,25 @@
+#ifndef AUTH_H
+#define AUTH_H
+
+#include <chrono>
+#include <functional>
+#include <string>
+
+// Password checks run on a small pool of worker threads behind a bounded admission queue,
+// so a burst of logins costs at most `config.auth_workers` cores and never stalls the
+// threads that carry messages. Workers start with the first request.
+
+struct AuthRequest {
+    std::string username;
+    std::string password;
+    std::function<void(bool)> done;                  // Called on a worker with the result of the check
+    std::chrono::steady_clock::time_point queued{};  // Set by auth_submit
+};
+
+// Queue a password check, returns false (and drops the request) if the queue is full
+bool auth_submit(AuthRequest request);
+
+// Stop the workers, requests still queued complete as failed
+void auth_shutdown();
+
+#endif // AUTH_H
@@ -0,0 +1,44 @@
+// Converts a "username:password" file into the credential index mapped by the server
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+#include "credentials.h"
+
+int main(int argc, char *argv[]) {
+    std::string input = "users.txt", output = "users.idx";
+    uint32_t iterations = CREDENTIALS_ITERATIONS;
+    int positional = 0;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--iterations" && i + 1 < argc) {
+            iterations = std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg[0] != '-' && positional < 2) {
+            (positional++ == 0 ? input : output) = arg;
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [users.txt [users.idx]] [--iterations N]" << std::endl;
+            return 1;
+        }
+    }
+    if (iterations == 0) {
+        std::cerr << "Error: --iterations must be positive." << std::endl;
+        return 1;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    auto users = read_credentials_file(input);
+    if (users.empty()) {
+        std::cerr << "Error: No credentials in " << input << "." << std::endl;
+        return 1;
+    }
+    std::string error;
+    if (!write_credential_index(users, output, iterations, error)) {
+        std::cerr << "Error: " << error << "." << std::endl;
+        return 1;
+    }
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Wrote " << users.size() << " credentials to " << output << " in " << ms << " ms" << std::endl;
+    return 0;
+}
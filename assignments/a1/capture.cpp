@@ -0,0 +1,202 @@
+#include "capture.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <unordered_map>
+
+#include "msglog.h"
+#include "record.h"
+#include "server_grp.h"
+#include "upgrade.h"
+
+uint64_t OutputDigest::hash_of(const iovec *parts, size_t n) {
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < n; i++) {
+        const unsigned char *data = (const unsigned char *)parts[i].iov_base;
+        for (size_t j = 0; j < parts[i].iov_len; j++) hash = (hash ^ data[j]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+static thread_local int timer_scopes = 0;
+
+CaptureTimerScope::CaptureTimerScope() {
+    timer_scopes++;
+}
+
+CaptureTimerScope::~CaptureTimerScope() {
+    timer_scopes--;
+}
+
+bool capture_in_timer() {
+    return timer_scopes > 0;
+}
+
+struct CapturedConnection {
+    uint32_t id;
+    OutputDigest output;
+};
+
+// Written by every thread that serves clients, so one lock guards the file and the connections.
+// Never freed: detached client threads may still call in while the process exits.
+struct Capture {
+    std::mutex mutex;
+    int fd = -1;
+    std::string buffer;
+    std::chrono::steady_clock::time_point last;       // Time of the previous record
+    uint32_t next_id = 1;
+    std::unordered_map<int, CapturedConnection> connections;  // By socket
+};
+
+static Capture &capture = *new Capture;
+static std::atomic<bool> capturing{false};
+
+static void flush_buffer() {
+    if (!write_all(capture.fd, capture.buffer)) {
+        std::cerr << "Warning: Cannot write the capture: " << strerror(errno) << "." << std::endl;
+    }
+    capture.buffer.clear();
+}
+
+// Start a record for a connection, with the time since the previous record. Caller holds the mutex.
+static std::string record_head(CaptureRecord type, uint32_t connection) {
+    auto now = std::chrono::steady_clock::now();
+    uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(now - capture.last).count();
+    capture.last = now;
+    std::string body(1, (char)type);
+    put_u32(body, connection);
+    put_u32(body, std::min<uint64_t>(us, UINT32_MAX));  // A silence over 71 minutes replays shorter
+    return body;
+}
+
+static void append(const std::string &body) {
+    capture.buffer += frame_record(body);
+    if (capture.buffer.size() >= CAPTURE_BUFFER) flush_buffer();
+}
+
+// A count followed by that many strings
+static void put_strings(std::string &body, const std::vector<std::string> &values) {
+    put_u32(body, values.size());
+    for (const std::string &value : values) put_string(body, value);
+}
+
+static void append_close(uint32_t id, const OutputDigest &output) {
+    std::string body = record_head(CAPTURE_CLOSE, id);
+    put_u64(body, output.messages);
+    put_u64(body, output.bytes);
+    put_u64(body, output.hash);
+    append(body);
+}
+
+bool capture_open(const std::string &path, std::string &error) {
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        error = "cannot open " + path + ": " + strerror(errno);
+        return false;
+    }
+    // The state the replay starts from, copied before taking the lock
+    Handoff state;
+    handoff_save_groups(state);
+    std::vector<std::pair<std::string, std::vector<std::string>>> backlog;
+    for_each_backlog([&](const std::string &username, const std::vector<std::string> &messages) {
+        backlog.emplace_back(username, messages);
+    });
+
+    std::lock_guard<std::mutex> lock(capture.mutex);
+    capture.fd = fd;
+    capture.last = std::chrono::steady_clock::now();
+    std::string body = record_head(CAPTURE_HEADER, 0);
+    put_u32(body, CAPTURE_VERSION);
+    put_u32(body, config.presence_threshold);
+    append(body);
+    for (const HandoffGroup &group : state.groups) {
+        body = record_head(CAPTURE_GROUP, 0);
+        put_string(body, group.name);
+        put_strings(body, group.members);
+        put_strings(body, group.messages);
+        append(body);
+    }
+    for (const auto &[username, messages] : backlog) {
+        body = record_head(CAPTURE_BACKLOG, 0);
+        put_string(body, username);
+        put_strings(body, messages);
+        append(body);
+    }
+    capturing = true;
+    return true;
+}
+
+void capture_close() {
+    std::lock_guard<std::mutex> lock(capture.mutex);
+    if (!capturing) return;
+    capturing = false;
+    for (auto &[socket, connection] : capture.connections) append_close(connection.id, connection.output);
+    capture.connections.clear();
+    flush_buffer();
+    close(capture.fd);
+    capture.fd = -1;
+}
+
+bool capture_running() {
+    return capturing.load(std::memory_order_relaxed);
+}
+
+void capture_session_open(const Session &session) {
+    if (!capture_running()) return;
+    std::lock_guard<std::mutex> lock(capture.mutex);
+    if (!capturing) return;
+    uint32_t id = capture.next_id++;
+    capture.connections[session.socket] = {id, {}};
+    append(record_head(CAPTURE_OPEN, id));
+}
+
+// Record of a connection that has nothing but a head, if the connection is captured
+static void append_event(const Session &session, CaptureRecord type, const std::function<void(std::string &)> &fill) {
+    if (!capture_running()) return;
+    std::lock_guard<std::mutex> lock(capture.mutex);
+    auto it = capture.connections.find(session.socket);
+    if (!capturing || it == capture.connections.end()) return;  // Taken over from the previous server
+    std::string body = record_head(type, it->second.id);
+    fill(body);
+    append(body);
+}
+
+void capture_framed(const Session &session) {
+    append_event(session, CAPTURE_FRAMED, [](std::string &) {});
+}
+
+void capture_input(const Session &session, std::string_view message) {
+    append_event(session, CAPTURE_INPUT, [&](std::string &body) { put_string(body, message); });
+}
+
+void capture_login(const Session &session, CaptureLogin outcome) {
+    append_event(session, CAPTURE_LOGIN, [&](std::string &body) { body += (char)outcome; });
+}
+
+void capture_session_close(const Session &session) {
+    if (!capture_running()) return;
+    std::lock_guard<std::mutex> lock(capture.mutex);
+    auto it = capture.connections.find(session.socket);
+    if (!capturing || it == capture.connections.end()) return;
+    append_close(it->second.id, it->second.output);
+    capture.connections.erase(it);
+}
+
+void capture_output(const int *sockets, size_t count, const iovec *parts, size_t n) {
+    if (!capture_running() || capture_in_timer()) return;
+    uint64_t hash = OutputDigest::hash_of(parts, n);
+    size_t bytes = 0;
+    for (size_t i = 0; i < n; i++) bytes += parts[i].iov_len;
+    std::lock_guard<std::mutex> lock(capture.mutex);
+    for (size_t i = 0; i < count; i++) {
+        auto it = capture.connections.find(sockets[i]);
+        if (it != capture.connections.end()) it->second.output.add(hash, bytes);
+    }
+}
@@ -0,0 +1,92 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <sys/uio.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+struct Session;
+
+// Traffic capture for deterministic replay (tests/replay.cpp). A server started with
+// --capture PATH writes what its clients did to PATH, in record.h framing. Every record body
+// starts with uint8_t type, uint32_t connection, uint32_t microseconds since the previous record:
+//
+//   CAPTURE_HEADER  uint32_t version, uint32_t presence_threshold        (connection 0)
+//   CAPTURE_GROUP   group, uint32_t n, n member usernames, uint32_t m, m recent messages   (connection 0)
+//   CAPTURE_BACKLOG username, uint32_t n, n messages kept for the user while offline      (connection 0)
+//   CAPTURE_OPEN    a connection was accepted and sent the username prompt
+//   CAPTURE_FRAMED  the client opened with PROTO_HELLO
+//   CAPTURE_INPUT   string message as it ran: the username, or a command
+//   CAPTURE_LOGIN   uint8_t CaptureLogin outcome; passwords are never written
+//   CAPTURE_CLOSE   uint64_t messages, uint64_t bytes, uint64_t hash: the OutputDigest of the connection
+//
+// The groups and offline messages the server had when the capture started follow the header, so
+// a replay starts from the same state. Inputs are written when they run, so input held back during a login or a throttle follows the
+// login, in the order the throttle let it through. The digests leave out output sent on a timer
+// (heartbeats, timeouts, presence digests), which a replay does not reproduce, and do not depend
+// on the order of the messages, which concurrent senders do not fix.
+
+#define CAPTURE_VERSION 2
+#define CAPTURE_BUFFER (64 << 10)  // Records collected before a write()
+
+enum CaptureRecord : uint8_t {
+    CAPTURE_HEADER = 1,
+    CAPTURE_OPEN = 2,
+    CAPTURE_FRAMED = 3,
+    CAPTURE_INPUT = 4,
+    CAPTURE_LOGIN = 5,
+    CAPTURE_CLOSE = 6,
+    CAPTURE_GROUP = 7,
+    CAPTURE_BACKLOG = 8,
+};
+
+enum CaptureLogin : uint8_t { LOGIN_FAILED = 0, LOGIN_OK = 1, LOGIN_BUSY = 2 };
+
+// What a connection was sent, whatever the order of the messages
+struct OutputDigest {
+    uint64_t messages = 0;
+    uint64_t bytes = 0;
+    uint64_t hash = 0;  // Sum of the 64-bit FNV-1a hashes of the messages
+
+    // 64-bit FNV-1a hash of one message, in parts
+    static uint64_t hash_of(const iovec *parts, size_t n);
+
+    // One message, hashed by hash_of()
+    void add(uint64_t message_hash, size_t message_bytes) {
+        messages++;
+        bytes += message_bytes;
+        hash += message_hash;
+    }
+    bool operator==(const OutputDigest &other) const = default;
+};
+
+// Output sent while a CaptureTimerScope is alive on the thread is left out of the digests
+class CaptureTimerScope {
+   public:
+    CaptureTimerScope();
+    ~CaptureTimerScope();
+};
+
+bool capture_in_timer();
+
+// Start writing the capture to `path`, replacing the file
+bool capture_open(const std::string &path, std::string &error);
+
+// Write the digests of the connections still open and stop capturing
+void capture_close();
+
+bool capture_running();
+
+void capture_session_open(const Session &session);
+void capture_framed(const Session &session);
+void capture_input(const Session &session, std::string_view message);
+void capture_login(const Session &session, CaptureLogin outcome);
+void capture_session_close(const Session &session);
+
+// A message sent to client sockets, hashed once for all of them
+void capture_output(const int *sockets, size_t count, const iovec *parts, size_t n);
+
+#endif // CAPTURE_H
@@ -14,6 +14,8 @@
 #include <arpa/inet.h>
 
 #define BUFFER_SIZE 1024
+#define PROTO_HELLO "/proto newline\n"  // Ask the server for newline framed commands
+#define HEARTBEAT "/ping\n"              // Sent by the server when we have been quiet for a while
 
 std::mutex cout_mutex;
 
@@ -28,8 +30,15 @@ void handle_server_messages(int server_socket) {
             close(server_socket);
             exit(0);
         }
+        // Answer the server's heartbeats without showing them
+        std::string received(buffer, bytes_received);
+        for (size_t ping; (ping = received.find(HEARTBEAT)) != std::string::npos;) {
+            received.erase(ping, strlen(HEARTBEAT));
+            send(server_socket, "/pong\n", 6, 0);
+        }
+        if (received.empty()) continue;
         std::lock_guard<std::mutex> lock(cout_mutex);
-        std::cout << buffer << std::endl;
+        std::cout << received << std::endl;
     }
 }
 
@@ -54,6 +63,9 @@ int main() {
 
     std::cout << "Connected to the server." << std::endl;
 
+    // Negotiate newline framing, so every line sent below is exactly one command
+    send(client_socket, PROTO_HELLO, strlen(PROTO_HELLO), 0);
+
     // Authentication
     std::string username, password;
     char buffer[BUFFER_SIZE];
@@ -64,12 +76,14 @@ int main() {
  
     std::cout << buffer;
     std::getline(std::cin, username);
+    username += '\n';
     send(client_socket, username.c_str(), username.size(), 0);
 
     memset(buffer, 0, BUFFER_SIZE);
     recv(client_socket, buffer, BUFFER_SIZE, 0); // Receive the message "Enter the password" for the server
     std::cout << buffer;
     std::getline(std::cin, password);
+    password += '\n';
     send(client_socket, password.c_str(), password.size(), 0);
 
     memset(buffer, 0, BUFFER_SIZE);
@@ -94,7 +108,8 @@ int main() {
 
         if (message.empty()) continue;
 
-        send(client_socket, message.c_str(), message.size(), 0);
+        std::string line = message + '\n';
+        send(client_socket, line.c_str(), line.size(), 0);
 
         if (message == "/exit") {
             close(client_socket);
@@ -0,0 +1,198 @@
+#include "credentials.h"
+
+#include <fcntl.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <thread>
+#include <unordered_map>
+
+#define NO_RECORD UINT32_MAX
+
+uint64_t credential_hash(std::string_view name) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (unsigned char c : name) {
+        hash = (hash ^ c) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+static bool derive(std::string_view password, const uint8_t *salt, uint32_t iterations, uint8_t *digest) {
+    return PKCS5_PBKDF2_HMAC(password.data(), (int)password.size(), salt, CREDENTIALS_SALT, (int)iterations, EVP_sha256(),
+                             CREDENTIALS_DIGEST, digest) == 1;
+}
+
+std::unique_ptr<CredentialIndex> CredentialIndex::open(const std::string &path, std::string &error) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        error = "cannot open " + path;
+        return nullptr;
+    }
+    struct stat st {};
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(CredentialHeader)) {
+        close(fd);
+        error = path + " is too short";
+        return nullptr;
+    }
+    void *base = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        error = "cannot map " + path;
+        return nullptr;
+    }
+
+    std::unique_ptr<CredentialIndex> index(new CredentialIndex());
+    index->base_ = (const char *)base;
+    index->length_ = st.st_size;
+    const CredentialHeader *h = (const CredentialHeader *)base;
+    index->header_ = h;
+
+    // Every later access relies on these bounds, so a truncated or foreign file is rejected here
+    uint64_t slots_end = h->slots_offset + h->slot_count * sizeof(uint32_t);
+    uint64_t records_end = h->records_offset + h->record_count * sizeof(CredentialRecord);
+    if (memcmp(h->magic, CREDENTIALS_MAGIC, sizeof(h->magic)) != 0 || h->version != CREDENTIALS_VERSION) {
+        error = path + " is not a credential index";
+    } else if (h->file_size != index->length_ || h->slot_count == 0 || (h->slot_count & (h->slot_count - 1)) != 0 ||
+               h->slot_count < h->record_count || h->record_count >= NO_RECORD || h->slots_offset % 8 != 0 ||
+               h->records_offset % 8 != 0 || slots_end > h->records_offset || records_end > h->names_offset ||
+               h->names_offset > h->file_size) {
+        error = path + " is corrupt";
+    } else {
+        index->slots_ = (const uint32_t *)(index->base_ + h->slots_offset);
+        index->records_ = (const CredentialRecord *)(index->base_ + h->records_offset);
+        index->names_ = index->base_ + h->names_offset;
+        index->names_length_ = h->file_size - h->names_offset;
+        return index;
+    }
+    return nullptr;
+}
+
+CredentialIndex::~CredentialIndex() {
+    if (base_ != nullptr) munmap(const_cast<char *>(base_), length_);
+}
+
+const CredentialRecord *CredentialIndex::find(std::string_view username) const {
+    uint64_t hash = credential_hash(username);
+    uint64_t mask = header_->slot_count - 1;
+    for (uint64_t i = hash & mask, probes = 0; probes <= mask; i = (i + 1) & mask, probes++) {
+        uint32_t slot = slots_[i];
+        if (slot == NO_RECORD || slot >= header_->record_count) return nullptr;
+        const CredentialRecord *record = &records_[slot];
+        if (record->hash == hash && record->name_length == username.size() &&
+            record->name_offset + record->name_length <= names_length_ &&
+            memcmp(names_ + record->name_offset, username.data(), username.size()) == 0) {
+            return record;
+        }
+    }
+    return nullptr;
+}
+
+bool CredentialIndex::verify(std::string_view username, std::string_view password) const {
+    const CredentialRecord *record = find(username);
+    if (record == nullptr) return false;
+    uint8_t digest[CREDENTIALS_DIGEST];
+    if (!derive(password, record->salt, header_->iterations, digest)) return false;
+    return CRYPTO_memcmp(digest, record->digest, CREDENTIALS_DIGEST) == 0;
+}
+
+std::vector<std::pair<std::string, std::string>> read_credentials_file(const std::string &path) {
+    std::vector<std::pair<std::string, std::string>> users;
+    std::unordered_map<std::string, size_t> seen;
+    std::ifstream file(path);
+    std::string line;
+    while (std::getline(file, line)) {
+        size_t colon = line.find(':');
+        if (colon == std::string::npos) continue;
+        std::string username = line.substr(0, colon);
+        size_t begin = line.find_first_not_of(" \t\r\n", colon + 1);
+        size_t end = line.find_last_not_of(" \t\r\n");
+        std::string password = (begin == std::string::npos) ? "" : line.substr(begin, end - begin + 1);
+        auto [it, inserted] = seen.emplace(username, users.size());
+        if (inserted) {
+            users.emplace_back(std::move(username), std::move(password));
+        } else {
+            users[it->second].second = std::move(password);
+        }
+    }
+    return users;
+}
+
+bool write_credential_index(const std::vector<std::pair<std::string, std::string>> &users, const std::string &path,
+                            uint32_t iterations, std::string &error) {
+    CredentialHeader header{};
+    memcpy(header.magic, CREDENTIALS_MAGIC, sizeof(header.magic));
+    header.version = CREDENTIALS_VERSION;
+    header.iterations = iterations;
+    header.record_count = users.size();
+    header.slot_count = 16;
+    while (header.slot_count < users.size() * 2) header.slot_count *= 2;
+    header.slots_offset = sizeof(CredentialHeader);
+    header.records_offset = (header.slots_offset + header.slot_count * sizeof(uint32_t) + 7) / 8 * 8;
+    header.names_offset = header.records_offset + users.size() * sizeof(CredentialRecord);
+
+    std::vector<uint32_t> slots(header.slot_count, NO_RECORD);
+    std::vector<CredentialRecord> records(users.size());
+    std::string names;
+    for (size_t i = 0; i < users.size(); i++) {
+        CredentialRecord &record = records[i];
+        record.hash = credential_hash(users[i].first);
+        record.name_offset = names.size();
+        record.name_length = users[i].first.size();
+        names += users[i].first;
+        uint64_t slot = record.hash & (header.slot_count - 1);
+        while (slots[slot] != NO_RECORD) slot = (slot + 1) & (header.slot_count - 1);
+        slots[slot] = i;
+    }
+
+    // Key derivation dominates, spread it over every core
+    std::atomic<size_t> next(0);
+    std::atomic<bool> failed(false);
+    std::vector<std::thread> workers;
+    for (unsigned t = 0; t < std::max(1u, std::thread::hardware_concurrency()); t++) {
+        workers.emplace_back([&]() {
+            for (size_t i = next++; i < users.size(); i = next++) {
+                if (RAND_bytes(records[i].salt, CREDENTIALS_SALT) != 1 ||
+                    !derive(users[i].second, records[i].salt, iterations, records[i].digest)) {
+                    failed = true;
+                }
+            }
+        });
+    }
+    for (auto &worker : workers) worker.join();
+    if (failed) {
+        error = "key derivation failed";
+        return false;
+    }
+    header.file_size = header.names_offset + names.size();
+
+    // Written next to the target and renamed over it, so a server that maps the old file keeps a valid view
+    std::string tmp = path + ".tmp";
+    FILE *file = fopen(tmp.c_str(), "wb");
+    if (file == nullptr) {
+        error = "cannot create " + tmp;
+        return false;
+    }
+    std::vector<char> padding(header.records_offset - header.slots_offset - slots.size() * sizeof(uint32_t), 0);
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+              fwrite(slots.data(), sizeof(uint32_t), slots.size(), file) == slots.size() &&
+              fwrite(padding.data(), 1, padding.size(), file) == padding.size() &&
+              fwrite(records.data(), sizeof(CredentialRecord), records.size(), file) == records.size() &&
+              fwrite(names.data(), 1, names.size(), file) == names.size();
+    ok = (fflush(file) == 0) && ok && fsync(fileno(file)) == 0;
+    ok = (fclose(file) == 0) && ok;
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        std::remove(tmp.c_str());
+        error = "cannot write " + path;
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,89 @@
+#ifndef CREDENTIALS_H
+#define CREDENTIALS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// On-disk credential index, built from users.txt by build_credentials and mmap'd by the server.
+//
+//   CredentialHeader
+//   uint32_t slots[slot_count]          open addressing table of record numbers, NO_RECORD if empty
+//   CredentialRecord records[record_count]
+//   char names[]                        usernames, not terminated
+//
+// Passwords are stored as PBKDF2-HMAC-SHA256 digests with a random salt per user.
+
+#define CREDENTIALS_MAGIC "CS425CRD"
+#define CREDENTIALS_VERSION 1
+#define CREDENTIALS_ITERATIONS 4096  // PBKDF2 rounds used by build_credentials by default
+#define CREDENTIALS_SALT 16
+#define CREDENTIALS_DIGEST 32
+
+struct CredentialHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t iterations;
+    uint64_t record_count;
+    uint64_t slot_count;  // Power of two, at least twice record_count
+    uint64_t slots_offset;
+    uint64_t records_offset;
+    uint64_t names_offset;
+    uint64_t file_size;
+};
+
+struct CredentialRecord {
+    uint64_t hash;  // credential_hash() of the username
+    uint64_t name_offset;
+    uint32_t name_length;
+    uint8_t salt[CREDENTIALS_SALT];
+    uint8_t digest[CREDENTIALS_DIGEST];
+    uint32_t reserved;
+};
+
+static_assert(sizeof(CredentialHeader) == 64 && sizeof(CredentialRecord) == 72, "on-disk layout");
+
+// FNV-1a, fixed so that the index does not depend on the standard library that built it
+uint64_t credential_hash(std::string_view name);
+
+// A read-only, memory-mapped credential index
+class CredentialIndex {
+   public:
+    // Map and validate an index file, returns nullptr and sets error on failure
+    static std::unique_ptr<CredentialIndex> open(const std::string &path, std::string &error);
+    ~CredentialIndex();
+    CredentialIndex(const CredentialIndex &) = delete;
+    CredentialIndex &operator=(const CredentialIndex &) = delete;
+
+    bool contains(std::string_view username) const { return find(username) != nullptr; }
+
+    // True if the user exists and the password matches its digest
+    bool verify(std::string_view username, std::string_view password) const;
+
+    size_t size() const { return header_->record_count; }
+
+   private:
+    CredentialIndex() = default;
+    const CredentialRecord *find(std::string_view username) const;
+
+    const char *base_ = nullptr;
+    size_t length_ = 0;
+    const CredentialHeader *header_ = nullptr;
+    const uint32_t *slots_ = nullptr;
+    const CredentialRecord *records_ = nullptr;
+    const char *names_ = nullptr;
+    size_t names_length_ = 0;
+};
+
+// Read "username:password" lines, trimming the password. A later line for the same user wins.
+std::vector<std::pair<std::string, std::string>> read_credentials_file(const std::string &path);
+
+// Write an index for (username, password) pairs to path, replacing any previous file atomically
+bool write_credential_index(const std::vector<std::pair<std::string, std::string>> &users, const std::string &path,
+                            uint32_t iterations, std::string &error);
+
+#endif // CREDENTIALS_H
@@ -0,0 +1,509 @@
+#include "groupstore.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "record.h"
+#include "server_grp.h"
+
+// groups.snap, all integers little-endian and every array aligned to its element size:
+//
+//   SnapshotHeader
+//   uint64_t name_end[users + groups]   end of each name in names[], users first
+//   uint64_t member_start[groups + 1]   group g holds member_user[member_start[g] .. member_start[g + 1])
+//   uint32_t member_user[members]       user indexes, increasing within a group (padded to an even count)
+//   char names[names_bytes]
+//
+// Users are every interned name, in id order, so that a fresh server interns them to the same ids.
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t wal;          // First WAL not covered by the snapshot
+    uint64_t users;
+    uint64_t groups;
+    uint64_t members;
+    uint64_t names_bytes;
+    uint64_t checksum;     // Of everything after the header
+};
+
+static constexpr char SNAPSHOT_MAGIC[8] = {'C', 'S', '4', '2', '5', 'G', 'R', 'P'};
+static constexpr uint32_t SNAPSHOT_VERSION = 1;
+
+struct GroupStore {
+    std::string dir;
+    bool sync = false;
+    size_t snapshot_every = 0;
+    // Under clients_mutex
+    bool open = false;
+    int fd = -1;                  // Current WAL, replaced only while sync_mutex is held too
+    uint64_t wal = 0;             // Number of the current WAL
+    size_t since_snapshot = 0;    // Operations appended since the last snapshot started
+    std::atomic<uint64_t> seq{0};     // Operations written to the WAL
+    std::atomic<uint64_t> synced{0};  // Operations known to be on disk
+    std::mutex sync_mutex;            // Held by the committer running fdatasync() and while switching WALs
+    std::mutex snapshot_mutex;        // One snapshot at a time
+    uint64_t oldest_wal = 0;          // Oldest WAL on disk (under snapshot_mutex)
+    // Snapshot thread
+    std::mutex thread_mutex;
+    std::condition_variable wake;
+    bool requested = false, stopping = false;
+    std::thread snapshotter;
+};
+
+static GroupStore store;
+
+static std::string wal_path(uint64_t wal) {
+    char name[32];
+    snprintf(name, sizeof(name), "/%020llu.wal", (unsigned long long)wal);
+    return store.dir + name;
+}
+
+static std::string snapshot_path() {
+    return store.dir + "/groups.snap";
+}
+
+// member_user[] is padded to an even length, which keeps names[] 8-byte aligned
+static uint64_t padded(uint64_t members) {
+    return (members + 1) & ~(uint64_t)1;
+}
+
+// FNV-1a over 8-byte words, so checking a large snapshot costs little next to reading it
+static uint64_t snapshot_checksum(std::string_view data) {
+    uint64_t hash = 14695981039346656037ull;
+    size_t i = 0;
+    for (; i + 8 <= data.size(); i += 8) {
+        uint64_t word;
+        memcpy(&word, data.data() + i, sizeof(word));
+        hash = (hash ^ word) * 1099511628211ull;
+    }
+    for (; i < data.size(); i++) {
+        hash = (hash ^ (unsigned char)data[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+// Membership being rebuilt at startup, mutable until it is published
+struct Recovery {
+    std::vector<IdSet> members;  // By group id
+    std::vector<bool> exists;
+    std::vector<IdSet> groups;   // By user id
+    uint64_t wal = 0;            // First WAL after the snapshot
+    bool full = false;           // A name did not fit in user_ids or group_ids
+
+    void fit() {
+        members.resize(group_ids.size());
+        exists.resize(group_ids.size());
+        groups.resize(user_ids.size());
+    }
+};
+
+// Map the snapshot and intern its names, building each member set from its sorted ids at once
+static bool load_snapshot(Recovery &state, std::string &error) {
+    std::string path = snapshot_path();
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno == ENOENT) return true;  // First start
+        error = "cannot open " + path;
+        return false;
+    }
+    struct stat st {};
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(SnapshotHeader)) {
+        close(fd);
+        error = path + " is corrupt";
+        return false;
+    }
+    size_t size = st.st_size;
+    void *base = mmap(nullptr, size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        error = "cannot map " + path;
+        return false;
+    }
+
+    const SnapshotHeader &header = *(const SnapshotHeader *)base;
+    const char *data = (const char *)base + sizeof(SnapshotHeader);
+    const uint64_t *name_end = (const uint64_t *)data;
+    const uint64_t *member_start = name_end + header.users + header.groups;
+    const uint32_t *member_user = (const uint32_t *)(member_start + header.groups + 1);
+    const char *names = (const char *)(member_user + padded(header.members));
+    bool valid = memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) == 0 && header.version == SNAPSHOT_VERSION &&
+                 header.users < NO_ID &&
+                 size == sizeof(SnapshotHeader) + (header.users + header.groups * 2 + 1) * 8 + padded(header.members) * 4 + header.names_bytes &&
+                 snapshot_checksum(std::string_view(data, size - sizeof(SnapshotHeader))) == header.checksum &&
+                 member_start[0] == 0 && member_start[header.groups] == header.members;
+    for (uint64_t i = 0; valid && i < header.users + header.groups; i++) {
+        valid = name_end[i] >= (i > 0 ? name_end[i - 1] : 0) && name_end[i] <= header.names_bytes;
+    }
+    for (uint64_t g = 0; valid && g < header.groups; g++) {
+        valid = member_start[g] <= member_start[g + 1];
+    }
+    for (uint64_t m = 0; valid && m < header.members; m++) {
+        valid = member_user[m] < header.users;
+    }
+    if (!valid) {
+        munmap(base, size);
+        error = path + " is corrupt";
+        return false;
+    }
+
+    auto name = [&](uint64_t i) {
+        uint64_t begin = i > 0 ? name_end[i - 1] : 0;
+        return std::string_view(names + begin, name_end[i] - begin);
+    };
+    // On a fresh server every user gets the id it had, and the member lists are used as they are
+    std::vector<uint32_t> user_map(header.users);
+    bool same_ids = true;
+    for (uint64_t u = 0; valid && u < header.users; u++) {
+        user_map[u] = user_ids.intern(name(u));
+        valid = user_map[u] != NO_ID;
+        same_ids = same_ids && user_map[u] == u;
+    }
+    std::vector<uint32_t> group_map(header.groups);
+    for (uint64_t g = 0; valid && g < header.groups; g++) {
+        group_map[g] = group_ids.intern(name(header.users + g));
+        valid = group_map[g] != NO_ID;
+    }
+    if (!valid) {
+        munmap(base, size);
+        error = path + " has more users or groups than the server can hold";
+        return false;
+    }
+    std::vector<std::vector<uint32_t>> user_groups(user_ids.size());
+    for (uint64_t g = 0; g < header.groups; g++) {
+        uint32_t group_id = group_map[g];
+        std::vector<uint32_t> ids(member_user + member_start[g], member_user + member_start[g + 1]);
+        if (!same_ids) {
+            for (uint32_t &id : ids) id = user_map[id];
+            std::sort(ids.begin(), ids.end());
+        }
+        for (uint32_t id : ids) user_groups[id].push_back(group_id);
+        state.fit();
+        state.members[group_id] = IdSet::from_sorted(std::move(ids));
+        state.exists[group_id] = true;
+    }
+    for (size_t u = 0; u < user_groups.size(); u++) {
+        if (user_groups[u].empty()) continue;
+        if (!std::is_sorted(user_groups[u].begin(), user_groups[u].end())) std::sort(user_groups[u].begin(), user_groups[u].end());
+        state.groups[u] = IdSet::from_sorted(std::move(user_groups[u]));
+    }
+    state.wal = header.wal;
+    munmap(base, size);
+    return true;
+}
+
+// Apply one logged operation, returns false if the record is malformed
+static bool replay_op(Recovery &state, std::string_view body) {
+    RecordReader reader{body};
+    uint8_t op;
+    std::string_view group_name, username;
+    if (!reader.get(op) || !reader.get(group_name) || !reader.get(username)) return false;
+    uint32_t group_id = group_ids.intern(group_name);
+    uint32_t user_id = user_ids.intern(username);
+    if (group_id == NO_ID || user_id == NO_ID) {
+        state.full = true;
+        return false;
+    }
+    state.fit();
+    switch ((GroupOp)op) {
+    case GROUP_CREATE:
+    case GROUP_JOIN:
+        state.exists[group_id] = true;
+        state.members[group_id].insert(user_id);
+        state.groups[user_id].insert(group_id);
+        return true;
+    case GROUP_LEAVE:
+        state.members[group_id].erase(user_id);
+        state.groups[user_id].erase(group_id);
+        return true;
+    }
+    return false;
+}
+
+// Replay a WAL, cutting off a torn tail if it is the last one
+static bool replay_wal(Recovery &state, uint64_t wal, bool last, std::string &error) {
+    std::string path = wal_path(wal);
+    int fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+    struct stat st {};
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        if (fd >= 0) close(fd);
+        error = "cannot open " + path;
+        return false;
+    }
+    size_t size = st.st_size, pos = 0;
+    if (size > 0) {
+        void *base = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (base == MAP_FAILED) {
+            close(fd);
+            error = "cannot map " + path;
+            return false;
+        }
+        pos = scan_records(std::string_view((const char *)base, size),
+                           [&state](std::string_view body) { return replay_op(state, body); });
+        munmap(base, size);
+    }
+    if (state.full) {
+        close(fd);
+        error = path + " has more users or groups than the server can hold";
+        return false;
+    }
+    if (pos < size) {
+        if (!last) {
+            close(fd);
+            error = path + " is corrupt";
+            return false;
+        }
+        std::cerr << "Warning: Dropping " << size - pos << " damaged bytes at the end of " << path << "." << std::endl;
+        if (ftruncate(fd, pos) < 0) {
+            close(fd);
+            error = "cannot truncate " + path;
+            return false;
+        }
+    }
+    close(fd);
+    return true;
+}
+
+// Close the current WAL and continue in a new one (caller holds clients_mutex)
+static bool switch_wal(uint64_t wal) {
+    std::lock_guard<std::mutex> lock(store.sync_mutex);
+    if (store.fd >= 0) {
+        if (store.sync) fdatasync(store.fd);
+        close(store.fd);
+        store.synced = store.seq.load();
+    }
+    store.wal = wal;
+    store.fd = ::open(wal_path(wal).c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (store.fd < 0) return false;
+    if (store.sync) sync_directory(store.dir);
+    return true;
+}
+
+// Write the groups of a directory and the users up to user_count to a new snapshot
+static bool write_snapshot(const Directory &dir, uint32_t user_count, uint64_t wal) {
+    std::vector<uint64_t> name_end, member_start = {0};
+    std::vector<uint32_t> member_user;
+    std::string names;
+    name_end.reserve(user_count);
+    for (uint32_t user_id = 0; user_id < user_count; user_id++) {
+        names += user_ids.name(user_id);
+        name_end.push_back(names.size());
+    }
+    dir.group_members.for_each([&](size_t group_id, const std::shared_ptr<const IdSet> &members) {
+        names += group_ids.name(group_id);
+        name_end.push_back(names.size());
+        members->for_each([&](uint32_t user_id) { member_user.push_back(user_id); });
+        member_start.push_back(member_user.size());
+    });
+    SnapshotHeader header{};
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    header.version = SNAPSHOT_VERSION;
+    header.wal = wal;
+    header.users = user_count;
+    header.groups = member_start.size() - 1;
+    header.members = member_user.size();
+    header.names_bytes = names.size();
+    member_user.resize(padded(member_user.size()));
+    std::string body;
+    body.reserve(name_end.size() * 8 + member_start.size() * 8 + member_user.size() * 4 + names.size());
+    body.append((const char *)name_end.data(), name_end.size() * sizeof(uint64_t));
+    body.append((const char *)member_start.data(), member_start.size() * sizeof(uint64_t));
+    body.append((const char *)member_user.data(), member_user.size() * sizeof(uint32_t));
+    body.append(names);
+    header.checksum = snapshot_checksum(body);
+
+    std::string path = snapshot_path(), tmp = path + ".tmp";
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return false;
+    bool ok = write_all(fd, std::string_view((const char *)&header, sizeof(header))) && write_all(fd, body);
+    if (store.sync) ok = fsync(fd) == 0 && ok;
+    close(fd);
+    if (!ok || rename(tmp.c_str(), path.c_str()) < 0) {
+        unlink(tmp.c_str());
+        return false;
+    }
+    if (store.sync) sync_directory(store.dir);
+    return true;
+}
+
+bool group_store_snapshot() {
+    std::lock_guard<std::mutex> serial(store.snapshot_mutex);
+    std::unique_ptr<const Directory> frozen;
+    uint32_t user_count;
+    uint64_t wal;
+    {
+        // A copy shares the directory's chunks, writers copy those they change from now on
+        std::lock_guard<TimedMutex> lock(clients_mutex);
+        if (!store.open) return false;
+        frozen.reset(new Directory(*directory.load()));
+        user_count = user_ids.size();
+        store.since_snapshot = 0;
+        if (!switch_wal(store.wal + 1)) {
+            std::cerr << "Error: Cannot create " << wal_path(store.wal) << "." << std::endl;
+        }
+        wal = store.wal;
+    }
+    if (!write_snapshot(*frozen, user_count, wal)) {
+        std::cerr << "Error: Cannot write " << snapshot_path() << "." << std::endl;
+        return false;
+    }
+    for (; store.oldest_wal < wal; store.oldest_wal++) {
+        unlink(wal_path(store.oldest_wal).c_str());
+    }
+    stats.group_snapshots.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+static void snapshot_thread() {
+    std::unique_lock<std::mutex> lock(store.thread_mutex);
+    while (true) {
+        store.wake.wait(lock, [] { return store.stopping || store.requested; });
+        if (store.stopping) break;
+        store.requested = false;
+        lock.unlock();
+        group_store_snapshot();
+        lock.lock();
+    }
+}
+
+bool group_store_open(const std::string &dir, bool sync, size_t snapshot_every, std::string &error) {
+    auto start = std::chrono::steady_clock::now();
+    if (mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST) {
+        error = "cannot create " + dir;
+        return false;
+    }
+    DIR *listing = opendir(dir.c_str());
+    if (listing == nullptr) {
+        error = "cannot read " + dir;
+        return false;
+    }
+    std::vector<uint64_t> found;
+    while (dirent *entry = readdir(listing)) {
+        std::string_view name = entry->d_name;
+        if (name.size() == 24 && name.substr(20) == ".wal" &&
+            std::all_of(name.begin(), name.begin() + 20, [](char c) { return c >= '0' && c <= '9'; })) {
+            found.push_back(std::stoull(std::string(name.substr(0, 20))));
+        }
+    }
+    closedir(listing);
+    std::sort(found.begin(), found.end());
+
+    store.dir = dir;
+    store.sync = sync;
+    store.snapshot_every = snapshot_every;
+    Recovery state;
+    if (!load_snapshot(state, error)) return false;
+    // WALs before the snapshot's were left behind by a snapshot interrupted before its cleanup
+    auto first = std::lower_bound(found.begin(), found.end(), state.wal);
+    for (auto it = found.begin(); it != first; ++it) unlink(wal_path(*it).c_str());
+    found.erase(found.begin(), first);
+    for (size_t i = 0; i < found.size(); i++) {
+        if (!replay_wal(state, found[i], i + 1 == found.size(), error)) return false;
+    }
+
+    size_t groups = 0, memberships = 0;
+    {
+        std::lock_guard<TimedMutex> lock(clients_mutex);
+        Directory *next = new Directory(*directory.load());
+        for (uint32_t group_id = 0; group_id < state.members.size(); group_id++) {
+            if (!state.exists[group_id]) continue;
+            groups++;
+            memberships += state.members[group_id].size();
+            next->group_members.set(group_id, std::make_shared<const IdSet>(std::move(state.members[group_id])));
+            next->group_history.set(group_id, std::make_shared<GroupHistory>());
+        }
+        for (uint32_t user_id = 0; user_id < state.groups.size(); user_id++) {
+            if (state.groups[user_id].empty()) continue;
+            next->user_groups.set(user_id, std::make_shared<const IdSet>(std::move(state.groups[user_id])));
+        }
+        rcu_publish<Directory>(directory, next);
+
+        // Appends go to a fresh WAL, so replayed files are never written again
+        uint64_t wal = std::max<uint64_t>({1, state.wal, found.empty() ? 0 : found.back() + 1});
+        store.oldest_wal = found.empty() ? wal : found.front();
+        store.seq = store.synced = 0;
+        store.since_snapshot = 0;
+        if (!switch_wal(wal)) {
+            error = "cannot create " + wal_path(wal);
+            return false;
+        }
+        store.open = true;
+    }
+    if (groups > 0) {
+        auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+        std::cout << "Recovered " << groups << " groups with " << memberships << " memberships in "
+                  << elapsed.count() << " ms." << std::endl;
+    }
+
+    store.requested = store.stopping = false;
+    store.snapshotter = std::thread(snapshot_thread);
+    return true;
+}
+
+void group_store_close() {
+    {
+        std::lock_guard<std::mutex> lock(store.thread_mutex);
+        if (!store.snapshotter.joinable()) return;
+        store.stopping = true;
+        store.wake.notify_one();
+    }
+    store.snapshotter.join();
+    bool changed;
+    {
+        std::lock_guard<TimedMutex> lock(clients_mutex);
+        changed = store.seq > 0 || store.wal > store.oldest_wal;
+    }
+    // The next start then maps the snapshot and has no WAL to replay
+    if (changed) group_store_snapshot();
+    std::lock_guard<TimedMutex> lock(clients_mutex);
+    std::lock_guard<std::mutex> sync_lock(store.sync_mutex);
+    if (store.fd >= 0) {
+        if (store.sync) fdatasync(store.fd);
+        close(store.fd);
+        store.fd = -1;
+    }
+    store.open = false;
+}
+
+uint64_t group_store_append(GroupOp op, const std::string &group_name, const std::string &username) {
+    if (!store.open) return 0;
+    std::string body(1, (char)op);
+    put_string(body, group_name);
+    put_string(body, username);
+    if (store.fd < 0 || !write_all(store.fd, frame_record(body))) {
+        std::cerr << "Error: Cannot write the group log." << std::endl;
+    }
+    stats.group_wal_records.fetch_add(1, std::memory_order_relaxed);
+    if (++store.since_snapshot == store.snapshot_every) {
+        std::lock_guard<std::mutex> lock(store.thread_mutex);
+        store.requested = true;
+        store.wake.notify_one();
+    }
+    return ++store.seq;
+}
+
+void group_store_commit(uint64_t seq) {
+    if (seq == 0 || !store.sync || store.synced >= seq) return;
+    std::lock_guard<std::mutex> lock(store.sync_mutex);
+    // Whoever synced while we waited for the lock may have covered us
+    if (store.synced >= seq || store.fd < 0) return;
+    uint64_t target = store.seq;
+    fdatasync(store.fd);
+    stats.group_wal_fsyncs.fetch_add(1, std::memory_order_relaxed);
+    store.synced = target;
+}
@@ -0,0 +1,41 @@
+#ifndef GROUPSTORE_H
+#define GROUPSTORE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Groups and their members, made durable so that they survive a restart.
+//
+// The state directory holds one snapshot and the write-ahead logs that follow it:
+//
+//   groups.snap                   every group and its members as of the start of one WAL (layout in groupstore.cpp)
+//   00000000000000000001.wal ...  operations applied since, framed as in record.h:
+//       body: uint8_t GROUP_CREATE | GROUP_JOIN | GROUP_LEAVE, uint32_t len, group, uint32_t len, username
+//
+// Operations are appended under clients_mutex in the order they were applied, and made durable
+// by one fdatasync() shared by every caller waiting at that moment (group commit). After
+// `snapshot_every` operations a background thread switches to a new WAL, writes the directory as
+// of the switch to a new snapshot, renames it into place and deletes the WALs it covers.
+// Recovery maps the snapshot, builds every member set in one pass and replays the WALs after it.
+
+enum GroupOp : uint8_t { GROUP_CREATE = 1, GROUP_JOIN = 2, GROUP_LEAVE = 3 };
+
+// Load the snapshot and WALs in dir (created if missing) into the directory and open a new WAL.
+// Called before any client connects.
+bool group_store_open(const std::string &dir, bool sync, size_t snapshot_every, std::string &error);
+
+// Write a snapshot if anything changed since the last one, then close the WAL
+void group_store_close();
+
+// Log an operation that was just applied (caller holds clients_mutex), returns the sequence
+// number to wait for with group_store_commit(), 0 if the store is not open
+uint64_t group_store_append(GroupOp op, const std::string &group_name, const std::string &username);
+
+// Wait until the operation with this sequence number is on disk (caller must not hold clients_mutex)
+void group_store_commit(uint64_t seq);
+
+// Write a snapshot now, returns false on failure
+bool group_store_snapshot();
+
+#endif // GROUPSTORE_H
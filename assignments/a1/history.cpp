@@ -0,0 +1,36 @@
+#include "history.h"
+
+void GroupHistory::append(const Payload &message) {
+    if (message.size() > HISTORY_BYTES) return;
+    std::lock_guard<std::mutex> lock(mutex_);
+    while (count_ == HISTORY_MESSAGES || bytes_ + message.size() > HISTORY_BYTES) {
+        bytes_ -= ring_[head_].size();
+        ring_[head_] = Payload();
+        head_ = (head_ + 1) % HISTORY_MESSAGES;
+        count_--;
+    }
+    ring_[(head_ + count_) % HISTORY_MESSAGES] = message;
+    count_++;
+    bytes_ += message.size();
+}
+
+std::vector<Payload> GroupHistory::recent(size_t n) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (n == 0 || n > count_) n = count_;
+    std::vector<Payload> messages;
+    messages.reserve(n);
+    for (size_t i = count_ - n; i < count_; i++) {
+        messages.push_back(ring_[(head_ + i) % HISTORY_MESSAGES]);
+    }
+    return messages;
+}
+
+size_t GroupHistory::size() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return count_;
+}
+
+size_t GroupHistory::bytes() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return bytes_;
+}
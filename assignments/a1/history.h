@@ -0,0 +1,34 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+#include "payload.h"
+
+#define HISTORY_MESSAGES 100       // Messages kept per group
+#define HISTORY_BYTES (64 << 10)   // Message bytes kept per group, larger messages are not kept
+
+// Recent messages of one group, in a fixed ring of slots. Each slot holds the formatted payload
+// that was multicast to the members, so keeping a message copies nothing and replaying it
+// queues the same buffer again. The oldest messages are dropped to stay within both limits.
+class GroupHistory {
+   public:
+    void append(const Payload &message);
+
+    // The last n messages (all if n is 0), oldest first
+    std::vector<Payload> recent(size_t n) const;
+
+    size_t size() const;
+    size_t bytes() const;
+
+   private:
+    mutable std::mutex mutex_;
+    Payload ring_[HISTORY_MESSAGES];
+    size_t head_ = 0;   // Slot of the oldest message
+    size_t count_ = 0;
+    size_t bytes_ = 0;
+};
+
+#endif // HISTORY_H
@@ -0,0 +1,228 @@
+#ifndef IDS_H
+#define IDS_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+constexpr uint32_t NO_ID = UINT32_MAX;
+
+// Assigns dense integer ids to names, so hot paths index vectors instead of hashing strings.
+// Insert-only: intern() calls must be serialized, find() and name() may run concurrently with
+// them without a lock. Tables outgrown by intern() are kept until clear() so that a reader
+// still probing one stays valid; together they are smaller than the current table.
+class Interner {
+    static constexpr size_t CHUNK = 4096;       // Ids per chunk of the id -> name index
+    static constexpr size_t MAX_CHUNKS = 1024;
+
+   public:
+    static constexpr size_t MAX_NAMES = CHUNK * MAX_CHUNKS;  // 4M
+
+    // Holds up to `capacity` names (at most MAX_NAMES). Names are never removed, so callers
+    // must handle a full interner.
+    explicit Interner(size_t capacity = MAX_NAMES) : capacity_(std::min(capacity, MAX_NAMES)) { table_.store(new_table(64)); }
+    ~Interner() { release(); }
+    Interner(const Interner &) = delete;
+    Interner &operator=(const Interner &) = delete;
+
+    // Returns the id of the name, assigning the next free one if it is new, or NO_ID if it is new
+    // and the interner is full (writers only)
+    uint32_t intern(std::string_view name) {
+        uint32_t id = find(name);
+        if (id != NO_ID) return id;
+        id = size_.load(std::memory_order_relaxed);
+        if (id >= capacity_) return NO_ID;
+        if (chunks_[id / CHUNK].load(std::memory_order_relaxed) == nullptr) {
+            chunks_[id / CHUNK].store(new std::atomic<const Entry *>[CHUNK](), std::memory_order_release);
+        }
+        const Entry *entry = new Entry{std::string(name), id, std::hash<std::string_view>()(name)};
+        chunks_[id / CHUNK].load(std::memory_order_relaxed)[id % CHUNK].store(entry, std::memory_order_release);
+
+        Table *table = table_.load(std::memory_order_relaxed);
+        if ((id + 1) * 2 > table->capacity) {
+            table = new_table(table->capacity * 2);
+            for (uint32_t i = 0; i < id; i++) place(table, entry_at(i));
+            place(table, entry);
+            table_.store(table, std::memory_order_release);
+        } else {
+            place(table, entry);
+        }
+        size_.store(id + 1, std::memory_order_release);
+        return id;
+    }
+
+    // Id of a name, NO_ID if it was never interned
+    uint32_t find(std::string_view name) const {
+        const Table *table = table_.load(std::memory_order_acquire);
+        size_t hash = std::hash<std::string_view>()(name);
+        for (size_t i = hash & (table->capacity - 1);; i = (i + 1) & (table->capacity - 1)) {
+            const Entry *entry = table->slots[i].load(std::memory_order_acquire);
+            if (entry == nullptr) return NO_ID;
+            if (entry->hash == hash && entry->name == name) return entry->id;
+        }
+    }
+
+    // Name of an id handed out by intern() or find()
+    const std::string &name(uint32_t id) const { return entry_at(id)->name; }
+    size_t size() const { return size_.load(std::memory_order_acquire); }
+
+    // Forget every name (no concurrent readers allowed)
+    void clear() {
+        release();
+        table_.store(new_table(64));
+    }
+
+   private:
+    struct Entry {
+        std::string name;
+        uint32_t id;
+        size_t hash;
+    };
+
+    struct Table {
+        size_t capacity;
+        std::unique_ptr<std::atomic<const Entry *>[]> slots;
+    };
+
+    Table *new_table(size_t capacity) {
+        tables_.push_back(std::make_unique<Table>(Table{capacity, std::make_unique<std::atomic<const Entry *>[]>(capacity)}));
+        return tables_.back().get();
+    }
+
+    static void place(Table *table, const Entry *entry) {
+        size_t i = entry->hash & (table->capacity - 1);
+        while (table->slots[i].load(std::memory_order_relaxed) != nullptr) i = (i + 1) & (table->capacity - 1);
+        table->slots[i].store(entry, std::memory_order_release);
+    }
+
+    const Entry *entry_at(uint32_t id) const {
+        return chunks_[id / CHUNK].load(std::memory_order_acquire)[id % CHUNK].load(std::memory_order_acquire);
+    }
+
+    void release() {
+        for (uint32_t id = 0; id < size(); id++) delete entry_at(id);
+        for (auto &chunk : chunks_) delete[] chunk.exchange(nullptr);
+        tables_.clear();
+        size_.store(0);
+    }
+
+    size_t capacity_;
+    std::atomic<Table *> table_;
+    std::atomic<std::atomic<const Entry *> *> chunks_[MAX_CHUNKS] = {};
+    std::atomic<uint32_t> size_{0};
+    std::vector<std::unique_ptr<Table>> tables_;  // Current table last
+};
+
+// Set of dense ids. Small sets are a sorted vector (4 bytes per member, contiguous iteration);
+// once a set is large and at least 1/32 dense it becomes a bitmap over the id space.
+class IdSet {
+   public:
+    static constexpr size_t BITMAP_MIN = 1024;  // Members before a bitmap is considered
+
+    IdSet() = default;
+
+    // Set of ids given in increasing order without duplicates, built in one pass
+    static IdSet from_sorted(std::vector<uint32_t> ids) {
+        IdSet set;
+        set.count_ = ids.size();
+        set.sorted_ = std::move(ids);
+        if (set.dense()) set.to_bitmap();
+        return set;
+    }
+
+    bool insert(uint32_t id) {
+        if (bitmap_) {
+            if (id / 64 >= bits_.size()) bits_.resize(id / 64 + 1, 0);
+            uint64_t mask = (uint64_t)1 << (id % 64);
+            if (bits_[id / 64] & mask) return false;
+            bits_[id / 64] |= mask;
+            count_++;
+            return true;
+        }
+        auto it = std::lower_bound(sorted_.begin(), sorted_.end(), id);
+        if (it != sorted_.end() && *it == id) return false;
+        sorted_.insert(it, id);
+        count_++;
+        if (dense()) to_bitmap();
+        return true;
+    }
+
+    bool erase(uint32_t id) {
+        if (bitmap_) {
+            uint64_t mask = (uint64_t)1 << (id % 64);
+            if (id / 64 >= bits_.size() || !(bits_[id / 64] & mask)) return false;
+            bits_[id / 64] &= ~mask;
+            count_--;
+            if (count_ < BITMAP_MIN / 2) to_sorted();
+            return true;
+        }
+        auto it = std::lower_bound(sorted_.begin(), sorted_.end(), id);
+        if (it == sorted_.end() || *it != id) return false;
+        sorted_.erase(it);
+        count_--;
+        return true;
+    }
+
+    bool contains(uint32_t id) const {
+        if (bitmap_) return id / 64 < bits_.size() && (bits_[id / 64] >> (id % 64)) & 1;
+        return std::binary_search(sorted_.begin(), sorted_.end(), id);
+    }
+
+    size_t size() const { return count_; }
+    bool empty() const { return count_ == 0; }
+    bool is_bitmap() const { return bitmap_; }
+
+    // Bytes allocated for the members
+    size_t memory_usage() const {
+        return bitmap_ ? bits_.capacity() * sizeof(uint64_t) : sorted_.capacity() * sizeof(uint32_t);
+    }
+
+    // Calls f(id) for every member in increasing id order
+    template <typename F>
+    void for_each(F &&f) const {
+        if (!bitmap_) {
+            for (uint32_t id : sorted_) f(id);
+            return;
+        }
+        for (size_t word = 0; word < bits_.size(); word++) {
+            for (uint64_t bits = bits_[word]; bits != 0; bits &= bits - 1) {
+                f((uint32_t)(word * 64 + __builtin_ctzll(bits)));
+            }
+        }
+    }
+
+   private:
+    // Large enough, and the bitmap would take no more memory than the sorted ids
+    bool dense() const {
+        return count_ >= BITMAP_MIN && (sorted_.back() / 64 + 1) * sizeof(uint64_t) <= count_ * sizeof(uint32_t);
+    }
+
+    void to_bitmap() {
+        bits_.assign(sorted_.back() / 64 + 1, 0);
+        for (uint32_t id : sorted_) bits_[id / 64] |= (uint64_t)1 << (id % 64);
+        std::vector<uint32_t>().swap(sorted_);
+        bitmap_ = true;
+    }
+
+    void to_sorted() {
+        std::vector<uint32_t> ids;
+        ids.reserve(count_);
+        for_each([&](uint32_t id) { ids.push_back(id); });
+        sorted_.swap(ids);
+        std::vector<uint64_t>().swap(bits_);
+        bitmap_ = false;
+    }
+
+    std::vector<uint32_t> sorted_;
+    std::vector<uint64_t> bits_;
+    size_t count_ = 0;
+    bool bitmap_ = false;
+};
+
+#endif // IDS_H
@@ -0,0 +1,237 @@
+#include "metrics.h"
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <iterator>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "record.h"
+#include "server_grp.h"
+
+// Everything one thread records. Aligned so that neighbouring slots never share a cache line.
+struct alignas(64) MetricSlot {
+    Histogram commands[METRIC_COMMANDS];  // Nanoseconds per command
+    Histogram fanout;                     // Recipients per message
+    Histogram send_queue;                 // Outbound queue bytes after an enqueue
+    Histogram lock_wait;                  // Nanoseconds waited for clients_mutex
+    Histogram lock_hold;                  // Nanoseconds clients_mutex was held
+    std::atomic<uint64_t> bytes_sent{0};
+};
+
+// Every slot ever handed out, and those whose thread exited. Never freed: detached threads may
+// record until the process exits.
+static std::mutex slots_mutex;
+static std::vector<MetricSlot *> &slots = *new std::vector<MetricSlot *>;
+static std::vector<MetricSlot *> &free_slots = *new std::vector<MetricSlot *>;
+static std::atomic<bool> enabled{true};
+
+static const char *command_names[] = {
+    "unknown",      "/broadcast",  "/msg",           "/group_msg", "/create_group", "/join_group", "/leave_group",
+    "/list_members", "/list_groups", "/list_commands", "/history",   "/pong",         "/stats",      "/exit",
+};
+static_assert(std::size(command_names) == (size_t)Command::EXIT + 1, "a command has no metric name");
+static_assert(std::size(command_names) <= METRIC_COMMANDS);
+
+// The slot of a thread, taken on its first record and given back when it exits with what it
+// recorded, which the next thread to record adds to
+struct SlotLease {
+    MetricSlot *slot = nullptr;
+
+    ~SlotLease() {
+        if (slot == nullptr) return;
+        std::lock_guard<std::mutex> lock(slots_mutex);
+        free_slots.push_back(slot);
+    }
+};
+
+static MetricSlot &slot() {
+    thread_local SlotLease lease;
+    if (lease.slot == nullptr) {
+        std::lock_guard<std::mutex> lock(slots_mutex);
+        if (free_slots.empty()) {
+            slots.push_back(new MetricSlot);
+            lease.slot = slots.back();
+        } else {
+            lease.slot = free_slots.back();
+            free_slots.pop_back();
+        }
+    }
+    return *lease.slot;
+}
+
+static uint64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void HistogramSnapshot::add(const Histogram &histogram) {
+    for (int i = 0; i < Histogram::BUCKETS; i++) {
+        uint64_t n = histogram.counts_[i].load(std::memory_order_relaxed);
+        counts[i] += n;
+        count += n;
+    }
+    sum += histogram.sum_.load(std::memory_order_relaxed);
+    max = std::max(max, histogram.max_.load(std::memory_order_relaxed));
+}
+
+uint64_t HistogramSnapshot::quantile(double q) const {
+    uint64_t rank = std::max<uint64_t>(1, (uint64_t)std::ceil(q * count));
+    uint64_t seen = 0;
+    for (int i = 0; i < Histogram::BUCKETS; i++) {
+        seen += counts[i];
+        if (seen >= rank) return std::min(Histogram::bucket_max(i), max);
+    }
+    return max;
+}
+
+void TimedMutex::lock() {
+    if (!enabled.load(std::memory_order_relaxed)) {
+        mutex_.lock();
+        acquired_ns_ = 0;
+        return;
+    }
+    uint64_t start = now_ns();
+    mutex_.lock();
+    acquired_ns_ = now_ns();
+    slot().lock_wait.record(acquired_ns_ - start);
+}
+
+bool TimedMutex::try_lock() {
+    if (!mutex_.try_lock()) return false;
+    acquired_ns_ = enabled.load(std::memory_order_relaxed) ? now_ns() : 0;
+    return true;
+}
+
+void TimedMutex::unlock() {
+    uint64_t acquired = acquired_ns_;
+    if (acquired != 0) slot().lock_hold.record(now_ns() - acquired);
+    mutex_.unlock();
+}
+
+void metrics_enable(bool on) {
+    enabled = on;
+}
+
+void metrics_command(unsigned command, uint64_t ns) {
+    if (enabled.load(std::memory_order_relaxed)) slot().commands[command].record(ns);
+}
+
+void metrics_sent(size_t recipients, size_t bytes) {
+    if (!enabled.load(std::memory_order_relaxed)) return;
+    MetricSlot &mine = slot();
+    mine.fanout.record(recipients);
+    mine.bytes_sent.fetch_add(recipients * bytes, std::memory_order_relaxed);
+}
+
+void metrics_send_queue(size_t bytes) {
+    if (enabled.load(std::memory_order_relaxed)) slot().send_queue.record(bytes);
+}
+
+// One summary: its quantiles, _sum and _count, labelled with `labels` (empty or `name="value"`)
+static void render(std::string &out, const char *name, const std::string &labels, const HistogramSnapshot &snapshot) {
+    static const char *quantiles[] = {"0.5", "0.9", "0.99", "0.999", "1"};
+    std::string prefix = labels.empty() ? "{" : "{" + labels + ",";
+    for (const char *q : quantiles) {
+        out += name + prefix + "quantile=\"" + q + "\"} " + std::to_string(snapshot.quantile(std::atof(q))) + "\n";
+    }
+    std::string suffix = labels.empty() ? " " : "{" + labels + "} ";
+    out += std::string(name) + "_sum" + suffix + std::to_string(snapshot.sum) + "\n";
+    out += std::string(name) + "_count" + suffix + std::to_string(snapshot.count) + "\n";
+}
+
+std::string metrics_report() {
+    // The histograms are large, keep the merged copies off the stack of the event loop
+    auto commands = std::make_unique<HistogramSnapshot[]>(METRIC_COMMANDS);
+    auto others = std::make_unique<HistogramSnapshot[]>(4);
+    uint64_t bytes_sent = 0;
+    std::vector<MetricSlot *> merged;
+    {
+        std::lock_guard<std::mutex> lock(slots_mutex);
+        merged = slots;
+    }
+    for (size_t i = 0; i < merged.size(); i++) {
+        const MetricSlot &from = *merged[i];
+        for (int c = 0; c < METRIC_COMMANDS; c++) commands[c].add(from.commands[c]);
+        others[0].add(from.fanout);
+        others[1].add(from.send_queue);
+        others[2].add(from.lock_wait);
+        others[3].add(from.lock_hold);
+        bytes_sent += from.bytes_sent.load(std::memory_order_relaxed);
+    }
+
+    std::string out = "# TYPE server_command_ns summary\n";
+    for (size_t c = 0; c < std::size(command_names); c++) {
+        if (commands[c].count > 0) render(out, "server_command_ns", std::string("command=\"") + command_names[c] + "\"", commands[c]);
+    }
+    out += "# TYPE server_fanout_recipients summary\n";
+    render(out, "server_fanout_recipients", "", others[0]);
+    out += "# TYPE server_sent_bytes counter\nserver_sent_bytes " + std::to_string(bytes_sent) + "\n";
+    out += "# TYPE server_send_queue_bytes summary\n";
+    render(out, "server_send_queue_bytes", "", others[1]);
+    out += "# TYPE server_clients_mutex_wait_ns summary\n";
+    render(out, "server_clients_mutex_wait_ns", "", others[2]);
+    out += "# TYPE server_clients_mutex_hold_ns summary\n";
+    render(out, "server_clients_mutex_hold_ns", "", others[3]);
+    return out;
+}
+
+// The endpoint thread stays blocked in accept() until the socket is closed, so its state is never destroyed
+struct MetricsEndpoint {
+    int listen_fd = -1;
+    std::string path;
+};
+
+static MetricsEndpoint &endpoint = *new MetricsEndpoint;
+
+static void serve_metrics(int listen_fd) {
+    while (true) {
+        int fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            return;  // Closed by metrics_close()
+        }
+        write_all(fd, metrics_report());
+        close(fd);
+    }
+}
+
+bool metrics_listen(const std::string &path, std::string &error) {
+    sockaddr_un addr{};
+    if (path.size() >= sizeof(addr.sun_path)) {
+        error = "socket path " + path + " is too long";
+        return false;
+    }
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    unlink(path.c_str());
+    // Only the owner may read the metrics
+    mode_t mask = umask(0077);
+    bool bound = fd >= 0 && bind(fd, (sockaddr *)&addr, sizeof(addr)) == 0;
+    umask(mask);
+    if (!bound || listen(fd, 16) < 0) {
+        error = "cannot listen on " + path + ": " + strerror(errno);
+        if (fd >= 0) close(fd);
+        return false;
+    }
+    endpoint.listen_fd = fd;
+    endpoint.path = path;
+    std::thread(serve_metrics, fd).detach();
+    return true;
+}
+
+void metrics_close() {
+    if (endpoint.listen_fd < 0) return;
+    shutdown(endpoint.listen_fd, SHUT_RDWR);  // Wakes the endpoint thread
+    close(endpoint.listen_fd);
+    endpoint.listen_fd = -1;
+    unlink(endpoint.path.c_str());
+}
@@ -0,0 +1,104 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+// Latency and size distributions recorded by the server threads, merged on demand.
+//
+// Every thread writes to a slot of its own, taken when it first records: event loops, auth
+// workers, the log writer and thread-per-client threads alike. Recording is a few uncontended
+// relaxed atomic adds. A thread that exits leaves its slot, counts and all, to the next new thread,
+// so there are never more slots than threads alive at once. A report merges the slots into one
+// snapshot and renders it in the Prometheus text format: summaries with the 0.5, 0.9, 0.99 and
+// 0.999 quantiles, quantile 1 being the maximum, plus _sum and _count.
+
+#define METRIC_COMMANDS 16  // Room for every Command, indexed by its value
+
+// Log-linear histogram in the style of HdrHistogram: exact below 8, then 8 buckets per power of
+// two, so any recorded value is known within 12.5%
+class Histogram {
+   public:
+    static constexpr int SUB_BITS = 3;
+    static constexpr int SUB_BUCKETS = 1 << SUB_BITS;
+    static constexpr int BUCKETS = (64 - SUB_BITS + 1) * SUB_BUCKETS;
+
+    static int bucket(uint64_t value) {
+        if (value < SUB_BUCKETS) return value;
+        int exponent = 63 - __builtin_clzll(value);
+        return (exponent - SUB_BITS + 1) * SUB_BUCKETS + ((value >> (exponent - SUB_BITS)) & (SUB_BUCKETS - 1));
+    }
+
+    // Largest value that falls into a bucket
+    static uint64_t bucket_max(int index) {
+        if (index < SUB_BUCKETS) return index;
+        int exponent = index / SUB_BUCKETS + SUB_BITS - 1;
+        uint64_t low = (uint64_t)(SUB_BUCKETS + index % SUB_BUCKETS) << (exponent - SUB_BITS);
+        return low + (1ull << (exponent - SUB_BITS)) - 1;
+    }
+
+    void record(uint64_t value) {
+        counts_[bucket(value)].fetch_add(1, std::memory_order_relaxed);
+        sum_.fetch_add(value, std::memory_order_relaxed);
+        uint64_t max = max_.load(std::memory_order_relaxed);
+        while (value > max && !max_.compare_exchange_weak(max, value, std::memory_order_relaxed)) {
+        }
+    }
+
+   private:
+    friend struct HistogramSnapshot;
+    std::atomic<uint64_t> counts_[BUCKETS] = {};
+    std::atomic<uint64_t> sum_{0};
+    std::atomic<uint64_t> max_{0};
+};
+
+// Sum of histograms, read from the slots without stopping the writers. count is the total of
+// the buckets, so it always agrees with the quantiles (no separate counter to keep up on record)
+struct HistogramSnapshot {
+    uint64_t counts[Histogram::BUCKETS] = {};
+    uint64_t count = 0;
+    uint64_t sum = 0;
+    uint64_t max = 0;
+
+    void add(const Histogram &histogram);
+    // Smallest bucket bound that at least a fraction q of the values do not exceed
+    uint64_t quantile(double q) const;
+};
+
+// std::mutex that records how long lockers waited for it and how long they held it
+class TimedMutex {
+   public:
+    void lock();
+    void unlock();
+    bool try_lock();
+
+   private:
+    std::mutex mutex_;
+    uint64_t acquired_ns_ = 0;  // Written by the holder only
+};
+
+// Turn recording on or off (on by default), for measuring its cost
+void metrics_enable(bool enabled);
+
+// Time taken by one command, by its Command value
+void metrics_command(unsigned command, uint64_t ns);
+
+// One message sent to `recipients` clients
+void metrics_sent(size_t recipients, size_t bytes);
+
+// Bytes waiting in an event loop connection's outbound queue, sampled on each enqueue
+void metrics_send_queue(size_t bytes);
+
+// Merge the slots and render them, one metric per line
+std::string metrics_report();
+
+// Serve metrics_report() to every connection on a Unix socket (mode 0600)
+bool metrics_listen(const std::string &path, std::string &error);
+
+// Stop serving and remove the Unix socket
+void metrics_close();
+
+#endif // METRICS_H
@@ -0,0 +1,38 @@
+#ifndef MPSC_QUEUE_H
+#define MPSC_QUEUE_H
+
+#include <atomic>
+
+// Lock-free multi-producer single-consumer queue of intrusive nodes (T needs a `T *next` member).
+// Producers push onto a Treiber stack; the consumer takes the whole stack at once and reverses it,
+// so every producer's items come out in the order it pushed them.
+template <typename T>
+class MpscQueue {
+   public:
+    // Returns true if the queue was empty, i.e. the consumer may need a wake-up
+    bool push(T *node) {
+        T *head = head_.load(std::memory_order_relaxed);
+        do {
+            node->next = head;
+        } while (!head_.compare_exchange_weak(head, node, std::memory_order_release, std::memory_order_relaxed));
+        return head == nullptr;
+    }
+
+    // Takes every queued node, oldest first, as a singly linked list
+    T *pop_all() {
+        T *node = head_.exchange(nullptr, std::memory_order_acquire);
+        T *ordered = nullptr;
+        while (node != nullptr) {
+            T *next = node->next;
+            node->next = ordered;
+            ordered = node;
+            node = next;
+        }
+        return ordered;
+    }
+
+   private:
+    std::atomic<T *> head_{nullptr};
+};
+
+#endif // MPSC_QUEUE_H
@@ -0,0 +1,364 @@
+#include "msglog.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+
+#include "payload.h"
+#include "record.h"
+#include "server_grp.h"
+
+struct BacklogEntry {
+    Payload message;   // Shared by every recipient of a group message
+    uint64_t segment;  // Segment holding the record, kept until the entry is delivered
+};
+
+// A record waiting for the writer
+struct LogItem {
+    uint64_t segment;
+    std::string record;
+    std::function<void()> on_durable;
+};
+
+struct MessageLog {
+    std::mutex mutex;
+    std::condition_variable ready;    // Records were queued, or the log is closing
+    std::condition_variable written;  // The writer finished a batch
+    std::unordered_map<std::string, std::deque<BacklogEntry>> backlog;
+    std::map<uint64_t, uint64_t> live;  // Undelivered backlog entries per segment
+    std::deque<uint64_t> segments;      // Segments on disk or being written, oldest first
+    std::vector<LogItem> pending;
+    uint64_t segment = 0;               // Segment of the next record
+    size_t segment_bytes = 0;           // Size of that segment once everything queued is written
+    uint64_t queued = 0, done = 0;      // Records queued, records written
+    std::string dir;
+    bool sync = false;
+    bool open = false, stopping = false;
+    std::thread writer;
+    // Writer thread only
+    int fd = -1;
+    uint64_t fd_segment = 0;
+};
+
+static MessageLog msglog;
+
+static std::string segment_path(uint64_t segment) {
+    char name[32];
+    snprintf(name, sizeof(name), "/%020llu.log", (unsigned long long)segment);
+    return msglog.dir + name;
+}
+
+// Backlog bookkeeping, the caller holds msglog.mutex
+
+static void add_entry(const std::string &username, const Payload &message, uint64_t segment) {
+    std::deque<BacklogEntry> &entries = msglog.backlog[username];
+    entries.push_back({message, segment});
+    msglog.live[segment]++;
+    if (entries.size() > MAX_BACKLOG) {
+        msglog.live[entries.front().segment]--;
+        entries.pop_front();
+    }
+}
+
+static size_t clear_entries(const std::string &username, std::string *out) {
+    auto it = msglog.backlog.find(username);
+    if (it == msglog.backlog.end()) return 0;
+    size_t count = it->second.size();
+    for (const BacklogEntry &entry : it->second) {
+        if (out != nullptr) out->append(entry.message.data(), entry.message.size()).push_back('\n');
+        msglog.live[entry.segment]--;
+    }
+    msglog.backlog.erase(it);
+    return count;
+}
+
+// Queue a record for the writer, returns the segment it goes to
+static uint64_t queue_record(std::string_view body, std::function<void()> on_durable) {
+    std::string record = frame_record(body);
+    if (msglog.segment_bytes > 0 && msglog.segment_bytes + record.size() > LOG_SEGMENT_SIZE) {
+        msglog.segments.push_back(++msglog.segment);
+        msglog.segment_bytes = 0;
+    }
+    msglog.segment_bytes += record.size();
+    msglog.pending.push_back({msglog.segment, std::move(record), std::move(on_durable)});
+    msglog.queued++;
+    msglog.ready.notify_one();
+    return msglog.segment;
+}
+
+// Delete the oldest segments once nothing in them is waiting for delivery. Only the front is
+// deleted: a delivery record may cover messages in earlier segments, which must not come back.
+static void prune_segments(uint64_t below) {
+    while (!msglog.segments.empty() && msglog.segments.front() < below && msglog.live[msglog.segments.front()] == 0) {
+        unlink(segment_path(msglog.segments.front()).c_str());
+        msglog.live.erase(msglog.segments.front());
+        msglog.segments.pop_front();
+    }
+}
+
+// Apply one record read back from disk, returns false if its body is malformed
+static bool replay_record(std::string_view body, uint64_t segment) {
+    RecordReader reader{body};
+    uint8_t type;
+    std::string_view name, message;
+    if (!reader.get(type)) return false;
+    switch ((LogRecordType)type) {
+    case LOG_MESSAGE: {
+        uint32_t count;
+        if (!reader.get(count)) return false;
+        std::vector<std::string_view> recipients;
+        for (uint32_t i = 0; i < count; i++) {
+            if (!reader.get(name)) return false;
+            recipients.push_back(name);
+        }
+        if (!reader.get(message)) return false;
+        Payload payload(message.data(), message.size());
+        for (std::string_view recipient : recipients) {
+            add_entry(std::string(recipient), payload, segment);
+        }
+        return true;
+    }
+    case LOG_DELIVERED:
+        if (!reader.get(name)) return false;
+        clear_entries(std::string(name), nullptr);
+        return true;
+    }
+    return false;
+}
+
+// Map a segment and replay its records. A damaged tail is cut off if this is the last segment.
+static bool replay_segment(uint64_t segment, bool last, std::string &error) {
+    std::string path = segment_path(segment);
+    int fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+    struct stat st {};
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        if (fd >= 0) close(fd);
+        error = "cannot open " + path;
+        return false;
+    }
+    msglog.segments.push_back(segment);
+    size_t size = st.st_size, pos = 0;
+    if (size > 0) {
+        void *base = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (base == MAP_FAILED) {
+            close(fd);
+            error = "cannot map " + path;
+            return false;
+        }
+        pos = scan_records(std::string_view((const char *)base, size),
+                           [segment](std::string_view body) { return replay_record(body, segment); });
+        munmap(base, size);
+    }
+    if (pos < size) {
+        if (!last) {
+            close(fd);
+            error = path + " is corrupt";
+            return false;
+        }
+        std::cerr << "Warning: Dropping " << size - pos << " damaged bytes at the end of " << path << "." << std::endl;
+        if (ftruncate(fd, pos) < 0) {
+            close(fd);
+            error = "cannot truncate " + path;
+            return false;
+        }
+    }
+    close(fd);
+    return true;
+}
+
+// Make a segment the one records are written to (writer thread)
+static bool switch_segment(uint64_t segment) {
+    if (msglog.fd >= 0) {
+        if (msglog.sync) fdatasync(msglog.fd);
+        close(msglog.fd);
+    }
+    msglog.fd_segment = segment;
+    msglog.fd = ::open(segment_path(segment).c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (msglog.fd < 0) return false;
+    // The new name must be durable too
+    if (msglog.sync) sync_directory(msglog.dir);
+    return true;
+}
+
+// Write a batch with one write() per segment and at most one fdatasync()
+static bool write_batch(const std::vector<LogItem> &batch) {
+    std::string buffer;
+    bool ok = true;
+    for (const LogItem &item : batch) {
+        if (msglog.fd < 0 || item.segment != msglog.fd_segment) {
+            if (!buffer.empty()) ok = write_all(msglog.fd, buffer) && ok;
+            buffer.clear();
+            ok = switch_segment(item.segment) && ok;
+        }
+        buffer += item.record;
+        stats.log_bytes.fetch_add(item.record.size(), std::memory_order_relaxed);
+    }
+    if (msglog.fd < 0) return false;
+    ok = write_all(msglog.fd, buffer) && ok;
+    if (msglog.sync) {
+        ok = fdatasync(msglog.fd) == 0 && ok;
+        stats.log_fsyncs.fetch_add(1, std::memory_order_relaxed);
+    }
+    stats.log_records.fetch_add(batch.size(), std::memory_order_relaxed);
+    stats.log_batches.fetch_add(1, std::memory_order_relaxed);
+    return ok;
+}
+
+static void log_writer() {
+    std::unique_lock<std::mutex> lock(msglog.mutex);
+    while (true) {
+        msglog.ready.wait(lock, [] { return msglog.stopping || !msglog.pending.empty(); });
+        if (msglog.pending.empty()) break;
+        std::vector<LogItem> batch;
+        batch.swap(msglog.pending);
+        uint64_t end = msglog.queued;
+
+        lock.unlock();
+        if (!write_batch(batch)) {
+            std::cerr << "Error: Cannot write the message log." << std::endl;
+        }
+        lock.lock();
+        msglog.done = end;
+        prune_segments(msglog.fd_segment);
+        msglog.written.notify_all();
+
+        lock.unlock();
+        for (LogItem &item : batch) {
+            if (item.on_durable) item.on_durable();
+        }
+        lock.lock();
+    }
+    if (msglog.fd >= 0) {
+        if (msglog.sync) fdatasync(msglog.fd);
+        close(msglog.fd);
+        msglog.fd = -1;
+    }
+}
+
+bool log_open(const std::string &dir, bool sync, std::string &error) {
+    std::lock_guard<std::mutex> lock(msglog.mutex);
+    if (mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST) {
+        error = "cannot create " + dir;
+        return false;
+    }
+    DIR *listing = opendir(dir.c_str());
+    if (listing == nullptr) {
+        error = "cannot read " + dir;
+        return false;
+    }
+    std::vector<uint64_t> found;
+    while (dirent *entry = readdir(listing)) {
+        std::string_view name = entry->d_name;
+        if (name.size() == 24 && name.substr(20) == ".log" &&
+            std::all_of(name.begin(), name.begin() + 20, [](char c) { return c >= '0' && c <= '9'; })) {
+            found.push_back(std::stoull(std::string(name.substr(0, 20))));
+        }
+    }
+    closedir(listing);
+    std::sort(found.begin(), found.end());
+
+    msglog.dir = dir;
+    msglog.sync = sync;
+    for (size_t i = 0; i < found.size(); i++) {
+        if (!replay_segment(found[i], i + 1 == found.size(), error)) return false;
+    }
+    // Appends go to a fresh segment, so replayed files are never written again
+    msglog.segment = found.empty() ? 1 : found.back() + 1;
+    msglog.segment_bytes = 0;
+    msglog.segments.push_back(msglog.segment);
+    prune_segments(msglog.segment);
+
+    msglog.open = true;
+    msglog.stopping = false;
+    msglog.writer = std::thread(log_writer);
+    return true;
+}
+
+void log_close() {
+    {
+        std::lock_guard<std::mutex> lock(msglog.mutex);
+        if (!msglog.open) return;
+        msglog.stopping = true;
+        msglog.ready.notify_one();
+    }
+    msglog.writer.join();
+    std::lock_guard<std::mutex> lock(msglog.mutex);
+    msglog.open = false;
+    msglog.backlog.clear();
+    msglog.live.clear();
+    msglog.segments.clear();
+    msglog.queued = msglog.done = 0;
+}
+
+void store_offline(const std::vector<std::string> &recipients, const std::string &message,
+                   std::function<void()> on_durable) {
+    if (recipients.empty()) return;
+    Payload payload(message);
+    {
+        std::lock_guard<std::mutex> lock(msglog.mutex);
+        uint64_t segment = 0;
+        if (msglog.open) {
+            std::string body(1, (char)LOG_MESSAGE);
+            put_u32(body, recipients.size());
+            for (const std::string &recipient : recipients) {
+                put_string(body, recipient);
+            }
+            put_string(body, message);
+            segment = queue_record(body, std::move(on_durable));
+        }
+        for (const std::string &recipient : recipients) {
+            add_entry(recipient, payload, segment);
+        }
+        if (msglog.open) on_durable = nullptr;
+    }
+    stats.offline_stored.fetch_add(recipients.size(), std::memory_order_relaxed);
+    if (on_durable) on_durable();
+}
+
+std::string take_backlog(const std::string &username) {
+    std::string messages;
+    size_t count;
+    {
+        std::lock_guard<std::mutex> lock(msglog.mutex);
+        count = clear_entries(username, &messages);
+        if (count > 0 && msglog.open) {
+            std::string body(1, (char)LOG_DELIVERED);
+            put_string(body, username);
+            queue_record(body, nullptr);
+        }
+    }
+    stats.offline_delivered.fetch_add(count, std::memory_order_relaxed);
+    return messages;
+}
+
+void for_each_backlog(const std::function<void(const std::string &username, const std::vector<std::string> &messages)> &f) {
+    std::lock_guard<std::mutex> lock(msglog.mutex);
+    std::vector<std::string> messages;
+    for (const auto &[username, entries] : msglog.backlog) {
+        messages.clear();
+        for (const BacklogEntry &entry : entries) messages.emplace_back(entry.message.data(), entry.message.size());
+        f(username, messages);
+    }
+}
+
+void log_flush() {
+    std::unique_lock<std::mutex> lock(msglog.mutex);
+    if (!msglog.open) return;
+    uint64_t target = msglog.queued;
+    msglog.written.wait(lock, [target] { return msglog.done >= target; });
+}
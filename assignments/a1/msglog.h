@@ -0,0 +1,49 @@
+#ifndef MSGLOG_H
+#define MSGLOG_H
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Messages for users who are offline, kept in memory per recipient and made durable in an
+// append-only log so that they survive a restart.
+//
+// The log is a directory of segments named after their sequence number (00000000000000000001.log,
+// ...), each a sequence of records framed as in record.h:
+//
+//   body: uint8_t LOG_MESSAGE, uint32_t n, n x (uint32_t len, recipient), uint32_t len, message
+//       | uint8_t LOG_DELIVERED, uint32_t len, username   (everything before it for that user was delivered)
+//
+// A single writer thread appends whatever has been queued since its last write with one write()
+// and, with sync on, one fdatasync() (group commit). Segments are replayed at startup, a torn
+// record at the end of the last one is cut off, and the oldest segments are deleted once
+// every message in them has been delivered.
+
+#define LOG_SEGMENT_SIZE (64 << 20)  // Bytes after which the log moves on to a new segment
+#define MAX_BACKLOG 1000             // Offline messages kept per user, older ones are dropped
+
+enum LogRecordType : uint8_t { LOG_MESSAGE = 1, LOG_DELIVERED = 2 };
+
+// Replay the segments in dir (created if missing) into the backlog and start the writer
+bool log_open(const std::string &dir, bool sync, std::string &error);
+
+// Write out everything queued and stop the writer
+void log_close();
+
+// Keep a message for users who are offline. on_durable (optional) runs once the message is on
+// disk, on the writer thread, or at once if the log is not open.
+void store_offline(const std::vector<std::string> &recipients, const std::string &message,
+                   std::function<void()> on_durable = nullptr);
+
+// Take the messages kept for a user, one per line, and record that they were delivered
+std::string take_backlog(const std::string &username);
+
+// Call f for every user with messages kept, oldest first. Runs under the log's lock, so f must
+// not call back into it.
+void for_each_backlog(const std::function<void(const std::string &username, const std::vector<std::string> &messages)> &f);
+
+// Wait until everything queued so far has been written (and synced if enabled)
+void log_flush();
+
+#endif // MSGLOG_H
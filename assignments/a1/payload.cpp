@@ -0,0 +1,81 @@
+#include "payload.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+// Blocks are recycled through per-thread free lists, one per power-of-two size class from
+// 64 bytes to 64 KiB. Larger messages bypass the pool. A block freed on another thread than
+// the one that allocated it simply joins the freeing thread's list.
+static constexpr uint32_t kMinClassShift = 6;
+static constexpr uint32_t kClasses = 11;
+static constexpr uint32_t kUnpooled = kClasses;
+static constexpr size_t kMaxCached = 256;  // Blocks kept per class and thread
+
+namespace {
+
+struct FreeBlock {
+    FreeBlock *next;
+};
+
+struct PayloadPool {
+    FreeBlock *free_lists[kClasses] = {};
+    size_t cached[kClasses] = {};
+
+    ~PayloadPool() {
+        for (uint32_t i = 0; i < kClasses; i++) {
+            while (free_lists[i] != nullptr) {
+                FreeBlock *next = free_lists[i]->next;
+                std::free(free_lists[i]);
+                free_lists[i] = next;
+            }
+        }
+    }
+};
+
+thread_local PayloadPool pool;
+
+}  // namespace
+
+static uint32_t size_class(size_t bytes) {
+    uint32_t cls = 0;
+    while (cls < kClasses && ((size_t)1 << (cls + kMinClassShift)) < bytes) cls++;
+    return cls;
+}
+
+Payload::Payload(const char *data, size_t len) {
+    size_t bytes = sizeof(Block) + len;
+    uint32_t cls = size_class(bytes);
+    void *memory = nullptr;
+    if (cls < kClasses && pool.free_lists[cls] != nullptr) {
+        FreeBlock *free_block = pool.free_lists[cls];
+        pool.free_lists[cls] = free_block->next;
+        pool.cached[cls]--;
+        memory = free_block;
+    } else {
+        memory = std::malloc(cls < kClasses ? ((size_t)1 << (cls + kMinClassShift)) : bytes);
+        if (memory == nullptr) throw std::bad_alloc();
+    }
+
+    block_ = new (memory) Block;
+    block_->refs.store(1, std::memory_order_relaxed);
+    block_->size = (uint32_t)len;
+    block_->size_class = cls;
+    if (len > 0) std::memcpy(block_->bytes(), data, len);  // data may be null for an empty payload
+}
+
+void Payload::release() {
+    if (block_ == nullptr || block_->refs.fetch_sub(1, std::memory_order_acq_rel) != 1) return;
+
+    uint32_t cls = block_->size_class;
+    block_->~Block();
+    if (cls < kUnpooled && pool.cached[cls] < kMaxCached) {
+        FreeBlock *free_block = reinterpret_cast<FreeBlock *>(block_);
+        free_block->next = pool.free_lists[cls];
+        pool.free_lists[cls] = free_block;
+        pool.cached[cls]++;
+    } else {
+        std::free(block_);
+    }
+    block_ = nullptr;
+}
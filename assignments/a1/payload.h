@@ -0,0 +1,47 @@
+#ifndef PAYLOAD_H
+#define PAYLOAD_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+
+// Immutable, reference-counted message bytes. A fan-out formats its message once into a
+// Payload and every recipient queue holds a reference to the same pooled block.
+class Payload {
+   public:
+    Payload() = default;
+    Payload(const char *data, size_t len);
+    explicit Payload(const std::string &message) : Payload(message.data(), message.size()) {}
+
+    Payload(const Payload &other) : block_(other.block_) {
+        if (block_ != nullptr) block_->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+    Payload(Payload &&other) noexcept : block_(other.block_) { other.block_ = nullptr; }
+    Payload &operator=(Payload other) noexcept {
+        std::swap(block_, other.block_);
+        return *this;
+    }
+    ~Payload() { release(); }
+
+    const char *data() const { return block_ != nullptr ? block_->bytes() : nullptr; }
+    size_t size() const { return block_ != nullptr ? block_->size : 0; }
+    bool empty() const { return size() == 0; }
+
+   private:
+    struct Block {
+        std::atomic<uint32_t> refs;
+        uint32_t size;
+        uint32_t size_class;  // Index of the pool free list, or kUnpooled
+
+        // The message bytes follow the header in the same allocation
+        char *bytes() { return reinterpret_cast<char *>(this + 1); }
+    };
+
+    void release();
+
+    Block *block_ = nullptr;
+};
+
+#endif // PAYLOAD_H
@@ -0,0 +1,108 @@
+#include "presence.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <thread>
+
+#include "capture.h"
+#include "server_grp.h"
+
+struct Digest {
+    uint64_t joined = 0;
+    uint64_t left = 0;
+    uint64_t deferred_sends = 0;  // Notices the events would have cost if sent one by one
+};
+
+// The flusher is detached and the process may exit while it waits, so its state is never destroyed
+struct Presence {
+    std::mutex mutex;
+    std::condition_variable wake;     // Events arrived, or a flush was requested
+    std::condition_variable flushed;  // The flusher sent a batch
+    std::map<uint32_t, Digest> pending;  // By scope
+    bool started = false;
+    bool flush_now = false;  // End the current window early
+    bool sending = false;    // A batch is being sent
+};
+
+static Presence &presence = *new Presence;
+
+static std::string digest_text(uint32_t scope, const Digest &digest) {
+    std::string text = scope == PRESENCE_SERVER ? "Server: " : "Group " + group_ids.name(scope) + ": ";
+    if (digest.joined > 0) {
+        text += std::to_string(digest.joined) + (digest.joined == 1 ? " user joined" : " users joined");
+    }
+    if (digest.left > 0) {
+        if (digest.joined > 0) text += ", " + std::to_string(digest.left) + " left";
+        else text += std::to_string(digest.left) + (digest.left == 1 ? " user left" : " users left");
+    }
+    return text + ".";
+}
+
+// Send one digest per scope to whoever is in the scope now
+static void send_digests(const std::map<uint32_t, Digest> &digests) {
+    CaptureTimerScope timer;  // Sent when the window closes, which a replay does not reproduce
+    for (const auto &[scope, digest] : digests) {
+        std::vector<int> recipients;
+        {
+            RcuReadGuard guard;
+            const Directory &dir = *directory.load();
+            if (scope == PRESENCE_SERVER) {
+                dir.socket_user.for_each([&](size_t socket, uint32_t) { recipients.push_back(socket); });
+            } else {
+                dir.members(scope).for_each([&](uint32_t user_id) {
+                    int socket = dir.socket_of(user_id);
+                    if (socket >= 0) recipients.push_back(socket);
+                });
+            }
+        }
+        multicast_message(digest_text(scope, digest), recipients);
+        stats.presence_digests.fetch_add(1, std::memory_order_relaxed);
+        if (digest.deferred_sends > recipients.size()) {
+            stats.presence_sends_saved.fetch_add(digest.deferred_sends - recipients.size(), std::memory_order_relaxed);
+        }
+    }
+}
+
+// Wait for the first event, let the window collect more, then send them as digests
+static void presence_flusher() {
+    std::unique_lock<std::mutex> lock(presence.mutex);
+    while (true) {
+        presence.wake.wait(lock, [] { return presence.flush_now || !presence.pending.empty(); });
+        presence.wake.wait_for(lock, std::chrono::milliseconds(config.presence_window_ms), [] { return presence.flush_now; });
+        presence.flush_now = false;
+        std::map<uint32_t, Digest> digests;
+        digests.swap(presence.pending);
+        presence.sending = true;
+        lock.unlock();
+        send_digests(digests);
+        lock.lock();
+        presence.sending = false;
+        presence.flushed.notify_all();
+    }
+}
+
+void announce_presence(uint32_t scope, bool joined, const std::string &notice, const std::vector<int> &recipients) {
+    if (config.presence_threshold == 0 || recipients.size() < config.presence_threshold) {
+        multicast_message(notice, recipients);
+        return;
+    }
+    std::lock_guard<std::mutex> lock(presence.mutex);
+    Digest &digest = presence.pending[scope];
+    (joined ? digest.joined : digest.left)++;
+    digest.deferred_sends += recipients.size();
+    if (!presence.started) {
+        std::thread(presence_flusher).detach();
+        presence.started = true;
+    }
+    presence.wake.notify_one();
+}
+
+void presence_flush() {
+    std::unique_lock<std::mutex> lock(presence.mutex);
+    if (!presence.started || (presence.pending.empty() && !presence.sending)) return;
+    presence.flush_now = true;
+    presence.wake.notify_one();
+    presence.flushed.wait(lock, [] { return presence.pending.empty() && !presence.sending; });
+}
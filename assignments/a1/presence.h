@@ -0,0 +1,23 @@
+#ifndef PRESENCE_H
+#define PRESENCE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// "User X joined/left" notices. A notice for fewer than `config.presence_threshold` recipients
+// is sent at once. For a larger audience the event is only counted, and a flusher thread sends
+// one digest per scope (a group, or the whole server) at the end of a `config.presence_window_ms`
+// window, e.g. "Group g1: 12 users joined, 3 left." A reconnect storm in a large group then
+// costs one message per member and window instead of one per member and event.
+
+constexpr uint32_t PRESENCE_SERVER = UINT32_MAX;  // Scope of logins and exits, seen by every client
+
+// Announce that a user joined or left a group (group id) or the server (PRESENCE_SERVER).
+// recipients are the sockets the notice goes to when it is sent at once.
+void announce_presence(uint32_t scope, bool joined, const std::string &notice, const std::vector<int> &recipients);
+
+// Send the pending digests now, without waiting for the end of the window
+void presence_flush();
+
+#endif // PRESENCE_H
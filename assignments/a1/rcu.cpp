@@ -0,0 +1,102 @@
+#include "rcu.h"
+
+#include <limits>
+#include <mutex>
+#include <thread>
+
+// Per-thread reader record. Records are never freed, a thread that exits hands its record
+// to the next thread that starts reading.
+struct RcuThread {
+    std::atomic<uint64_t> epoch{0};  // Epoch the current read section started in, 0 when quiescent
+    std::atomic<bool> in_use{true};
+    unsigned depth = 0;              // Nesting of read guards, only touched by the owner
+    RcuThread *next = nullptr;
+};
+
+struct Retired {
+    uint64_t epoch;
+    void *object;
+    void (*destroy)(void *);
+};
+
+static std::atomic<uint64_t> global_epoch(1);
+static std::atomic<RcuThread *> rcu_threads(nullptr);
+static std::mutex retired_mutex;
+static std::vector<Retired> retired;
+
+static RcuThread *acquire_record() {
+    for (RcuThread *t = rcu_threads.load(); t != nullptr; t = t->next) {
+        bool expected = false;
+        if (!t->in_use.load() && t->in_use.compare_exchange_strong(expected, true)) return t;
+    }
+    RcuThread *t = new RcuThread;
+    t->next = rcu_threads.load();
+    while (!rcu_threads.compare_exchange_weak(t->next, t)) {
+    }
+    return t;
+}
+
+// Gives the record back when the thread exits
+struct RcuRegistration {
+    RcuThread *record = acquire_record();
+    ~RcuRegistration() { record->in_use = false; }
+};
+
+static RcuThread *this_thread_record() {
+    thread_local RcuRegistration registration;
+    return registration.record;
+}
+
+RcuReadGuard::RcuReadGuard() : thread_(this_thread_record()) {
+    if (thread_->depth++ == 0) {
+        // seq_cst: the announcement must be visible before any published pointer is loaded
+        thread_->epoch.store(global_epoch.load());
+    }
+}
+
+RcuReadGuard::~RcuReadGuard() {
+    if (--thread_->depth == 0) {
+        thread_->epoch.store(0, std::memory_order_release);
+    }
+}
+
+void rcu_retire(void *object, void (*destroy)(void *)) {
+    // The object was unpublished before this point, readers announcing a later epoch cannot see it
+    uint64_t epoch = global_epoch.fetch_add(1);
+    std::lock_guard<std::mutex> lock(retired_mutex);
+    retired.push_back({epoch, object, destroy});
+}
+
+size_t rcu_reclaim() {
+    uint64_t oldest = std::numeric_limits<uint64_t>::max();
+    for (RcuThread *t = rcu_threads.load(); t != nullptr; t = t->next) {
+        uint64_t epoch = t->epoch.load();
+        if (epoch != 0 && epoch < oldest) oldest = epoch;
+    }
+
+    std::vector<Retired> ready;
+    size_t pending;
+    {
+        std::lock_guard<std::mutex> lock(retired_mutex);
+        auto it = retired.begin();
+        for (auto &r : retired) {
+            if (r.epoch < oldest) {
+                ready.push_back(r);
+            } else {
+                *it++ = r;
+            }
+        }
+        retired.erase(it, retired.end());
+        pending = retired.size();
+    }
+    for (auto &r : ready) {
+        r.destroy(r.object);
+    }
+    return pending;
+}
+
+void rcu_barrier() {
+    while (rcu_reclaim() > 0) {
+        std::this_thread::yield();
+    }
+}
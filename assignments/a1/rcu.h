@@ -0,0 +1,95 @@
+#ifndef RCU_H
+#define RCU_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Epoch based reclamation for read-mostly data published through an atomic pointer.
+// Readers wrap their accesses in an RcuReadGuard and never block; writers swap in a new
+// object and retire the old one, which is freed once every reader that could still see it
+// has left its read section.
+
+struct RcuThread;
+
+// Marks the current thread as reading published data for the lifetime of the guard (nestable)
+class RcuReadGuard {
+   public:
+    RcuReadGuard();
+    ~RcuReadGuard();
+    RcuReadGuard(const RcuReadGuard &) = delete;
+    RcuReadGuard &operator=(const RcuReadGuard &) = delete;
+
+   private:
+    RcuThread *thread_;
+};
+
+// Free an unpublished object once no reader can hold it any more (writers only)
+void rcu_retire(void *object, void (*destroy)(void *));
+
+template <typename T>
+void rcu_retire(const T *object) {
+    rcu_retire(const_cast<T *>(object), [](void *p) { delete static_cast<T *>(p); });
+}
+
+// Free whatever retired objects are no longer visible, returns how many are still pending
+size_t rcu_reclaim();
+
+// Wait until every retired object has been freed
+void rcu_barrier();
+
+// Replace the object behind an atomic pointer and retire the old one (caller serializes writers)
+template <typename T>
+void rcu_publish(std::atomic<const T *> &slot, const T *next) {
+    const T *old = slot.exchange(next);
+    if (old != nullptr) rcu_retire(old);
+    rcu_reclaim();
+}
+
+// Array whose copies share fixed-size chunks, so a writer copying a snapshot to change a
+// few slots duplicates only the chunk table and the chunks it touches.
+// Copies and writes must be serialized; concurrent const access is safe.
+template <typename T, size_t CHUNK = 256>
+class CowArray {
+   public:
+    explicit CowArray(const T &fill = T()) : fill_(fill) {}
+
+    size_t size() const { return chunks_.size() * CHUNK; }
+
+    // Value at an index, the fill value past the end
+    const T &get(size_t index) const {
+        if (index >= size()) return fill_;
+        return (*chunks_[index / CHUNK])[index % CHUNK];
+    }
+
+    void set(size_t index, const T &value) {
+        while (index >= size()) {
+            chunks_.push_back(std::make_shared<std::vector<T>>(CHUNK, fill_));
+        }
+        std::shared_ptr<std::vector<T>> &chunk = chunks_[index / CHUNK];
+        // Only writers copy arrays, so under the writer lock a unique chunk is ours to change
+        if (chunk.use_count() > 1) {
+            chunk = std::make_shared<std::vector<T>>(*chunk);
+        }
+        (*chunk)[index % CHUNK] = value;
+    }
+
+    // Call f(index, value) for every slot that does not hold the fill value
+    template <typename F>
+    void for_each(F &&f) const {
+        for (size_t c = 0; c < chunks_.size(); c++) {
+            const std::vector<T> &chunk = *chunks_[c];
+            for (size_t i = 0; i < CHUNK; i++) {
+                if (!(chunk[i] == fill_)) f(c * CHUNK + i, chunk[i]);
+            }
+        }
+    }
+
+   private:
+    std::vector<std::shared_ptr<std::vector<T>>> chunks_;
+    T fill_;
+};
+
+#endif // RCU_H
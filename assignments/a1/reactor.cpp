@@ -0,0 +1,1161 @@
+#include "reactor.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "mpsc_queue.h"
+#include "payload.h"
+#include "sendq.h"
+#include "timer_wheel.h"
+#include "uring.h"
+
+#define MAX_IOVECS 64        // Queued messages written per sendmsg() call
+#define URING_ENTRIES 1024   // Submission queue size of each io_uring worker
+#define URING_BUFFERS 128    // Provided receive buffers per io_uring worker (power of two)
+#define URING_GROUP 0        // Buffer group id of the receive buffers
+#define MAX_READS 16         // recv() calls on one connection before the event loop serves the others
+#define TIMER_TICK std::chrono::milliseconds(10)  // Resolution of the timer wheels
+#define CLOSE_LINGER std::chrono::seconds(5)      // Time a closing connection has to flush its output
+
+struct Shard;
+
+// Kinds of io_uring requests, stored in the low byte of the user data
+enum UringOp : uint8_t { OP_ACCEPT = 1, OP_RECV, OP_SEND, OP_WAKE, OP_CANCEL };
+
+// The send a connection has in flight on io_uring
+struct UringSend {
+    msghdr msg{};
+    iovec iov[MAX_IOVECS];
+    std::vector<Payload> pinned;  // Zero-copy buffers the kernel may still read
+    unsigned notifications = 0;   // Zero-copy completions whose buffer release is still to come
+};
+
+// State of one non-blocking client connection, only touched by the shard that accepted it.
+// Its TimerNode is armed in the shard's wheel for the next check of the session's deadlines, or
+// for the end of its linger once it is closing.
+struct Connection : TimerNode {
+    Session session;
+    Shard *shard = nullptr;
+    uint64_t tag = 0;               // Owner tag published in socket_owner, guards against socket reuse
+    SendQueue out;                  // Messages the socket could not take yet
+    bool write_blocked = false;     // Last send hit EAGAIN, wait for EPOLLOUT
+    bool closing = false;           // No more input is read, released by reap_closed
+    bool dead = false;              // Peer is gone, close without flushing
+    bool paused = false;            // Session is throttled, no input is read until the shard resumes it
+    bool yielded = false;           // Used up its read budget with input left, waits in the shard's ready list
+    // io_uring mode only
+    unsigned pending_ops = 0;           // Requests in the ring that still refer to this connection
+    bool released = false;              // Session closed, the socket is closed once pending_ops drains
+    std::unique_ptr<UringSend> send;    // Allocated on the first send
+    bool recv_armed = false;            // The multishot recv is in the ring
+    bool recv_cancelled = false;        // It was cancelled to pause the connection
+};
+
+// A paused connection and the end of its throttle
+struct Wakeup {
+    std::chrono::steady_clock::time_point at;
+    int socket;
+    uint64_t tag;
+    bool operator>(const Wakeup &other) const { return at > other.at; }
+};
+
+// A message handed to another shard, addressed to one or more of its sockets
+struct Delivery {
+    Delivery *next = nullptr;
+    std::vector<Payload> messages;                   // Queued together, in order
+    std::vector<std::pair<int, uint64_t>> targets;  // (socket, owner tag)
+    std::function<bool(Session &)> task;            // Run on the target's session instead of queueing message
+};
+
+// One event loop pinned to a core, owning the connections it accepted on its own listening socket
+struct Shard {
+    int id = 0;
+    int listen_socket = -1;
+    int epoll_fd = -1;
+    int wake_fd = -1;                   // eventfd signalled when the inbox goes non-empty
+    std::vector<Connection *> connections;  // Indexed by socket
+    std::vector<Connection *> pool;     // Free connections, reused before allocating new ones
+    std::vector<int> closing;           // Sockets to reap at the end of the current iteration
+    std::vector<std::pair<int, uint64_t>> ready;  // (socket, owner tag) of yielded connections, read again next iteration
+    std::vector<Wakeup> paused;         // Min-heap of paused connections by the end of their throttle
+    MpscQueue<Delivery> inbox;
+    std::unique_ptr<Uring> ring;        // Set in io_uring mode, replaces epoll_fd
+    uint64_t wake_count = 0;            // Read target of the eventfd in io_uring mode
+    bool stopping = false;              // Shutting down, sends are written synchronously
+    bool accepting = false;             // io_uring mode: the multishot accept is in the ring
+    uint64_t syscalls = 0;              // I/O system calls since the last stats update
+    uint64_t messages = 0;              // Messages queued since the last stats update
+    uint64_t yields = 0;                // Read budgets used up since the last stats update
+    TimerWheel timers;                  // Deadline checks of the connections
+    std::chrono::steady_clock::time_point timer_start;  // Time of tick 0
+    uint64_t timer_ticks = 0;           // Timer counters since the last stats update
+    uint64_t timers_fired = 0;
+    uint64_t timer_ns = 0;
+    uint64_t timer_max_ns = 0;
+    uint64_t ring_enters = 0;           // io_uring_enter() calls already counted in syscalls
+    uint64_t accepted = 0;              // Accept counters since the last stats update
+    uint64_t accept_wakeups = 0;
+    uint64_t pool_misses = 0;
+};
+
+static std::vector<std::unique_ptr<Shard>> shards;
+static std::unique_ptr<std::atomic<uint64_t>[]> socket_owner;  // Owner tag of every reactor socket, 0 if none
+static size_t socket_owner_size = 0;
+static std::atomic<uint64_t> next_generation(1);
+static thread_local Shard *current_shard = nullptr;
+static bool zero_copy = false;  // IORING_OP_SEND_ZC is available
+static Handoff adopted;         // Listening sockets and connections to serve, from reactor_adopt()
+
+static void count_syscall() {
+    if (current_shard != nullptr) current_shard->syscalls++;
+}
+
+static uint64_t user_data(UringOp op, ci socket, uint64_t tag) {
+    return ((uint64_t)socket << 32) | (((tag >> 16) & 0xffffff) << 8) | op;
+}
+
+static uint64_t make_tag(const Shard *shard) {
+    return (next_generation.fetch_add(1, std::memory_order_relaxed) << 16) | (uint64_t)(shard->id + 1);
+}
+
+static Shard *tag_shard(uint64_t tag) {
+    return shards[(tag & 0xffff) - 1].get();
+}
+
+static uint64_t owner_of(ci socket) {
+    if (socket < 0 || (size_t)socket >= socket_owner_size) return 0;
+    return socket_owner[socket].load(std::memory_order_acquire);
+}
+
+static void set_nonblocking(ci socket, bool on = true) {
+    int flags = fcntl(socket, F_GETFL, 0);
+    fcntl(socket, F_SETFL, on ? flags | O_NONBLOCK : flags & ~O_NONBLOCK);
+}
+
+static Connection *find_connection(Shard *shard, ci socket) {
+    if (socket < 0 || (size_t)socket >= shard->connections.size()) return nullptr;
+    return shard->connections[socket];
+}
+
+static void schedule_check(Shard *shard, Connection *conn, std::chrono::steady_clock::time_point next);
+
+// Stop reading from a connection and release it once its output is flushed (or at once if dead).
+// A peer that stops reading gets CLOSE_LINGER to take the output before the connection is dropped.
+// The session state is left alone so that session_close still sees whether the client logged in.
+static void schedule_close(Connection *conn) {
+    if (!conn->closing) {
+        conn->closing = true;
+        schedule_check(conn->shard, conn, std::chrono::steady_clock::now() + CLOSE_LINGER);
+    }
+    conn->shard->closing.push_back(conn->session.socket);
+}
+
+// Stop reading from a connection whose session was throttled, until resume_connections() gives it
+// its input back. In io_uring mode the multishot recv is cancelled, the chunks it still delivers
+// are held back by the session.
+static void pause_connection(Connection *conn) {
+    Shard *shard = conn->shard;
+    if (conn->paused || conn->closing || !conn->session.throttled) return;
+    conn->paused = true;
+    shard->paused.push_back({conn->session.throttled_until, conn->session.socket, conn->tag});
+    std::push_heap(shard->paused.begin(), shard->paused.end(), std::greater<Wakeup>());
+    if (shard->ring && conn->recv_armed && !conn->recv_cancelled) {
+        io_uring_sqe *sqe = shard->ring->get_sqe();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = user_data(OP_RECV, conn->session.socket, conn->tag);
+        sqe->user_data = user_data(OP_CANCEL, conn->session.socket, conn->tag);
+        conn->recv_cancelled = true;
+    }
+}
+
+static void drop_output(Connection *conn) {
+    conn->out.clear();
+}
+
+// Drop `sent` bytes from the front of the output queue
+static void consume_output(Connection *conn, size_t sent) {
+    conn->out.consume(sent);
+}
+
+// Bookkeeping once the socket took what it could
+static void output_flushed(Connection *conn) {
+    conn->out.flushed(config.sndq_low);
+    if (conn->out.empty()) {
+        if (conn->closing) {
+            schedule_close(conn);
+        }
+    }
+}
+
+// Fill iov with up to MAX_IOVECS queued messages, returns how many
+static size_t gather_output(Connection *conn, iovec *iov) {
+    size_t count = 0;
+    for (auto it = conn->out.messages.begin(); it != conn->out.messages.end() && count < MAX_IOVECS; ++it, ++count) {
+        size_t skip = (count == 0) ? conn->out.offset : 0;
+        iov[count].iov_base = const_cast<char *>(it->data.data()) + skip;
+        iov[count].iov_len = it->data.size() - skip;
+    }
+    return count;
+}
+
+// Queue one send for the pending output on io_uring. A large message at the head of the queue
+// goes out alone as IORING_OP_SEND_ZC, so the kernel transmits from the shared payload instead
+// of copying it into every recipient's socket buffer.
+static void submit_send(Connection *conn) {
+    if (!conn->send) conn->send = std::make_unique<UringSend>();
+    UringSend &send = *conn->send;
+    io_uring_sqe *sqe = conn->shard->ring->get_sqe();
+    const Payload &front = conn->out.messages.front().data;
+    if (zero_copy && front.size() - conn->out.offset >= config.zc_threshold) {
+        sqe->opcode = IORING_OP_SEND_ZC;
+        sqe->addr = (uint64_t)(front.data() + conn->out.offset);
+        sqe->len = front.size() - conn->out.offset;
+        send.pinned.push_back(front);
+    } else {
+        send.msg = msghdr{};
+        send.msg.msg_iov = send.iov;
+        send.msg.msg_iovlen = gather_output(conn, send.iov);
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->addr = (uint64_t)&send.msg;
+        sqe->len = 1;
+    }
+    sqe->fd = conn->session.socket;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = user_data(OP_SEND, conn->session.socket, conn->tag);
+    conn->pending_ops++;
+    conn->write_blocked = true;  // Until the completion arrives
+}
+
+// Write as much of the pending output as the socket accepts, batching queued messages into one sendmsg()
+static void flush_connection(Connection *conn) {
+    if (conn->shard->ring && !conn->shard->stopping) {
+        if (!conn->out.empty() && !conn->write_blocked && !conn->released) submit_send(conn);
+        return;
+    }
+    iovec iov[MAX_IOVECS];
+    while (!conn->out.empty()) {
+        msghdr msg{};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = gather_output(conn, iov);
+
+        count_syscall();
+        ssize_t sent = sendmsg(conn->session.socket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent > 0) {
+            consume_output(conn, sent);
+        } else if (sent < 0 && errno == EINTR) {
+            continue;
+        } else if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            conn->write_blocked = true;
+            break;
+        } else {
+            conn->dead = true;
+            drop_output(conn);
+            schedule_close(conn);
+            return;
+        }
+    }
+    output_flushed(conn);
+}
+
+// Queue messages to be written together, applying the overflow policy once the queue is past the high watermark
+static void enqueue_local(Connection *conn, const Payload *messages, size_t count) {
+    if (conn->dead) return;
+    switch (conn->out.push(messages, count, config.sndq_high, config.overflow_policy)) {
+    case Admit::DROPPED:
+        stats.overflow_dropped++;
+        return;
+    case Admit::DISCONNECT:
+        stats.overflow_disconnected++;
+        conn->dead = true;
+        drop_output(conn);
+        schedule_close(conn);
+        return;
+    case Admit::COALESCED:
+        stats.overflow_coalesced++;
+        break;
+    case Admit::QUEUED:
+        break;
+    }
+    metrics_send_queue(conn->out.bytes);
+    conn->shard->messages++;
+    if (!conn->write_blocked) {
+        flush_connection(conn);
+    }
+}
+
+static void enqueue_local(Connection *conn, const Payload &payload) {
+    enqueue_local(conn, &payload, 1);
+}
+
+static void post_delivery(Shard *shard, Delivery *delivery) {
+    if (shard->inbox.push(delivery)) {
+        uint64_t one = 1;
+        count_syscall();
+        (void)!write(shard->wake_fd, &one, sizeof(one));
+    }
+}
+
+bool reactor_running() {
+    return !shards.empty();
+}
+
+bool reactor_send(ci client_socket, const char *data, size_t len) {
+    uint64_t tag = owner_of(client_socket);
+    if (tag == 0) return false;
+
+    Shard *owner = tag_shard(tag);
+    if (owner == current_shard) {
+        Connection *conn = find_connection(owner, client_socket);
+        if (conn != nullptr && conn->tag == tag) enqueue_local(conn, Payload(data, len));
+        return true;
+    }
+
+    Delivery *delivery = new Delivery();
+    delivery->messages.emplace_back(data, len);
+    delivery->targets.emplace_back(client_socket, tag);
+    post_delivery(owner, delivery);
+    return true;
+}
+
+bool reactor_send_all(ci client_socket, const std::vector<Payload> &messages) {
+    uint64_t tag = owner_of(client_socket);
+    if (tag == 0) return false;
+
+    Shard *owner = tag_shard(tag);
+    if (owner == current_shard) {
+        Connection *conn = find_connection(owner, client_socket);
+        if (conn != nullptr && conn->tag == tag) enqueue_local(conn, messages.data(), messages.size());
+        return true;
+    }
+
+    Delivery *delivery = new Delivery();
+    delivery->messages = messages;
+    delivery->targets.emplace_back(client_socket, tag);
+    post_delivery(owner, delivery);
+    return true;
+}
+
+void reactor_multicast(const Payload &payload, const std::vector<int> &sockets) {
+    // One hand-off per destination shard instead of one per recipient, all sharing the payload
+    std::vector<Delivery *> batches(shards.size(), nullptr);
+    for (int socket : sockets) {
+        uint64_t tag = owner_of(socket);
+        if (tag == 0) continue;
+        Shard *owner = tag_shard(tag);
+        if (owner == current_shard) {
+            Connection *conn = find_connection(owner, socket);
+            if (conn != nullptr && conn->tag == tag) enqueue_local(conn, payload);
+            continue;
+        }
+        Delivery *&batch = batches[owner->id];
+        if (batch == nullptr) {
+            batch = new Delivery();
+            batch->messages.push_back(payload);
+        }
+        batch->targets.emplace_back(socket, tag);
+    }
+    for (size_t i = 0; i < batches.size(); i++) {
+        if (batches[i] != nullptr) post_delivery(shards[i].get(), batches[i]);
+    }
+}
+
+bool reactor_post(ci client_socket, std::function<bool(Session &)> task) {
+    uint64_t tag = owner_of(client_socket);
+    if (tag == 0) return false;
+    Delivery *delivery = new Delivery();
+    delivery->targets.emplace_back(client_socket, tag);
+    delivery->task = std::move(task);
+    post_delivery(tag_shard(tag), delivery);
+    return true;
+}
+
+// Move messages posted by other shards into the output buffers of their recipients, and run posted tasks
+static void drain_inbox(Shard *shard) {
+    Delivery *delivery = shard->inbox.pop_all();
+    while (delivery != nullptr) {
+        for (const auto &[socket, tag] : delivery->targets) {
+            Connection *conn = find_connection(shard, socket);
+            if (conn == nullptr || conn->tag != tag) continue;
+            if (!delivery->task) {
+                enqueue_local(conn, delivery->messages.data(), delivery->messages.size());
+            } else if (!conn->closing && !conn->released) {
+                if (!delivery->task(conn->session)) schedule_close(conn);
+                pause_connection(conn);
+            }
+        }
+        Delivery *next = delivery->next;
+        delete delivery;
+        delivery = next;
+    }
+}
+
+// A blank connection from the shard's pool, so that a burst of connections does not hit the allocator
+static Connection *new_connection(Shard *shard) {
+    if (shard->pool.empty()) {
+        shard->pool_misses++;
+        return new Connection();
+    }
+    Connection *conn = shard->pool.back();
+    shard->pool.pop_back();
+    return conn;
+}
+
+// Return a connection to the pool, keeping its io_uring send state allocated
+static void free_connection(Shard *shard, Connection *conn) {
+    if (shard->pool.size() >= config.connection_pool) {
+        delete conn;
+        return;
+    }
+    std::unique_ptr<UringSend> send = std::move(conn->send);
+    *conn = Connection();
+    if (send) {
+        send->pinned.clear();
+        send->notifications = 0;
+        conn->send = std::move(send);
+    }
+    shard->pool.push_back(conn);
+}
+
+// Free a connection whose socket no request refers to any more
+static void release_connection(Shard *shard, Connection *conn) {
+    int socket = conn->session.socket;
+    shard->timers.cancel(conn);
+    shard->connections[socket] = nullptr;
+    close(socket);
+    free_connection(shard, conn);
+}
+
+static void close_connection(Shard *shard, ci socket) {
+    Connection *conn = find_connection(shard, socket);
+    if (conn == nullptr || conn->released) return;
+    conn->released = true;
+    socket_owner[socket].store(0, std::memory_order_release);
+    session_close(conn->session);
+    if (shard->ring) {
+        // The socket stays open, and its slot taken, until the ring has let go of the connection
+        if (conn->pending_ops > 0) {
+            io_uring_sqe *sqe = shard->ring->get_sqe();
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->fd = socket;
+            sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+            sqe->user_data = user_data(OP_CANCEL, socket, conn->tag);
+            return;
+        }
+    } else {
+        count_syscall();
+        epoll_ctl(shard->epoll_fd, EPOLL_CTL_DEL, socket, nullptr);
+    }
+    release_connection(shard, conn);
+}
+
+static void reap_closed(Shard *shard) {
+    // Closing a connection may broadcast to (and fail on) others, so drain until stable
+    while (!shard->closing.empty()) {
+        std::vector<int> batch;
+        batch.swap(shard->closing);
+        for (int socket : batch) {
+            Connection *conn = find_connection(shard, socket);
+            if (conn != nullptr && !conn->released && (conn->dead || conn->out.empty())) {
+                close_connection(shard, socket);
+            }
+        }
+    }
+}
+
+// Arm the connection's timer for the next check of its session's deadlines, if it has any
+static void schedule_check(Shard *shard, Connection *conn, std::chrono::steady_clock::time_point next) {
+    if (next == std::chrono::steady_clock::time_point::max()) return;
+    uint64_t tick = (next - shard->timer_start + TIMER_TICK - std::chrono::nanoseconds(1)) / TIMER_TICK;
+    shard->timers.schedule(conn, tick);
+}
+
+// Timer of a connection: check its deadlines, and close it if it timed out. On a closing
+// connection the timer is its linger deadline: it is released with whatever output is left.
+static void check_connection(Shard *shard, Connection *conn, std::chrono::steady_clock::time_point now) {
+    if (conn->released) return;
+    if (conn->closing) {
+        conn->dead = true;
+        shard->closing.push_back(conn->session.socket);
+        return;
+    }
+    std::chrono::steady_clock::time_point next;
+    if (session_check_timeouts(conn->session, now, next)) {
+        schedule_check(shard, conn, next);
+        return;
+    }
+    // A peer that stopped reading would keep the connection open until its output drains
+    if (!shard->ring && conn->write_blocked) conn->dead = true;
+    schedule_close(conn);
+}
+
+// Fire the timers that are due and add the cost of the tick to the shard's counters
+static void run_timers(Shard *shard) {
+    auto now = std::chrono::steady_clock::now();
+    uint64_t tick = (now - shard->timer_start) / TIMER_TICK;
+    if (tick <= shard->timers.now()) return;
+    shard->timer_ticks += tick - shard->timers.now();
+    shard->timers_fired += shard->timers.advance(tick, [&](TimerNode *node) { check_connection(shard, static_cast<Connection *>(node), now); });
+    uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - now).count();
+    shard->timer_ns += ns;
+    shard->timer_max_ns = std::max(shard->timer_max_ns, ns);
+}
+
+// Register a socket with the shard, returns its connection (with a blank session) or nullptr if
+// it was rejected and closed
+static Connection *attach_connection(Shard *shard, int client_socket) {
+    if ((size_t)client_socket >= socket_owner_size) {
+        std::cerr << "Error: Socket " << client_socket << " exceeds the descriptor limit." << std::endl;
+        close(client_socket);
+        return nullptr;
+    }
+    if ((size_t)client_socket >= shard->connections.size()) {
+        shard->connections.resize(std::min(socket_owner_size, (size_t)client_socket * 2 + 1), nullptr);
+    }
+    Connection *conn = new_connection(shard);
+    conn->session.socket = client_socket;
+    conn->shard = shard;
+    conn->tag = make_tag(shard);
+
+    if (!shard->ring) {
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.fd = client_socket;
+        count_syscall();
+        if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, client_socket, &ev) < 0) {
+            close(client_socket);
+            free_connection(shard, conn);
+            return nullptr;
+        }
+    }
+    shard->connections[client_socket] = conn;
+    socket_owner[client_socket].store(conn->tag, std::memory_order_release);
+    return conn;
+}
+
+// Take over an accepted socket, returns the new connection or nullptr if it was rejected
+static Connection *add_connection(Shard *shard, int client_socket) {
+    Connection *conn = attach_connection(shard, client_socket);
+    if (conn == nullptr) return nullptr;
+    session_open(conn->session);
+    std::chrono::steady_clock::time_point next;
+    session_check_timeouts(conn->session, conn->session.opened, next);
+    schedule_check(shard, conn, next);
+    return conn;
+}
+
+static void read_connection(Connection *conn);
+
+// Accept every pending connection. With --defer-accept the client's first bytes are already in,
+// so they are read at once instead of on the next epoll_wait().
+static void accept_clients(Shard *shard) {
+    shard->accept_wakeups++;
+    while (true) {
+        count_syscall();
+        int client_socket = accept4(shard->listen_socket, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_socket < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                std::cerr << "Error: Cannot accept client connection." << std::endl;
+            }
+            return;
+        }
+        shard->accepted++;
+        Connection *conn = add_connection(shard, client_socket);
+        if (conn != nullptr && config.defer_accept_s > 0) read_connection(conn);
+    }
+}
+
+// Read the socket until it would block, feeding every chunk to the session. Reading stops early
+// when the session is throttled, and after MAX_READS chunks the connection goes to the back of
+// the ready list, so that a flooding client gets the same turns as everyone else.
+static void read_connection(Connection *conn) {
+    char buffer[READ_CHUNK];
+    for (int reads = 0; !conn->closing; reads++) {
+        if (conn->session.throttled) {
+            pause_connection(conn);
+            return;
+        }
+        if (reads == MAX_READS) {
+            if (!conn->yielded) {
+                conn->yielded = true;
+                conn->shard->ready.emplace_back(conn->session.socket, conn->tag);
+                conn->shard->yields++;
+            }
+            return;
+        }
+        count_syscall();
+        ssize_t bytes_received = recv(conn->session.socket, buffer, conn->session.framed ? READ_CHUNK : BUFFER_SIZE, 0);
+        if (bytes_received > 0) {
+            if (!session_receive(conn->session, buffer, bytes_received)) {
+                schedule_close(conn);
+            }
+        } else if (bytes_received < 0 && errno == EINTR) {
+            continue;
+        } else if (bytes_received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        } else {
+            conn->dead = true;
+            schedule_close(conn);
+        }
+    }
+}
+
+static bool watch(Shard *shard, ci fd, uint32_t events) {
+    epoll_event ev{};
+    ev.events = events;
+    ev.data.fd = fd;
+    return epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == 0;
+}
+
+static void pin_to_core(ci core) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(core, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+// Move the shard's counters into the server stats
+static void publish_counters(Shard *shard) {
+    if (shard->ring) {
+        shard->syscalls += shard->ring->enter_calls() - shard->ring_enters;
+        shard->ring_enters = shard->ring->enter_calls();
+    }
+    stats.io_syscalls.fetch_add(shard->syscalls, std::memory_order_relaxed);
+    stats.messages_queued.fetch_add(shard->messages, std::memory_order_relaxed);
+    stats.read_yields.fetch_add(shard->yields, std::memory_order_relaxed);
+    stats.timer_ticks.fetch_add(shard->timer_ticks, std::memory_order_relaxed);
+    stats.timers_fired.fetch_add(shard->timers_fired, std::memory_order_relaxed);
+    stats.timer_ns.fetch_add(shard->timer_ns, std::memory_order_relaxed);
+    stats.accepted.fetch_add(shard->accepted, std::memory_order_relaxed);
+    stats.accept_wakeups.fetch_add(shard->accept_wakeups, std::memory_order_relaxed);
+    stats.pool_misses.fetch_add(shard->pool_misses, std::memory_order_relaxed);
+    uint64_t max = stats.timer_max_ns.load(std::memory_order_relaxed);
+    while (shard->timer_max_ns > max && !stats.timer_max_ns.compare_exchange_weak(max, shard->timer_max_ns)) {
+    }
+    shard->syscalls = shard->messages = shard->yields = 0;
+    shard->timer_ticks = shard->timers_fired = shard->timer_ns = shard->timer_max_ns = 0;
+    shard->accepted = shard->accept_wakeups = shard->pool_misses = 0;
+}
+
+static void arm_recv(Connection *conn);
+
+// Give paused connections whose throttle ended their input back, then read the yielded ones
+static void resume_connections(Shard *shard) {
+    auto now = std::chrono::steady_clock::now();
+    while (!shard->paused.empty() && shard->paused.front().at <= now) {
+        std::pop_heap(shard->paused.begin(), shard->paused.end(), std::greater<Wakeup>());
+        Wakeup wakeup = shard->paused.back();
+        shard->paused.pop_back();
+        Connection *conn = find_connection(shard, wakeup.socket);
+        if (conn == nullptr || conn->tag != wakeup.tag) continue;
+        conn->paused = false;
+        if (conn->closing || conn->released) continue;
+        if (!session_resume(conn->session)) {
+            schedule_close(conn);
+        } else if (!shard->ring) {
+            read_connection(conn);
+        } else {
+            pause_connection(conn);
+            if (!conn->paused && !conn->recv_armed) arm_recv(conn);
+        }
+    }
+
+    std::vector<std::pair<int, uint64_t>> ready;
+    ready.swap(shard->ready);
+    for (const auto &[socket, tag] : ready) {
+        Connection *conn = find_connection(shard, socket);
+        if (conn == nullptr || conn->tag != tag) continue;
+        conn->yielded = false;
+        read_connection(conn);
+    }
+}
+
+// How long the loop may wait for events: not at all if connections yielded, otherwise at most
+// until the first throttle ends or the next timer tick that has work
+static int wait_timeout(Shard *shard) {
+    if (!shard->ready.empty()) return 0;
+    auto now = std::chrono::steady_clock::now();
+    auto until = now + std::chrono::seconds(1);
+    if (!shard->paused.empty()) until = std::min(until, shard->paused.front().at);
+    uint64_t tick = shard->timers.next_tick();
+    if (tick != UINT64_MAX) until = std::min(until, shard->timer_start + (int64_t)tick * TIMER_TICK);
+    return std::max<int>(0, std::chrono::ceil<std::chrono::milliseconds>(until - now).count());
+}
+
+static void epoll_loop(Shard *shard) {
+    epoll_event events[MAX_EVENTS];
+    while (running) {
+        if (shard->id == 0) handle_signal_requests();
+        count_syscall();
+        int n = epoll_wait(shard->epoll_fd, events, MAX_EVENTS, wait_timeout(shard));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            std::cerr << "Error: epoll_wait error." << std::endl;
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            int socket = events[i].data.fd;
+            if (socket == shard->listen_socket) {
+                accept_clients(shard);
+                continue;
+            }
+            if (socket == shard->wake_fd) {
+                uint64_t count;
+                count_syscall();
+                (void)!read(shard->wake_fd, &count, sizeof(count));
+                drain_inbox(shard);
+                continue;
+            }
+
+            Connection *conn = find_connection(shard, socket);
+            if (conn == nullptr) continue;
+            if (events[i].events & EPOLLOUT) {
+                conn->write_blocked = false;
+                flush_connection(conn);
+            }
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                read_connection(conn);
+            }
+        }
+        resume_connections(shard);
+        run_timers(shard);
+        reap_closed(shard);
+        publish_counters(shard);
+    }
+}
+
+// Multishot accept: one submission keeps accepting until it is cancelled or fails
+static void arm_accept(Shard *shard) {
+    io_uring_sqe *sqe = shard->ring->get_sqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = shard->listen_socket;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = user_data(OP_ACCEPT, 0, 0);
+    shard->accepting = true;
+}
+
+// Multishot recv into the shard's provided buffers, one completion per chunk received
+static void arm_recv(Connection *conn) {
+    io_uring_sqe *sqe = conn->shard->ring->get_sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->session.socket;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_GROUP;
+    sqe->user_data = user_data(OP_RECV, conn->session.socket, conn->tag);
+    conn->pending_ops++;
+    conn->recv_armed = true;
+}
+
+static void arm_wake(Shard *shard) {
+    io_uring_sqe *sqe = shard->ring->get_sqe();
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = shard->wake_fd;
+    sqe->addr = (uint64_t)&shard->wake_count;
+    sqe->len = sizeof(shard->wake_count);
+    sqe->user_data = user_data(OP_WAKE, 0, 0);
+}
+
+static void complete_recv(Connection *conn, const io_uring_cqe &cqe) {
+    Uring &ring = *conn->shard->ring;
+    bool more = cqe.flags & IORING_CQE_F_MORE;
+    bool cancelled = false;
+    if (!more) {
+        conn->pending_ops--;
+        conn->recv_armed = false;
+        cancelled = conn->recv_cancelled && cqe.res == -ECANCELED;
+        conn->recv_cancelled = false;
+    }
+    if (cqe.flags & IORING_CQE_F_BUFFER) {
+        uint16_t id = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+        // Without framing every recv() of at most BUFFER_SIZE bytes is one message, so hand the
+        // chunk over in the pieces that the epoll loop would have read
+        const char *data = ring.buffer(id);
+        size_t left = cqe.res > 0 ? cqe.res : 0;
+        while (left > 0 && !conn->closing) {
+            size_t len = conn->session.framed ? left : std::min<size_t>(left, BUFFER_SIZE);
+            if (!session_receive(conn->session, data, len)) {
+                schedule_close(conn);
+            }
+            data += len;
+            left -= len;
+        }
+        ring.recycle_buffer(id);
+        pause_connection(conn);
+    }
+    if (cqe.res == 0 || (cqe.res < 0 && cqe.res != -ENOBUFS && !cancelled)) {
+        if (!conn->closing) {
+            conn->dead = true;
+            schedule_close(conn);
+        }
+        return;
+    }
+    if (!more && !conn->closing && !conn->paused && !conn->shard->stopping) {
+        arm_recv(conn);
+    }
+}
+
+static void complete_send(Connection *conn, const io_uring_cqe &cqe) {
+    UringSend &send = *conn->send;
+    conn->pending_ops--;
+    if (cqe.flags & IORING_CQE_F_NOTIF) {
+        // The kernel is done with the zero-copy buffers sent so far
+        if (--send.notifications == 0) send.pinned.clear();
+        return;
+    }
+    if (cqe.flags & IORING_CQE_F_MORE) {
+        // Zero-copy send: the payload must outlive the notification that follows
+        send.notifications++;
+        conn->pending_ops++;
+        send.pinned.push_back(conn->out.messages.front().data);
+    }
+    conn->write_blocked = false;
+    if (conn->released || conn->dead) return;
+    if (cqe.res >= 0 || cqe.res == -EAGAIN || cqe.res == -EINTR) {
+        if (cqe.res > 0) consume_output(conn, cqe.res);
+        output_flushed(conn);
+        flush_connection(conn);
+    } else {
+        conn->dead = true;
+        drop_output(conn);
+        schedule_close(conn);
+    }
+}
+
+static void complete(Shard *shard, const io_uring_cqe &cqe) {
+    UringOp op = (UringOp)(cqe.user_data & 0xff);
+    int socket = (int)(cqe.user_data >> 32);
+    uint64_t generation = (cqe.user_data >> 8) & 0xffffff;
+
+    switch (op) {
+    case OP_ACCEPT:
+        if (cqe.res >= 0) {
+            shard->accepted++;
+            Connection *conn = add_connection(shard, cqe.res);
+            if (conn != nullptr && !conn->closing) arm_recv(conn);
+        }
+        if (!(cqe.flags & IORING_CQE_F_MORE)) shard->accepting = false;
+        if (!shard->accepting && running) {
+            if (cqe.res < 0 && cqe.res != -ECANCELED) std::cerr << "Error: Cannot accept client connection." << std::endl;
+            arm_accept(shard);
+        }
+        return;
+    case OP_WAKE:
+        drain_inbox(shard);
+        arm_wake(shard);
+        return;
+    case OP_CANCEL:
+        return;
+    case OP_RECV:
+    case OP_SEND:
+        break;
+    }
+
+    Connection *conn = find_connection(shard, socket);
+    if (conn == nullptr || ((conn->tag >> 16) & 0xffffff) != generation) {
+        if (cqe.flags & IORING_CQE_F_BUFFER) shard->ring->recycle_buffer(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+        return;
+    }
+    if (op == OP_RECV) {
+        complete_recv(conn, cqe);
+    } else {
+        complete_send(conn, cqe);
+    }
+    if (conn->released && conn->pending_ops == 0) {
+        release_connection(shard, conn);
+    }
+}
+
+static void uring_loop(Shard *shard) {
+    arm_accept(shard);
+    arm_wake(shard);
+    while (running) {
+        if (shard->id == 0) handle_signal_requests();
+        if (shard->ring->submit_and_wait(wait_timeout(shard)) < 0) {
+            std::cerr << "Error: io_uring_enter error." << std::endl;
+            break;
+        }
+        uint64_t accepted = shard->accepted;
+        shard->ring->for_each_cqe([&](const io_uring_cqe &cqe) { complete(shard, cqe); });
+        if (shard->accepted != accepted) shard->accept_wakeups++;
+        resume_connections(shard);
+        run_timers(shard);
+        reap_closed(shard);
+        publish_counters(shard);
+    }
+}
+
+static void run_shard(Shard *shard) {
+    current_shard = shard;
+    if (shards.size() > 1) {
+        pin_to_core(shard->id % std::max(1u, std::thread::hardware_concurrency()));
+    }
+    if (shard->ring) {
+        uring_loop(shard);
+    } else {
+        epoll_loop(shard);
+    }
+    current_shard = nullptr;
+}
+
+// Create the io_uring of a worker, returns false if the kernel lacks what the backend needs
+static bool setup_ring(Shard *shard) {
+    shard->ring = std::make_unique<Uring>();
+    if (!shard->ring->init(URING_ENTRIES) || !shard->ring->setup_buffers(URING_GROUP, URING_BUFFERS, READ_CHUNK) ||
+        !shard->ring->supports(IORING_OP_ACCEPT) || !shard->ring->supports(IORING_OP_RECV)) {
+        shard->ring.reset();
+        return false;
+    }
+    zero_copy = shard->ring->supports(IORING_OP_SEND_ZC);
+    return true;
+}
+
+void reactor_adopt(Handoff &handoff) {
+    adopted = std::move(handoff);
+}
+
+// Spread the connections of a handoff over the shards and pick up each session where the previous
+// server left it: its queued output is sent first, then the input it had read but not run
+static void adopt_connections() {
+    for (size_t i = shards.size(); i < adopted.listeners.size(); i++) close(adopted.listeners[i]);
+    for (size_t i = 0; i < adopted.connections.size(); i++) {
+        HandoffConnection &handed = adopted.connections[i];
+        Shard *shard = shards[i % shards.size()].get();
+        current_shard = shard;
+        set_nonblocking(handed.socket, !shard->ring);
+        Connection *conn = attach_connection(shard, handed.socket);
+        if (conn == nullptr) continue;
+        conn->session = std::move(handed.session);
+        conn->session.socket = handed.socket;
+        if (!session_restore(conn->session)) {
+            conn->dead = true;
+            schedule_close(conn);
+            continue;
+        }
+        if (!handed.output.empty()) enqueue_local(conn, Payload(handed.output));
+        if (conn->session.throttled) {
+            pause_connection(conn);
+        } else if (!session_resume(conn->session)) {
+            schedule_close(conn);
+            continue;
+        }
+        if (shard->ring && !conn->paused && !conn->closing) arm_recv(conn);
+        std::chrono::steady_clock::time_point next;
+        session_check_timeouts(conn->session, std::chrono::steady_clock::now(), next);
+        schedule_check(shard, conn, next);
+    }
+    for (auto &shard : shards) {
+        current_shard = shard.get();
+        reap_closed(shard.get());
+    }
+    current_shard = nullptr;
+    adopted = Handoff();
+}
+
+int run_epoll_server(ci server_socket) {
+    rlimit limit{};
+    getrlimit(RLIMIT_NOFILE, &limit);
+    socket_owner_size = std::min<rlim_t>(limit.rlim_cur, 1 << 22);
+    socket_owner.reset(new std::atomic<uint64_t>[socket_owner_size]());
+
+    int workers = config.workers > 0 ? config.workers : std::max(1u, std::thread::hardware_concurrency());
+    for (int i = 0; i < workers; i++) {
+        auto shard = std::make_unique<Shard>();
+        shard->id = i;
+        shard->timer_start = std::chrono::steady_clock::now();
+        shard->pool.reserve(config.connection_pool);
+        for (size_t n = 0; n < config.connection_pool; n++) shard->pool.push_back(new Connection());
+        // Shard 0 serves the socket created by main(), the others bind their own through SO_REUSEPORT
+        // unless the previous server handed theirs over
+        if (i == 0) {
+            shard->listen_socket = server_socket;
+        } else if ((size_t)i < adopted.listeners.size()) {
+            shard->listen_socket = adopted.listeners[i];
+        } else {
+            shard->listen_socket = create_server_socket(config.port);
+        }
+        if (config.io_mode == IoMode::URING && !setup_ring(shard.get())) {
+            if (i > 0) {
+                std::cerr << "Error: Cannot set up io_uring of worker " << i << "." << std::endl;
+                return 1;
+            }
+            std::cerr << "Warning: io_uring is not available, using epoll." << std::endl;
+            config.io_mode = IoMode::EPOLL;
+        }
+        if (shard->ring) {
+            // io_uring waits on blocking descriptors itself; O_NONBLOCK would make it fail with EAGAIN
+            shard->wake_fd = eventfd(0, EFD_CLOEXEC);
+            if (shard->listen_socket < 0 || shard->wake_fd < 0) {
+                std::cerr << "Error: Cannot set up worker " << i << "." << std::endl;
+                return 1;
+            }
+            set_nonblocking(shard->listen_socket, false);
+            shards.push_back(std::move(shard));
+            continue;
+        }
+        shard->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        shard->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (shard->listen_socket < 0 || shard->epoll_fd < 0 || shard->wake_fd < 0) {
+            std::cerr << "Error: Cannot set up worker " << i << "." << std::endl;
+            return 1;
+        }
+        set_nonblocking(shard->listen_socket);
+        if (!watch(shard.get(), shard->listen_socket, EPOLLIN | EPOLLET) || !watch(shard.get(), shard->wake_fd, EPOLLIN)) {
+            std::cerr << "Error: Cannot watch sockets of worker " << i << "." << std::endl;
+            return 1;
+        }
+        shards.push_back(std::move(shard));
+    }
+    adopt_connections();
+
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < shards.size(); i++) {
+        threads.emplace_back(run_shard, shards[i].get());
+    }
+    run_shard(shards[0].get());
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    return 0;
+}
+
+// Wait (briefly) for the sends in flight, so the final synchronous flush does not repeat their data
+static void settle_ring(Shard *shard) {
+    shard->stopping = true;
+    for (int round = 0; round < 20; round++) {
+        bool busy = false;
+        for (Connection *conn : shard->connections) {
+            if (conn != nullptr && conn->write_blocked && !conn->released) busy = true;
+        }
+        if (!busy) return;
+        shard->ring->submit_and_wait(50);
+        shard->ring->for_each_cqe([&](const io_uring_cqe &cqe) { complete(shard, cqe); });
+    }
+}
+
+void reactor_shutdown() {
+    for (auto &shard : shards) {
+        current_shard = shard.get();
+        if (shard->ring) settle_ring(shard.get());
+        drain_inbox(shard.get());
+        for (size_t socket = 0; socket < shard->connections.size(); socket++) {
+            if (shard->connections[socket] != nullptr) {
+                flush_connection(shard->connections[socket]);
+                close_connection(shard.get(), socket);
+            }
+        }
+        shard->closing.clear();
+        if (shard->ring) {
+            // Connections still referenced by the ring go with it
+            shard->ring.reset();
+            for (Connection *conn : shard->connections) {
+                if (conn != nullptr) release_connection(shard.get(), conn);
+            }
+        } else {
+            close(shard->epoll_fd);
+        }
+        if (shard->id != 0) close(shard->listen_socket);
+        close(shard->wake_fd);
+        for (Connection *conn : shard->pool) delete conn;
+    }
+    current_shard = nullptr;
+    shards.clear();
+}
+
+// Stop the ring from reading or accepting: cancel the multishot requests and run their last
+// completions, which may still carry input
+static void quiesce_ring(Shard *shard) {
+    settle_ring(shard);
+    if (shard->accepting) {
+        io_uring_sqe *sqe = shard->ring->get_sqe();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = user_data(OP_ACCEPT, 0, 0);
+        sqe->user_data = user_data(OP_CANCEL, 0, 0);
+    }
+    for (int round = 0; round < 20; round++) {
+        bool busy = shard->accepting;
+        for (Connection *conn : shard->connections) {
+            if (conn == nullptr || !conn->recv_armed) continue;
+            busy = true;
+            if (!conn->recv_cancelled) {
+                io_uring_sqe *sqe = shard->ring->get_sqe();
+                sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                sqe->addr = user_data(OP_RECV, conn->session.socket, conn->tag);
+                sqe->user_data = user_data(OP_CANCEL, conn->session.socket, conn->tag);
+                conn->recv_cancelled = true;
+            }
+        }
+        if (!busy) return;
+        shard->ring->submit_and_wait(50);
+        shard->ring->for_each_cqe([&](const io_uring_cqe &cqe) { complete(shard, cqe); });
+    }
+}
+
+void reactor_export(Handoff &handoff) {
+    // Every loop stops reading before any is exported, so a command run by a late completion can
+    // still reach clients of the other loops
+    for (auto &shard : shards) {
+        current_shard = shard.get();
+        if (shard->ring) quiesce_ring(shard.get());
+        shard->stopping = true;
+    }
+    for (auto &shard : shards) {
+        current_shard = shard.get();
+        handoff.listeners.push_back(shard->listen_socket);
+        shard->listen_socket = -1;
+        // Closing them first makes drain_inbox skip their pending logins
+        for (Connection *conn : shard->connections) {
+            if (conn == nullptr || conn->closing || conn->released || conn->session.state == SessionState::COMMAND) continue;
+            enqueue_local(conn, Payload(std::string("Error: Server restarting, please reconnect.\n")));
+            schedule_close(conn);
+        }
+        drain_inbox(shard.get());
+        for (size_t socket = 0; socket < shard->connections.size(); socket++) {
+            Connection *conn = shard->connections[socket];
+            if (conn == nullptr || conn->closing || conn->released) continue;
+            flush_connection(conn);
+            if (conn->closing) continue;
+
+            HandoffConnection &handed = handoff.connections.emplace_back();
+            handed.socket = socket;
+            size_t skip = conn->out.offset;
+            for (const OutMessage &message : conn->out.messages) {
+                handed.output.append(message.data.data() + skip, message.data.size() - skip);
+                skip = 0;
+            }
+            handed.session = std::move(conn->session);
+            // Forget the connection without session_close(): the client stays logged in
+            conn->released = true;
+            socket_owner[socket].store(0, std::memory_order_release);
+            shard->timers.cancel(conn);
+            shard->connections[socket] = nullptr;
+            if (!shard->ring) {
+                epoll_ctl(shard->epoll_fd, EPOLL_CTL_DEL, socket, nullptr);
+            }
+            // The ring may still read a send's buffers until it is torn down
+            if (conn->pending_ops == 0) free_connection(shard.get(), conn);
+        }
+        reap_closed(shard.get());
+    }
+    current_shard = nullptr;
+}
@@ -0,0 +1,46 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <cstddef>
+#include <functional>
+#include <vector>
+
+#include "payload.h"
+#include "server_grp.h"
+#include "upgrade.h"
+
+#define MAX_EVENTS 256
+
+// Runs `config.workers` edge-triggered epoll event loops until `running` is cleared.
+// The first loop serves `server_socket`, the others bind their own SO_REUSEPORT sockets.
+int run_epoll_server(ci server_socket);
+
+// True between the start of run_epoll_server and reactor_shutdown
+bool reactor_running();
+
+// Queues data on a reactor-owned socket, returns false if the socket is not managed by the reactor.
+// Sockets of another worker are reached through that worker's lock-free inbox.
+bool reactor_send(ci client_socket, const char *data, size_t len);
+
+// Queues several payloads on a reactor-owned socket as one message, written with as few sendmsg() calls as possible
+bool reactor_send_all(ci client_socket, const std::vector<Payload> &messages);
+
+// Queues one shared payload for many sockets with a single hand-off per worker
+void reactor_multicast(const Payload &payload, const std::vector<int> &sockets);
+
+// Runs task(session) on the worker that owns the socket, and closes the connection if it returns false.
+// Returns false if the socket is not managed by the reactor. The task is dropped if the connection closes first.
+bool reactor_post(ci client_socket, std::function<bool(Session &)> task);
+
+// Serve the listening sockets and connections of a handoff in the next run_epoll_server
+void reactor_adopt(Handoff &handoff);
+
+// Once the event loops stopped: asks the clients that had not logged in to reconnect, flushes the
+// others and moves them into the handoff without closing their sockets, along with every loop's
+// listening socket. reactor_shutdown() must still be called.
+void reactor_export(Handoff &handoff);
+
+// Flushes what can be written without blocking and closes every reactor connection
+void reactor_shutdown();
+
+#endif // REACTOR_H
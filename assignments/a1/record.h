@@ -0,0 +1,123 @@
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+// Framing shared by the append-only logs: every record is
+//
+//   uint32_t length, uint32_t checksum (FNV-1a of the body), body[length]
+//
+// with little-endian integers and length-prefixed strings inside the body. A reader stops at
+// the first record that is cut short or fails its checksum, i.e. at a torn write.
+
+inline uint32_t record_checksum(std::string_view data) {
+    uint32_t hash = 2166136261u;
+    for (unsigned char c : data) {
+        hash = (hash ^ c) * 16777619u;
+    }
+    return hash;
+}
+
+inline void put_u32(std::string &out, uint32_t value) {
+    out.append((const char *)&value, sizeof(value));
+}
+
+inline void put_u64(std::string &out, uint64_t value) {
+    out.append((const char *)&value, sizeof(value));
+}
+
+inline void put_string(std::string &out, std::string_view value) {
+    put_u32(out, value.size());
+    out.append(value);
+}
+
+// Length and checksum followed by the body
+inline std::string frame_record(std::string_view body) {
+    std::string record;
+    record.reserve(8 + body.size());
+    put_u32(record, body.size());
+    put_u32(record, record_checksum(body));
+    record.append(body);
+    return record;
+}
+
+// Calls f(body) for every intact record at the start of data until f returns false, returns
+// the number of bytes consumed by the records f accepted
+template <typename F>
+size_t scan_records(std::string_view data, F &&f) {
+    size_t pos = 0;
+    while (data.size() - pos >= 8) {
+        uint32_t len, sum;
+        memcpy(&len, data.data() + pos, sizeof(len));
+        memcpy(&sum, data.data() + pos + 4, sizeof(sum));
+        if (len > data.size() - pos - 8) break;
+        std::string_view body = data.substr(pos + 8, len);
+        if (record_checksum(body) != sum || !f(body)) break;
+        pos += 8 + len;
+    }
+    return pos;
+}
+
+// Sequential reader of a record body, every get fails once the body is exhausted
+struct RecordReader {
+    std::string_view rest;
+
+    bool get(uint8_t &value) {
+        if (rest.empty()) return false;
+        value = (uint8_t)rest[0];
+        rest.remove_prefix(1);
+        return true;
+    }
+
+    bool get(uint32_t &value) {
+        if (rest.size() < sizeof(value)) return false;
+        memcpy(&value, rest.data(), sizeof(value));
+        rest.remove_prefix(sizeof(value));
+        return true;
+    }
+
+    bool get(uint64_t &value) {
+        if (rest.size() < sizeof(value)) return false;
+        memcpy(&value, rest.data(), sizeof(value));
+        rest.remove_prefix(sizeof(value));
+        return true;
+    }
+
+    bool get(std::string_view &value) {
+        uint32_t len;
+        if (!get(len) || rest.size() < len) return false;
+        value = rest.substr(0, len);
+        rest.remove_prefix(len);
+        return true;
+    }
+};
+
+// write() everything, retrying short writes
+inline bool write_all(int fd, std::string_view data) {
+    size_t done = 0;
+    while (done < data.size()) {
+        ssize_t n = write(fd, data.data() + done, data.size() - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        done += n;
+    }
+    return true;
+}
+
+// Make the names created in a directory durable
+inline void sync_directory(const std::string &dir) {
+    int dir_fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd >= 0) {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+}
+
+#endif // RECORD_H
@@ -0,0 +1,102 @@
+#ifndef SENDQ_H
+#define SENDQ_H
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+
+#include "payload.h"
+#include "server_grp.h"
+
+// A message waiting in a connection's outbound queue
+struct OutMessage {
+    Payload data;         // Shared with every other recipient of the same fan-out
+    bool notice = false;  // Generated by the coalesce policy, not by a sender
+};
+
+// What push() did with the messages
+enum class Admit { QUEUED, COALESCED, DROPPED, DISCONNECT };
+
+// Outbound queue of one event loop connection. Once a push would take it past the high watermark
+// the queue is congested and every push goes through the overflow policy, until the socket drained
+// it to the low watermark. Not thread-safe: only the connection's event loop touches it.
+struct SendQueue {
+    std::deque<OutMessage> messages;  // Not written yet, flushed on EPOLLOUT
+    size_t offset = 0;                // Bytes of messages.front() already written
+    size_t bytes = 0;                 // Unwritten bytes in messages
+    bool congested = false;           // Set above the high watermark, cleared at the low watermark
+    uint64_t skipped = 0;             // Messages folded into the pending coalesce notice
+
+    bool empty() const { return messages.empty(); }
+
+    // Queue messages to be written together, or apply the overflow policy. On DISCONNECT the
+    // caller closes the connection; the queue is left as it was.
+    Admit push(const Payload *added, size_t count, size_t high, OverflowPolicy policy) {
+        size_t len = 0;
+        for (size_t i = 0; i < count; i++) len += added[i].size();
+        if (bytes > 0 && bytes + len > high) congested = true;
+        Admit admit = Admit::QUEUED;
+        if (congested) {
+            switch (policy) {
+            case OverflowPolicy::DROP:
+                return Admit::DROPPED;
+            case OverflowPolicy::DISCONNECT:
+                return Admit::DISCONNECT;
+            case OverflowPolicy::COALESCE:
+                coalesce();
+                admit = Admit::COALESCED;
+                break;
+            }
+        }
+        for (size_t i = 0; i < count; i++) messages.push_back(OutMessage{added[i]});
+        bytes += len;
+        return admit;
+    }
+
+    // Drop `sent` bytes from the front
+    void consume(size_t sent) {
+        bytes -= sent;
+        while (sent > 0) {
+            size_t remaining = messages.front().data.size() - offset;
+            if (sent < remaining) {
+                offset += sent;
+                break;
+            }
+            sent -= remaining;
+            messages.pop_front();
+            offset = 0;
+        }
+    }
+
+    // Bookkeeping once the socket took what it could
+    void flushed(size_t low) {
+        if (congested && bytes <= low) congested = false;
+        if (messages.empty()) skipped = 0;
+    }
+
+    void clear() {
+        messages.clear();
+        offset = 0;
+        bytes = 0;
+    }
+
+   private:
+    // Replace every message that has not started transmitting with one notice counting them
+    void coalesce() {
+        size_t keep = (offset > 0) ? 1 : 0;
+        while (messages.size() > keep) {
+            OutMessage &last = messages.back();
+            if (!last.notice) skipped++;
+            bytes -= last.data.size();
+            messages.pop_back();
+        }
+        OutMessage notice;
+        notice.data = Payload("... " + std::to_string(skipped) + " messages skipped, connection too slow ...\n");
+        notice.notice = true;
+        bytes += notice.data.size();
+        messages.push_back(std::move(notice));
+    }
+};
+
+#endif // SENDQ_H
@@ -1,16 +1,32 @@
 #include "server_grp.h"
+#include "reactor.h"
+#include "auth.h"
+#include "msglog.h"
+#include "groupstore.h"
+#include "presence.h"
+#include "upgrade.h"
+#include "capture.h"
 
 #include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/resource.h>
 #include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include <algorithm>
 #include <atomic>
+#include <charconv>
+#include <climits>
 #include <csignal>
 #include <cstdlib>
 #include <cstring>
 #include <fstream>
 #include <functional>
+#include <future>
 #include <iostream>
 #include <mutex>
 #include <sstream>
@@ -20,125 +36,393 @@
 #include <unordered_set>
 #include <vector>
 
-std::mutex clients_mutex;
-std::unordered_map<int, std::string> clients;                            // Maps socket to username
-std::unordered_map<std::string, std::unordered_set<int>> groups;         // Maps group name to set of client sockets
+SocketLayer *socket_layer = nullptr;
+TimedMutex clients_mutex;                                                // Serializes writers of the directory
+Interner user_ids;                                                       // Usernames <-> dense user ids
+Interner group_ids;                                                      // Group names <-> dense group ids
+std::atomic<const Directory *> directory(new Directory);                 // Current snapshot of clients and groups
 std::unordered_map<std::string, std::string> user_credentials;           // Stores username-password pairs
-std::unordered_map<std::string, std::unordered_set<std::string>> users;  // Maps username to set of groups
+std::atomic<const CredentialIndex *> credential_index(nullptr);          // Mapped credential index, used instead of user_credentials
+
+static const IdSet no_ids;
+
+const IdSet &Directory::members(uint32_t group_id) const {
+    const IdSet *set = group_members.get(group_id).get();
+    return set ? *set : no_ids;
+}
+
+const IdSet &Directory::groups_of(uint32_t user_id) const {
+    const IdSet *set = user_groups.get(user_id).get();
+    return set ? *set : no_ids;
+}
+
+// Mark a user as connected on a socket
+void Directory::attach(int socket, uint32_t user_id) {
+    socket_user.set(socket, user_id);
+    user_socket.set(user_id, socket);
+}
+
+// Mark the user on a socket as offline
+void Directory::detach(int socket) {
+    uint32_t user_id = user_of(socket);
+    if (user_id == NO_ID) return;
+    socket_user.set(socket, NO_ID);
+    user_socket.set(user_id, -1);
+}
+
+// Add a user to a group, creating the group if needed. Both sets are copied, the published ones stay intact.
+void Directory::join(uint32_t group_id, uint32_t user_id) {
+    if (group_history.get(group_id) == nullptr) group_history.set(group_id, std::make_shared<GroupHistory>());
+    auto members = std::make_shared<IdSet>(this->members(group_id));
+    auto groups = std::make_shared<IdSet>(groups_of(user_id));
+    members->insert(user_id);
+    groups->insert(group_id);
+    group_members.set(group_id, members);
+    user_groups.set(user_id, groups);
+}
+
+// Remove a user from a group, returns false if it was not a member
+bool Directory::leave(uint32_t group_id, uint32_t user_id) {
+    if (!members(group_id).contains(user_id)) return false;
+    auto members = std::make_shared<IdSet>(this->members(group_id));
+    auto groups = std::make_shared<IdSet>(groups_of(user_id));
+    members->erase(user_id);
+    groups->erase(group_id);
+    group_members.set(group_id, members);
+    user_groups.set(user_id, groups);
+    return true;
+}
+
+// Sockets of the connected members of a group, except one
+static std::vector<int> online_members(const Directory &dir, uint32_t group_id, ci except_socket) {
+    std::vector<int> sockets;
+    dir.members(group_id).for_each([&](uint32_t user_id) {
+        int socket = dir.socket_of(user_id);
+        if (socket >= 0 && socket != except_socket) sockets.push_back(socket);
+    });
+    return sockets;
+}
+
+// Sockets of every connected client, except one
+static std::vector<int> connected_sockets(ci except_socket) {
+    std::vector<int> sockets;
+    RcuReadGuard guard;
+    directory.load()->socket_user.for_each([&](size_t socket, uint32_t) {
+        if ((int)socket != except_socket) sockets.push_back(socket);
+    });
+    return sockets;
+}
 
 // Trim leading and trailing whitespaces
 std::string trim(cstr str) {
-    std::string _str = str;
-    _str.erase(0, _str.find_first_not_of(" \n\r\t"));
-    _str.erase(_str.find_last_not_of(" \n\r\t") + 1);
-    return _str;
+    return std::string(trim_view(str));
 }
 
-// Load user credentials from "users.txt"
+// Load user credentials, from the index if there is one and from "users.txt" otherwise
 void load_credentials() {
-    std::ifstream file("users.txt");
-    std::string line;
-    while (std::getline(file, line)) {
-        std::istringstream iss(line);
-        std::string username, password;
-        if (std::getline(iss, username, ':') && std::getline(iss, password)) {
-            password = trim(password);
-            user_credentials[username] = password;
-        }
+    if (access(config.credentials_path.c_str(), F_OK) == 0 && reload_credentials()) return;
+    for (auto &[username, password] : read_credentials_file("users.txt")) {
+        user_credentials[username] = password;
     }
 }
 
+// Map the credential index again and swap it in. Logins in progress finish on the old mapping,
+// which is unmapped once they are done. On error the current credentials stay in use.
+bool reload_credentials() {
+    static std::mutex reload_mutex;
+    std::string error;
+    std::unique_ptr<CredentialIndex> index = CredentialIndex::open(config.credentials_path, error);
+    if (!index) {
+        std::cerr << "Error: Cannot load credentials: " << error << "." << std::endl;
+        return false;
+    }
+    std::cout << "Loaded " << index->size() << " credentials from " << config.credentials_path << std::endl;
+    std::lock_guard<std::mutex> lock(reload_mutex);
+    rcu_publish<CredentialIndex>(credential_index, index.release());
+    return true;
+}
+
+// True if the user has credentials, whether or not it is connected
+static bool known_user(cstr username) {
+    RcuReadGuard guard;
+    const CredentialIndex *index = credential_index.load();
+    if (index != nullptr) return index->contains(username);
+    return user_credentials.count(username) > 0;
+}
+
+// True if the password is valid for the user
+bool check_credentials(cstr username, cstr password) {
+    RcuReadGuard guard;
+    const CredentialIndex *index = credential_index.load();
+    if (index != nullptr) return index->verify(username, password);
+    auto it = user_credentials.find(username);
+    return it != user_credentials.end() && it->second == password;
+}
+
+// Sends to one socket are serialized, so that messages from concurrent handlers never interleave
+static std::mutex send_locks[64];
+
+// Messages sent by this thread, the fan-out a command is charged for
+static thread_local uint64_t thread_sends = 0;
+
+// Show a message to the capture, then hand it to the socket layer if one is installed.
+// Returns true if the socket layer took it.
+static bool divert(const int *sockets, size_t count, const iovec *parts, size_t n) {
+    if (capture_running()) capture_output(sockets, count, parts, n);
+    if (socket_layer == nullptr) return false;
+    socket_layer->send(sockets, count, parts, n);
+    return true;
+}
+
 // Utility function to send a message to a client
 void send_message(cstr message, ci client_socket) {
+    thread_sends++;
+    metrics_sent(1, message.size());
+    iovec part = {const_cast<char *>(message.data()), message.size()};
+    if (divert(&client_socket, 1, &part, 1)) return;
+    if (reactor_send(client_socket, message.data(), message.size())) return;
+    std::lock_guard<std::mutex> lock(send_locks[client_socket % 64]);
     send(client_socket, message.c_str(), message.size(), 0);
 }
 
+// Send several payloads as one message: one hand-off in the event loop modes, one sendmsg() otherwise
+void send_payloads(const std::vector<Payload> &messages, ci client_socket) {
+    thread_sends++;
+    size_t bytes = 0;
+    for (const Payload &message : messages) bytes += message.size();
+    metrics_sent(1, bytes);
+    std::vector<iovec> iov;
+    for (const Payload &message : messages) {
+        iov.push_back({const_cast<char *>(message.data()), message.size()});
+    }
+    if (divert(&client_socket, 1, iov.data(), iov.size())) return;
+    if (reactor_send_all(client_socket, messages)) return;
+    std::lock_guard<std::mutex> lock(send_locks[client_socket % 64]);
+    size_t first = 0;
+    while (first < iov.size()) {
+        msghdr msg{};
+        msg.msg_iov = iov.data() + first;
+        msg.msg_iovlen = std::min<size_t>(iov.size() - first, IOV_MAX);
+        ssize_t sent = sendmsg(client_socket, &msg, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent <= 0) return;
+        for (; first < iov.size() && (size_t)sent >= iov[first].iov_len; first++) sent -= iov[first].iov_len;
+        if (first < iov.size()) {
+            iov[first].iov_base = (char *)iov[first].iov_base + sent;
+            iov[first].iov_len -= sent;
+        }
+    }
+}
+
+// Send the same message to many clients, formatting it into one shared buffer in epoll mode
+void multicast_message(cstr message, const std::vector<int> &recipients) {
+    thread_sends += recipients.size();
+    metrics_sent(recipients.size(), message.size());
+    iovec part = {const_cast<char *>(message.data()), message.size()};
+    if (divert(recipients.data(), recipients.size(), &part, 1)) return;
+    if (reactor_running()) {
+        reactor_multicast(Payload(message), recipients);
+        return;
+    }
+    for (int socket : recipients) {
+        std::lock_guard<std::mutex> lock(send_locks[socket % 64]);
+        send(socket, message.c_str(), message.size(), 0);
+    }
+}
+
+// Send a formatted payload to many clients
+void multicast_message(const Payload &message, const std::vector<int> &recipients) {
+    thread_sends += recipients.size();
+    metrics_sent(recipients.size(), message.size());
+    iovec part = {const_cast<char *>(message.data()), message.size()};
+    if (divert(recipients.data(), recipients.size(), &part, 1)) return;
+    if (reactor_running()) {
+        reactor_multicast(message, recipients);
+        return;
+    }
+    for (int socket : recipients) {
+        std::lock_guard<std::mutex> lock(send_locks[socket % 64]);
+        send(socket, message.data(), message.size(), 0);
+    }
+}
+
+// The /history reply: a header line, then the messages one per line
+static std::vector<Payload> history_reply(cstr group_name, const std::vector<Payload> &messages) {
+    static const Payload &newline = *new Payload("\n", 1);  // Never freed, shared by every reply
+    std::vector<Payload> parts;
+    parts.reserve(messages.size() * 2 + 1);
+    parts.emplace_back("History of group " + group_name + " (" + std::to_string(messages.size()) + " messages):\n");
+    for (const Payload &message : messages) {
+        parts.push_back(message);
+        parts.push_back(newline);
+    }
+    return parts;
+}
+
 // Create a group
 void create_group(cstr group_name, cstr username, ci client_socket) {
-    std::lock_guard<std::mutex> lock(clients_mutex);
-    if (groups.find(group_name) == groups.end()) {
-        groups[group_name] = {client_socket};
-        users[username].insert(group_name);
-        send_message("Group " + group_name + " created.\n", client_socket);
-    } else {
-        send_message("Error: Group " + group_name + " already exists!\n", client_socket);
+    uint64_t seq = 0;
+    {
+        std::lock_guard<TimedMutex> lock(clients_mutex);
+        uint32_t group_id = group_ids.intern(group_name);
+        if (group_id == NO_ID) {
+            send_message("Error: The server cannot hold more groups!\n", client_socket);
+            return;
+        }
+        if (directory.load()->has_group(group_id)) {
+            send_message("Error: Group " + group_name + " already exists!\n", client_socket);
+            return;
+        }
+        uint32_t user_id = user_ids.intern(username);
+        if (user_id == NO_ID) {
+            send_message("Error: The server cannot hold more users!\n", client_socket);
+            return;
+        }
+        update_directory([&](Directory &dir) { dir.join(group_id, user_id); });
+        seq = group_store_append(GROUP_CREATE, group_name, username);
     }
+    group_store_commit(seq);
+    send_message("Group " + group_name + " created.\n", client_socket);
 }
 
 // Join a group
 void join_group(cstr group_name, cstr username, ci client_socket) {
-    std::lock_guard<std::mutex> lock(clients_mutex);
-    if (groups.find(group_name) != groups.end()) {
-        groups[group_name].insert(client_socket);
-        users[username].insert(group_name);
-        send_message("Joined group " + group_name + ".\n", client_socket);
-        for (auto &member : groups[group_name]) {
-            if (member != client_socket)
-                send_message("User " + username + " joined group " + group_name + ".", member);
+    std::vector<int> recipients;
+    std::shared_ptr<GroupHistory> history;
+    uint64_t seq = 0;
+    uint32_t group_id;
+    {
+        std::lock_guard<TimedMutex> lock(clients_mutex);
+        group_id = group_ids.find(group_name);
+        if (!directory.load()->has_group(group_id)) {
+            send_message("Error: Group " + group_name + " does not exist!\n", client_socket);
+            return;
         }
-    } else {
-        send_message("Error: Group " + group_name + " does not exist!\n", client_socket);
+        uint32_t user_id = user_ids.intern(username);
+        if (user_id == NO_ID) {
+            send_message("Error: The server cannot hold more users!\n", client_socket);
+            return;
+        }
+        update_directory([&](Directory &dir) { dir.join(group_id, user_id); });
+        seq = group_store_append(GROUP_JOIN, group_name, username);
+        recipients = online_members(*directory.load(), group_id, client_socket);
+        history = directory.load()->group_history.get(group_id);
+    }
+    group_store_commit(seq);
+    send_message("Joined group " + group_name + ".\n", client_socket);
+    // Catch up on the conversation from memory
+    if (history != nullptr && history->size() > 0) {
+        send_payloads(history_reply(group_name, history->recent(0)), client_socket);
     }
+    announce_presence(group_id, true, "User " + username + " joined group " + group_name + ".", recipients);
 }
 
 // Leave a group
 void leave_group(cstr group_name, cstr username, ci client_socket) {
-    std::lock_guard<std::mutex> lock(clients_mutex);
-    if (groups.find(group_name) != groups.end()) {
-        if (groups[group_name].find(client_socket) == groups[group_name].end()) {
-            send_message("You already are not a member of this group.\n", client_socket);
+    std::vector<int> recipients;
+    uint64_t seq = 0;
+    uint32_t group_id;
+    {
+        std::lock_guard<TimedMutex> lock(clients_mutex);
+        group_id = group_ids.find(group_name);
+        if (!directory.load()->has_group(group_id)) {
+            send_message("Error: Group " + group_name + " does not exist!\n", client_socket);
             return;
         }
-        groups[group_name].erase(client_socket);
-        users[username].erase(group_name);
-        send_message("Left group " + group_name + ".\n", client_socket);
-        for (auto &member : groups[group_name]) {
-            if (member != client_socket)
-                send_message("User " + username + " left the group" + group_name + ".", member);
+        uint32_t user_id = user_ids.find(username);
+        bool left = false;
+        update_directory([&](Directory &dir) { left = user_id != NO_ID && dir.leave(group_id, user_id); });
+        if (!left) {
+            send_message("You already are not a member of this group.\n", client_socket);
+            return;
         }
-    } else {
-        send_message("Error: Group " + group_name + " does not exist!\n", client_socket);
+        seq = group_store_append(GROUP_LEAVE, group_name, username);
+        recipients = online_members(*directory.load(), group_id, client_socket);
     }
+    group_store_commit(seq);
+    send_message("Left group " + group_name + ".\n", client_socket);
+    announce_presence(group_id, false, "User " + username + " left the group" + group_name + ".", recipients);
 }
 
 // Broadcast message to all connected clients
 void broadcast_message(cstr message, ci sender_socket) {
-    std::lock_guard<std::mutex> lock(clients_mutex);
-    for (const auto &[socket, username] : clients) {
-        if (socket != sender_socket) {
-            send_message(message, socket);
+    multicast_message(message, connected_sockets(sender_socket));
+}
+
+// Hand messages just kept for users who logged in meanwhile to them. A login attaches its user
+// before it takes the backlog, and both steps and store_offline are ordered by the log's lock, so
+// a message stored after the login took the backlog is seen online here.
+static void deliver_late(const std::vector<std::string> &recipients) {
+    for (cstr recipient : recipients) {
+        int socket;
+        {
+            RcuReadGuard guard;
+            socket = directory.load()->socket_of(user_ids.find(recipient));
         }
+        if (socket < 0) continue;
+        std::string backlog = take_backlog(recipient);
+        if (!backlog.empty()) send_message(backlog, socket);
     }
 }
 
-// Send a private message to a specific user
+// Send a private message to a specific user, or keep it until they log in
 void private_message(cstr recipient, cstr message, ci sender_socket) {
-    std::lock_guard<std::mutex> lock(clients_mutex);
-    for (const auto &[socket, username] : clients) {
-        if (username == recipient) {
-            send_message(message, socket);
-            return;
-        }
+    int socket;
+    uint32_t sender_id;
+    {
+        RcuReadGuard guard;
+        socket = directory.load()->socket_of(user_ids.find(recipient));
+        sender_id = directory.load()->user_of(sender_socket);
+    }
+    if (socket >= 0) {
+        send_message(message, socket);
+    } else if (known_user(recipient)) {
+        // Confirmed once the message is on disk, unless the sender's socket changed hands or the
+        // recipient logged in meanwhile
+        store_offline({recipient}, message, [recipient, sender_socket = (int)sender_socket, sender_id]() {
+            RcuReadGuard guard;
+            const Directory &dir = *directory.load();
+            if (dir.user_of(sender_socket) != sender_id || dir.socket_of(user_ids.find(recipient)) >= 0) return;
+            send_message("User " + recipient + " is offline, the message will be delivered when they log in.\n", sender_socket);
+        });
+        deliver_late({recipient});
+    } else {
+        send_message("Error: User " + recipient + " not found!\n", sender_socket);
     }
-    send_message("Error: User " + recipient + " not found!\n", sender_socket);
 }
 
-// Send a message to all members of a group
+// Send a message to all members of a group, members who are offline get it when they log in
 void group_message(cstr group_name, cstr message, ci sender_socket) {
-    std::lock_guard<std::mutex> lock(clients_mutex);
-    if (groups.find(group_name) == groups.end()) {
-        send_message("Error: Group does not exist!\n", sender_socket);
-        return;
-    }
-    if (groups[group_name].find(sender_socket) == groups[group_name].end()) {
-        send_message("Error: You are not a member of this group!\n", sender_socket);
-        return;
-    }
-    for (int socket : groups[group_name]) {
-        if (socket != sender_socket) {
-            send_message("[" + group_name + "] @" + clients[sender_socket] + " : " + message, socket);
+    std::vector<int> recipients;
+    std::vector<std::string> offline;
+    std::string sender;
+    std::shared_ptr<GroupHistory> history;
+    {
+        RcuReadGuard guard;
+        const Directory &dir = *directory.load();
+        uint32_t group_id = group_ids.find(group_name);
+        if (!dir.has_group(group_id)) {
+            send_message("Error: Group does not exist!\n", sender_socket);
+            return;
+        }
+        uint32_t sender_id = dir.user_of(sender_socket);
+        if (sender_id == NO_ID || !dir.members(group_id).contains(sender_id)) {
+            send_message("Error: You are not a member of this group!\n", sender_socket);
+            return;
         }
+        sender = user_ids.name(sender_id);
+        recipients = online_members(dir, group_id, sender_socket);
+        dir.members(group_id).for_each([&](uint32_t user_id) {
+            if (dir.socket_of(user_id) < 0) offline.push_back(user_ids.name(user_id));
+        });
+        history = dir.group_history.get(group_id);
     }
+    std::string formatted = "[" + group_name + "] @" + sender + " : " + message;
+    Payload payload(formatted);
+    if (history != nullptr) history->append(payload);
+    multicast_message(payload, recipients);
+    store_offline(offline, formatted);
+    deliver_late(offline);
 }
 
 // List all commands
@@ -151,6 +435,7 @@ void list_commands(ci client_socket) {
     commands += "/leave_group <group_name> : Leave a group\n";
     commands += "/list_members <group_name> : List all members of a group\n";
     commands += "/list_groups : List all groups in which the user is a member\n";
+    commands += "/history <group_name> [n] : Show the last n (default all kept) messages of a group\n";
     commands += "/list_commands : List all commands (to print this)\n";
     commands += "/exit : Exit the server\n";
     send_message(commands, client_socket);
@@ -158,154 +443,461 @@ void list_commands(ci client_socket) {
 
 // List all groups of a user
 void list_groups(cstr username, ci client_socket) {
-    std::lock_guard<std::mutex> lock(clients_mutex);
     std::string group_list = "You are in the following groups:\n";
-    for (auto &group : users[username]) {
-        group_list += group + "\n";
-    }
-    if (users[username].size() == 0) {
-        group_list = "You are not a member of any group.\n";
+    {
+        RcuReadGuard guard;
+        const IdSet &groups = directory.load()->groups_of(user_ids.find(username));
+        if (groups.empty()) {
+            group_list = "You are not a member of any group.\n";
+        }
+        groups.for_each([&](uint32_t group_id) {
+            group_list += group_ids.name(group_id) + "\n";
+        });
     }
     send_message(group_list, client_socket);
 }
 
-// List all members of a group
+// List the connected members of a group
 void list_members(cstr group_name, ci client_socket) {
-    if (groups.find(group_name) == groups.end()) {
-        send_message("Error: Group " + group_name + " does not exist!\n", client_socket);
-        return;
-    }
-    if (groups[group_name].find(client_socket) == groups[group_name].end()) {
-        send_message("Error: You are not a member of this group!\n", client_socket);
-        return;
-    }
     std::string members = "Members of group " + group_name + ":\n";
     {
-        std::lock_guard<std::mutex> lock(clients_mutex);
-        if (groups.find(group_name) != groups.end()) {
-            for (int socket : groups[group_name]) {
-                members += clients[socket] + "\n";
+        RcuReadGuard guard;
+        const Directory &dir = *directory.load();
+        uint32_t group_id = group_ids.find(group_name);
+        if (!dir.has_group(group_id)) {
+            send_message("Error: Group " + group_name + " does not exist!\n", client_socket);
+            return;
+        }
+        uint32_t user_id = dir.user_of(client_socket);
+        if (user_id == NO_ID || !dir.members(group_id).contains(user_id)) {
+            send_message("Error: You are not a member of this group!\n", client_socket);
+            return;
+        }
+        dir.members(group_id).for_each([&](uint32_t member_id) {
+            if (dir.socket_of(member_id) >= 0) {
+                members += user_ids.name(member_id) + "\n";
             }
-            send_message(members, client_socket);
+        });
+    }
+    send_message(members, client_socket);
+}
+
+// Replay the last messages of a group, as one vectored write
+void send_history(cstr group_name, size_t count, ci client_socket) {
+    std::shared_ptr<GroupHistory> history;
+    {
+        RcuReadGuard guard;
+        const Directory &dir = *directory.load();
+        uint32_t group_id = group_ids.find(group_name);
+        if (!dir.has_group(group_id)) {
+            send_message("Error: Group " + group_name + " does not exist!\n", client_socket);
+            return;
+        }
+        uint32_t user_id = dir.user_of(client_socket);
+        if (user_id == NO_ID || !dir.members(group_id).contains(user_id)) {
+            send_message("Error: You are not a member of this group!\n", client_socket);
+            return;
         }
+        history = dir.group_history.get(group_id);
     }
+    send_payloads(history_reply(group_name, history != nullptr ? history->recent(count) : std::vector<Payload>()), client_socket);
 }
 
-// Command handlers for group commands
-std::unordered_map<std::string, std::function<void(cstr, cstr, ci)>> grpcmd = {
-    {"/group_msg", group_message},
-    {"/create_group", create_group},
-    {"/join_group", join_group},
-    {"/leave_group", leave_group},
-};
+// Mark a client as offline. Memberships are kept by user id, so no group has to be touched.
+static void unregister_client(Session &session) {
+    std::lock_guard<TimedMutex> lock(clients_mutex);
+    if (directory.load()->user_of(session.socket) != NO_ID) {
+        update_directory([&](Directory &dir) { dir.detach(session.socket); });
+    }
+}
 
-// Handle individual client connection
-void handle_client(ci client_socket) {
-    char buffer[BUFFER_SIZE];
-
-    // Authentication
-    send_message("Enter username: ", client_socket);
-    memset(buffer, 0, BUFFER_SIZE);
-    recv(client_socket, buffer, BUFFER_SIZE, 0);
-    std::string username = trim(buffer);
-
-    send_message("Enter password: ", client_socket);
-    memset(buffer, 0, BUFFER_SIZE);
-    recv(client_socket, buffer, BUFFER_SIZE, 0);
-    std::string password = trim(buffer);
-
-    if ((user_credentials.find(username) == user_credentials.end()) || (user_credentials[username] != password)) {
-        send_message("Authentication failed.\n", client_socket);
-        close(client_socket);
-        return;
+// Add an authenticated client to the connected list
+static bool finish_login(Session &session, bool authenticated) {
+    cstr username = session.username;
+    capture_login(session, authenticated ? LOGIN_OK : LOGIN_FAILED);
+    if (!authenticated) {
+        send_message("Authentication failed.\n", session.socket);
+        session.state = SessionState::CLOSING;
+        return false;
     }
 
-    // Do not allow multiple connections
     {
-        std::lock_guard<std::mutex> lock(clients_mutex);
-        for (const auto &[socket, user] : clients) {
-            if (user == username) {
-                send_message("Error: User already connected!\n", client_socket);
-                close(client_socket);
-                return;
-            }
+        std::lock_guard<TimedMutex> lock(clients_mutex);
+        uint32_t user_id = user_ids.intern(username);
+        if (user_id == NO_ID) {
+            send_message("Error: The server cannot hold more users!\n", session.socket);
+            session.state = SessionState::CLOSING;
+            return false;
+        }
+        // Do not allow multiple connections
+        if (directory.load()->socket_of(user_id) >= 0) {
+            send_message("Error: User already connected!\n", session.socket);
+            session.state = SessionState::CLOSING;
+            return false;
         }
+        update_directory([&](Directory &dir) { dir.attach(session.socket, user_id); });
     }
+    session.state = SessionState::COMMAND;
 
-    // Add client to the list
-    {
-        std::lock_guard<std::mutex> lock(clients_mutex);
-        clients[client_socket] = username;
-        for (const auto &group_name : users[username]) {
-            groups[group_name].insert(client_socket);
+    send_message("Welcome to the server, " + username + "!\n", session.socket);
+    std::string backlog = take_backlog(username);
+    if (!backlog.empty()) send_message(backlog, session.socket);
+    announce_presence(PRESENCE_SERVER, true, "User " + username + " joined the server!", connected_sockets(session.socket));
+    return true;
+}
+
+// Feed the input held back during AUTH_WAIT or a throttle. If it throttles the session again,
+// the rest is held back once more.
+static bool replay_input(Session &session) {
+    std::vector<std::string> deferred;
+    deferred.swap(session.deferred);
+    for (cstr message : deferred) {
+        if (!session_input(session, message.data(), message.size())) return false;
+    }
+    return !session.framed || session_receive(session, nullptr, 0);
+}
+
+// Answer of the auth pool for an event loop connection, then replay the input that waited for it
+static bool resume_login(Session &session, uint64_t ticket, bool authenticated) {
+    if (session.state != SessionState::AUTH_WAIT || session.auth_ticket != ticket) return true;
+    if (!finish_login(session, authenticated)) return false;
+    return replay_input(session);
+}
+
+// Hand the password to the auth pool. A thread-per-client session waits for the answer, an event
+// loop session goes on to other connections and is resumed through reactor_post().
+static bool login(Session &session, cstr password) {
+    static std::atomic<uint64_t> next_ticket(1);
+    session.state = SessionState::AUTH_WAIT;
+    session.auth_ticket = next_ticket.fetch_add(1, std::memory_order_relaxed);
+
+    AuthRequest request{session.username, password, nullptr};
+    std::future<bool> answer;
+    if (reactor_running()) {
+        request.done = [socket = session.socket, ticket = session.auth_ticket](bool authenticated) {
+            reactor_post(socket, [=](Session &s) { return resume_login(s, ticket, authenticated); });
+        };
+    } else {
+        auto promise = std::make_shared<std::promise<bool>>();
+        answer = promise->get_future();
+        request.done = [promise](bool authenticated) { promise->set_value(authenticated); };
+    }
+    if (!auth_submit(std::move(request))) {
+        capture_login(session, LOGIN_BUSY);
+        send_message("Error: Server busy, try again later.\n", session.socket);
+        session.state = SessionState::CLOSING;
+        return false;
+    }
+    return answer.valid() ? finish_login(session, answer.get()) : true;
+}
+
+// Build "<prefix><username> : <message>" with a single allocation
+static std::string format_message(std::string_view prefix, cstr username, std::string_view message) {
+    std::string formatted;
+    formatted.reserve(prefix.size() + username.size() + 3 + message.size());
+    formatted.append(prefix).append(username).append(" : ").append(message);
+    return formatted;
+}
+
+// Records how long a command took once it goes out of scope
+struct CommandTimer {
+    Command command;
+    std::chrono::steady_clock::time_point start;
+
+    explicit CommandTimer(Command command) : command(command) {
+        if (config.metrics) start = std::chrono::steady_clock::now();
+    }
+    ~CommandTimer() {
+        if (config.metrics) metrics_command((unsigned)command, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+    }
+};
+
+// Execute one command of an authenticated client, returns false once the client leaves
+static bool process_command(Session &session, std::string_view command) {
+    cstr username = session.username;
+    ci client_socket = session.socket;
+    Tokenizer tokens(command);
+    std::string_view cmd = tokens.next();
+    CommandTimer timer(parse_command(cmd));
+
+    switch (timer.command) {
+    case Command::BROADCAST:
+        broadcast_message(format_message("(broadcast) @", username, tokens.rest_of_line()), client_socket);
+        break;
+    case Command::MSG: {
+        std::string recipient(tokens.next());
+        private_message(recipient, format_message("(private) @", username, tokens.rest_of_line()), client_socket);
+        break;
+    }
+    case Command::GROUP_MSG: {
+        std::string group_name(tokens.next());
+        group_message(group_name, std::string(tokens.rest_of_line()), client_socket);
+        break;
+    }
+    case Command::CREATE_GROUP:
+        create_group(std::string(tokens.next()), username, client_socket);
+        break;
+    case Command::JOIN_GROUP:
+        join_group(std::string(tokens.next()), username, client_socket);
+        break;
+    case Command::LEAVE_GROUP:
+        leave_group(std::string(tokens.next()), username, client_socket);
+        break;
+    case Command::LIST_MEMBERS:
+        list_members(std::string(tokens.next()), client_socket);
+        break;
+    case Command::LIST_GROUPS:
+        list_groups(username, client_socket);
+        break;
+    case Command::LIST_COMMANDS:
+        list_commands(client_socket);
+        break;
+    case Command::HISTORY: {
+        std::string group_name(tokens.next());
+        std::string_view count_arg = tokens.next();
+        size_t count = 0;
+        if (!count_arg.empty() && (std::from_chars(count_arg.data(), count_arg.data() + count_arg.size(), count).ec != std::errc() || count == 0)) {
+            send_message("Error: Usage: /history <group_name> [n], n > 0.\n", client_socket);
+            break;
+        }
+        send_history(group_name, count, client_socket);
+        break;
+    }
+    case Command::PONG:
+        // Answer to a heartbeat, receiving it was all that mattered
+        break;
+    case Command::STATS:
+        if (config.admins.count(username) == 0) {
+            send_message("Error: /stats is for administrators only.\n", client_socket);
+            break;
+        }
+        send_message(metrics_report(), client_socket);
+        break;
+    case Command::EXIT:
+        unregister_client(session);
+        session.state = SessionState::CLOSING;
+        announce_presence(PRESENCE_SERVER, false, "User " + username + " left the server. :/", connected_sockets(client_socket));
+        return false;
+    case Command::UNKNOWN:
+        send_message("Error: Unknown command ( " + std::string(cmd.substr(0, 10)) + ((cmd.size() > 10) ? "... " : " ") + "). Run /list_commands to know the list of commands!\n", client_socket);
+        break;
+    }
+    return true;
+}
+
+// Charge a command to the client's token bucket, and throttle the client if that puts it in debt
+static void charge(Session &session, uint64_t cost) {
+    if (config.rate_limit == 0) return;
+    auto now = std::chrono::steady_clock::now();
+    double elapsed = std::chrono::duration<double>(now - session.refilled).count();
+    session.tokens = std::min<double>(config.rate_burst, session.tokens + elapsed * config.rate_limit) - cost;
+    session.refilled = now;
+    if (session.tokens >= 0) return;
+
+    auto pause = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::duration<double>(-session.tokens / config.rate_limit));
+    session.throttled = true;
+    session.throttled_until = now + pause;
+    stats.throttled.fetch_add(1, std::memory_order_relaxed);
+    stats.throttled_us.fetch_add(pause.count(), std::memory_order_relaxed);
+}
+
+// Start the authentication handshake of a new connection
+void session_open(Session &session) {
+    session.state = SessionState::AUTH_USER;
+    session.tokens = config.rate_burst;
+    session.refilled = session.opened = session.last_input = std::chrono::steady_clock::now();
+    capture_session_open(session);
+    send_message("Enter username: ", session.socket);
+}
+
+// Feed one message received from the client, returns false when the connection should be closed
+bool session_input(Session &session, const char *data, size_t len) {
+    std::string_view input = trim_view(std::string_view(data, len));
+    switch (session.state) {
+    case SessionState::AUTH_USER:
+        capture_input(session, std::string_view(data, len));
+        session.username = input;
+        session.state = SessionState::AUTH_PASS;
+        send_message("Enter password: ", session.socket);
+        return true;
+    case SessionState::AUTH_PASS:
+        return login(session, std::string(input));
+    case SessionState::AUTH_WAIT:
+        break;
+    case SessionState::COMMAND: {
+        if (session.throttled) break;
+        capture_input(session, std::string_view(data, len));
+        uint64_t sends = thread_sends;
+        bool open = process_command(session, input);
+        if (open) charge(session, 1 + thread_sends - sends);
+        return open;
+    }
+    case SessionState::CLOSING:
+        return false;
+    }
+    // Held back: only an unframed message gets here, framed input stays in inbuf
+    if (session.deferred.size() >= MAX_DEFERRED) return false;
+    session.deferred.emplace_back(data, len);
+    return true;
+}
+
+// Feed bytes received from the client, returns false when the connection should be closed.
+// A client that opens with PROTO_HELLO switches to newline framing: bytes are buffered and
+// every complete line is executed in order, so commands may be pipelined and split freely.
+// Other clients keep the original protocol where each recv() is exactly one message.
+bool session_receive(Session &session, const char *data, size_t len) {
+    static const size_t hello_len = strlen(PROTO_HELLO);
+    session.last_input = std::chrono::steady_clock::now();
+    session.pinged = false;
+    if (!session.framed && session.state == SessionState::AUTH_USER && len >= hello_len &&
+        memcmp(data, PROTO_HELLO, hello_len) == 0) {
+        session.framed = true;
+        capture_framed(session);
+        data += hello_len;
+        len -= hello_len;
+    }
+    if (!session.framed) {
+        return len == 0 || session_input(session, data, len);
+    }
+
+    session.inbuf.append(data, len);
+    size_t start = 0;
+    bool open = true;
+    while (open && session.state != SessionState::AUTH_WAIT && !session.throttled) {
+        size_t end = session.inbuf.find('\n', start);
+        if (end == std::string::npos) break;
+        open = session_input(session, session.inbuf.data() + start, end - start);
+        start = end + 1;
+    }
+    session.inbuf.erase(0, start);
+
+    if (open && !session.throttled && session.inbuf.size() > MAX_LINE_SIZE) {
+        send_message("Error: Message too long.\n", session.socket);
+        open = false;
+    }
+    return open;
+}
+
+// End the throttle of a session whose debt is paid off and run the input it held back.
+// Returns false when the connection should be closed.
+bool session_resume(Session &session) {
+    session.throttled = false;
+    return replay_input(session);
+}
+
+// Put a session handed over by the previous server (upgrade.h) back in the directory, without the
+// welcome and join notice of a login. Returns false if the user logged in again meanwhile.
+bool session_restore(Session &session) {
+    std::lock_guard<TimedMutex> lock(clients_mutex);
+    uint32_t user_id = user_ids.intern(session.username);
+    if (user_id == NO_ID || directory.load()->socket_of(user_id) >= 0) {
+        session.state = SessionState::CLOSING;
+        return false;
+    }
+    update_directory([&](Directory &dir) { dir.attach(session.socket, user_id); });
+    session.state = SessionState::COMMAND;
+    return true;
+}
+
+// Check the deadlines of a session: close it (returns false) if it did not log in within
+// --auth-timeout or stayed silent for --idle-timeout, and send a framed client a heartbeat after
+// --heartbeat of silence. `next` is set to when the deadlines must be checked again. Input does
+// not move a pending check, the check works out the deadlines from the latest input instead.
+bool session_check_timeouts(Session &session, std::chrono::steady_clock::time_point now, std::chrono::steady_clock::time_point &next) {
+    using std::chrono::seconds;
+    CaptureTimerScope timer;
+    next = std::chrono::steady_clock::time_point::max();
+    if (session.state == SessionState::CLOSING) return false;
+    if (session.state != SessionState::COMMAND) {
+        if (config.auth_timeout_s <= 0) return true;
+        next = session.opened + seconds(config.auth_timeout_s);
+        if (now < next) return true;
+        send_message("Error: Login timed out.\n", session.socket);
+        stats.auth_timeouts.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    if (config.idle_timeout_s > 0) {
+        next = session.last_input + seconds(config.idle_timeout_s);
+        if (now >= next) {
+            send_message("Error: Disconnected after " + std::to_string(config.idle_timeout_s) + " seconds of inactivity.\n", session.socket);
+            stats.idle_timeouts.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+    }
+    if (config.heartbeat_s > 0 && session.framed && !session.pinged) {
+        auto due = session.last_input + seconds(config.heartbeat_s);
+        if (now >= due) {
+            send_message("/ping\n", session.socket);
+            session.pinged = true;
+            stats.heartbeats.fetch_add(1, std::memory_order_relaxed);
+        } else {
+            next = std::min(next, due);
         }
     }
+    return true;
+}
+
+// Release the server state held by a connection that went away
+void session_close(Session &session) {
+    capture_session_close(session);
+    if (session.state == SessionState::COMMAND) {
+        unregister_client(session);
+    }
+    session.state = SessionState::CLOSING;
+}
 
-    send_message("Welcome to the server, " + username + "!\n", client_socket);
-    broadcast_message("User " + username + " joined the server!", client_socket);
+// Make recv() on a blocking socket give up after `timeout`, none if it is max()
+static void set_recv_timeout(ci client_socket, std::chrono::steady_clock::duration timeout) {
+    auto us = std::chrono::duration_cast<std::chrono::microseconds>(timeout).count();
+    timeval tv{};
+    if (timeout != std::chrono::steady_clock::duration::max()) {
+        us = std::max<long long>(us, 1000);
+        tv.tv_sec = us / 1000000;
+        tv.tv_usec = us % 1000000;
+    }
+    setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+}
+
+// Serve an open session until the connection ends (thread-per-client mode). The thread is the
+// only one waiting on its socket, so a receive timeout stands in for the event loops' timer wheel.
+static void serve_client(Session &session) {
+    char buffer[READ_CHUNK];
+    ci client_socket = session.socket;
+    auto next_check = std::chrono::steady_clock::now();
 
-    // Handle client commands
     while (true) {
-        memset(buffer, 0, BUFFER_SIZE);
-        int bytes_received = recv(client_socket, buffer, BUFFER_SIZE, 0);
-
-        if (bytes_received <= 0) {
-            std::lock_guard<std::mutex> lock(clients_mutex);
-            clients.erase(client_socket);
-            for (auto &[group_name, members] : groups) {
-                members.erase(client_socket);
-            }
-            close(client_socket);
-            break;
+        // A throttled client is not read from, so its input backs up in the socket
+        bool open = true;
+        while (open && session.throttled) {
+            std::this_thread::sleep_until(session.throttled_until);
+            open = session_resume(session);
         }
+        if (!open) break;
 
-        std::string command = trim(buffer);
-        std::istringstream iss(command);
-        std::string cmd;
-        iss >> cmd;
-
-        if (cmd == "/broadcast") {
-            std::string message;
-            std::getline(iss, message);
-            broadcast_message("(broadcast) @" + username + " : " + trim(message), client_socket);
-        } else if (cmd == "/msg") {
-            std::string recipient, message;
-            iss >> recipient;
-            std::getline(iss, message);
-            private_message(recipient, "(private) @" + username + " : " + trim(message), client_socket);
-        } else if (grpcmd.find(cmd) != grpcmd.end() || cmd == "/list_members") {
-            std::string group_name;
-            iss >> group_name;
-            std::string message;
-            std::getline(iss, message);
-            message = trim(message);
-
-            if (cmd == "/list_members") {
-                list_members(group_name, client_socket);
-            } else if(cmd == "/group_msg") {
-                grpcmd[cmd](group_name, message, client_socket);
-            } else {
-                grpcmd[cmd](group_name, username, client_socket);
-            }
-        } else if (cmd == "/list_groups") {
-            list_groups(username, client_socket);
-        } else if (cmd == "/list_commands") {
-            list_commands(client_socket);
-        } else if (cmd == "/exit") {
-            {
-                std::lock_guard<std::mutex> lock(clients_mutex);
-                clients.erase(client_socket);
-                for (auto &[group_name, members] : groups) {
-                    members.erase(client_socket);
-                }
-            }
-            broadcast_message("User " + username + " left the server. :/", client_socket);
-            close(client_socket);
+        auto now = std::chrono::steady_clock::now();
+        if (now >= next_check) {
+            if (!session_check_timeouts(session, now, next_check)) break;
+            set_recv_timeout(client_socket, next_check == std::chrono::steady_clock::time_point::max() ? std::chrono::steady_clock::duration::max() : next_check - now);
+        }
+        int bytes_received = recv(client_socket, buffer, session.framed ? READ_CHUNK : BUFFER_SIZE, 0);
+        if (bytes_received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            continue;
+        }
+        if (bytes_received <= 0 || !session_receive(session, buffer, bytes_received)) {
             break;
-        } else {
-            send_message("Error: Unknown command ( " + cmd.substr(0, 10) + ((cmd.size() > 10) ? "... " : " ") + "). Run /list_commands to know the list of commands!\n", client_socket);
         }
     }
+
+    session_close(session);
+    close(client_socket);
+}
+
+// Handle individual client connection (thread-per-client mode)
+void handle_client(ci client_socket) {
+    Session session;
+    session.socket = client_socket;
+    session_open(session);
+    serve_client(session);
 }
 
 // atomic variable for storing the server state
@@ -313,46 +905,271 @@ std::atomic<bool> running(true);
 
 // Signal handler for SIGINT
 void sigint_handler(int signum) {
-    std::lock_guard<std::mutex> lock(clients_mutex);
+    // No locking here: in epoll mode the signal may interrupt the thread that holds clients_mutex
     std::cout << "Server shutting down..." << std::endl;
     running = false;
 }
 
-#ifndef UNIT_TEST
-int main() {
-    signal(SIGINT, sigint_handler);
+// Signal handler for SIGUSR1, the stats are printed by the accept loop
+void sigusr1_handler(int) {
+    stats_requested = true;
+}
 
-    int server_socket;
-    sockaddr_in server_address{};
+// Signal handler for SIGHUP, the credential index is reloaded by the accept loop
+void sighup_handler(int) {
+    reload_requested = true;
+}
 
-    load_credentials();
+ServerConfig config;
+ServerStats stats;
+std::atomic<bool> stats_requested(false);
+std::atomic<bool> reload_requested(false);
 
-    server_socket = socket(AF_INET, SOCK_STREAM, 0);
+// Act on SIGUSR1 and SIGHUP outside of the signal handlers (called periodically by one thread)
+void handle_signal_requests() {
+    if (stats_requested.exchange(false)) {
+        print_stats();
+    }
+    if (reload_requested.exchange(false)) {
+        reload_credentials();
+    }
+}
+
+// Print the server counters
+void print_stats() {
+    std::cout << "Stats: overflow dropped=" << stats.overflow_dropped
+              << " disconnected=" << stats.overflow_disconnected
+              << " coalesced=" << stats.overflow_coalesced << std::endl;
+
+    // Event loop cost per message, to compare the epoll and io_uring backends on one workload
+    uint64_t messages = stats.messages_queued, syscalls = stats.io_syscalls;
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    double cpu_us = (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1e6 + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+    std::cout << "Stats: messages=" << messages << " io_syscalls=" << syscalls;
+    if (messages > 0) {
+        std::cout << " syscalls/message=" << (double)syscalls / messages << " cpu_us/message=" << cpu_us / messages;
+    }
+    std::cout << std::endl;
+
+    uint64_t logins = stats.logins;
+    std::cout << "Stats: auth_queue=" << stats.auth_queue_depth << " auth_queue_peak=" << stats.auth_queue_peak
+              << " auth_rejected=" << stats.auth_rejected << " logins=" << logins;
+    if (logins > 0) {
+        std::cout << " login_us avg=" << stats.login_latency_us / logins << " max=" << stats.login_latency_max_us;
+    }
+    std::cout << std::endl;
+
+    std::cout << "Stats: offline stored=" << stats.offline_stored << " delivered=" << stats.offline_delivered
+              << " log records=" << stats.log_records << " batches=" << stats.log_batches
+              << " fsyncs=" << stats.log_fsyncs << " bytes=" << stats.log_bytes << std::endl;
+    std::cout << "Stats: group wal records=" << stats.group_wal_records << " fsyncs=" << stats.group_wal_fsyncs
+              << " snapshots=" << stats.group_snapshots << std::endl;
+    std::cout << "Stats: presence digests=" << stats.presence_digests << " sends_saved=" << stats.presence_sends_saved << std::endl;
+    std::cout << "Stats: throttled=" << stats.throttled << " throttled_ms=" << stats.throttled_us / 1000
+              << " read_yields=" << stats.read_yields << std::endl;
+
+    // Timer cost per tick, to check that the wheels stay cheap with many connections
+    uint64_t ticks = stats.timer_ticks;
+    std::cout << "Stats: timeouts auth=" << stats.auth_timeouts << " idle=" << stats.idle_timeouts
+              << " heartbeats=" << stats.heartbeats << " timer ticks=" << ticks << " fired=" << stats.timers_fired;
+    if (ticks > 0) {
+        std::cout << " ns/tick=" << stats.timer_ns / ticks << " max_ns=" << stats.timer_max_ns;
+    }
+    std::cout << std::endl;
+
+    uint64_t accepted = stats.accepted, wakeups = stats.accept_wakeups;
+    std::cout << "Stats: accepted=" << accepted << " accept_wakeups=" << wakeups;
+    if (wakeups > 0) {
+        std::cout << " per_wakeup=" << (double)accepted / wakeups;
+    }
+    std::cout << " pool_misses=" << stats.pool_misses << std::endl;
+}
+
+// Parse command line options, returns false on invalid usage
+bool parse_args(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--io" && i + 1 < argc) {
+            std::string mode = argv[++i];
+            if (mode == "threads") {
+                config.io_mode = IoMode::THREADS;
+            } else if (mode == "epoll") {
+                config.io_mode = IoMode::EPOLL;
+            } else if (mode == "uring") {
+                config.io_mode = IoMode::URING;
+            } else {
+                std::cerr << "Error: Unknown I/O mode " << mode << "." << std::endl;
+                return false;
+            }
+        } else if (arg == "--port" && i + 1 < argc) {
+            config.port = std::atoi(argv[++i]);
+        } else if (arg == "--workers" && i + 1 < argc) {
+            config.workers = std::atoi(argv[++i]);
+        } else if (arg == "--sndq-high" && i + 1 < argc) {
+            config.sndq_high = std::strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--sndq-low" && i + 1 < argc) {
+            config.sndq_low = std::strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--zc-threshold" && i + 1 < argc) {
+            config.zc_threshold = std::strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--credentials" && i + 1 < argc) {
+            config.credentials_path = argv[++i];
+        } else if (arg == "--auth-workers" && i + 1 < argc) {
+            config.auth_workers = std::atoi(argv[++i]);
+        } else if (arg == "--auth-queue" && i + 1 < argc) {
+            config.auth_queue = std::strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--log-dir" && i + 1 < argc) {
+            config.log_dir = argv[++i];
+        } else if (arg == "--log-sync" && i + 1 < argc) {
+            std::string sync = argv[++i];
+            if (sync != "on" && sync != "off") {
+                std::cerr << "Error: --log-sync takes on or off." << std::endl;
+                return false;
+            }
+            config.log_sync = (sync == "on");
+        } else if (arg == "--state-dir" && i + 1 < argc) {
+            config.state_dir = argv[++i];
+        } else if (arg == "--snapshot-every" && i + 1 < argc) {
+            config.snapshot_every = std::strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--presence-threshold" && i + 1 < argc) {
+            config.presence_threshold = std::strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--presence-window" && i + 1 < argc) {
+            config.presence_window_ms = std::atoi(argv[++i]);
+        } else if (arg == "--rate-limit" && i + 1 < argc) {
+            config.rate_limit = std::strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--rate-burst" && i + 1 < argc) {
+            config.rate_burst = std::strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--auth-timeout" && i + 1 < argc) {
+            config.auth_timeout_s = std::atoi(argv[++i]);
+        } else if (arg == "--heartbeat" && i + 1 < argc) {
+            config.heartbeat_s = std::atoi(argv[++i]);
+        } else if (arg == "--idle-timeout" && i + 1 < argc) {
+            config.idle_timeout_s = std::atoi(argv[++i]);
+        } else if (arg == "--backlog" && i + 1 < argc) {
+            config.backlog = std::atoi(argv[++i]);
+        } else if (arg == "--defer-accept" && i + 1 < argc) {
+            config.defer_accept_s = std::atoi(argv[++i]);
+        } else if (arg == "--connection-pool" && i + 1 < argc) {
+            config.connection_pool = std::strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--admin" && i + 1 < argc) {
+            config.admins.insert(argv[++i]);
+        } else if (arg == "--metrics-socket" && i + 1 < argc) {
+            config.metrics_socket = argv[++i];
+        } else if (arg == "--metrics" && i + 1 < argc) {
+            std::string metrics = argv[++i];
+            if (metrics != "on" && metrics != "off") {
+                std::cerr << "Error: --metrics takes on or off." << std::endl;
+                return false;
+            }
+            config.metrics = (metrics == "on");
+        } else if (arg == "--capture" && i + 1 < argc) {
+            config.capture_path = argv[++i];
+        } else if (arg == "--upgrade-socket" && i + 1 < argc) {
+            config.upgrade_socket = argv[++i];
+        } else if (arg == "--takeover" && i + 1 < argc) {
+            config.takeover = argv[++i];
+        } else if (arg == "--overflow" && i + 1 < argc) {
+            std::string policy = argv[++i];
+            if (policy == "drop") {
+                config.overflow_policy = OverflowPolicy::DROP;
+            } else if (policy == "disconnect") {
+                config.overflow_policy = OverflowPolicy::DISCONNECT;
+            } else if (policy == "coalesce") {
+                config.overflow_policy = OverflowPolicy::COALESCE;
+            } else {
+                std::cerr << "Error: Unknown overflow policy " << policy << "." << std::endl;
+                return false;
+            }
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--io threads|epoll|uring] [--port N] [--workers N]"
+                      << " [--sndq-high BYTES] [--sndq-low BYTES] [--overflow drop|disconnect|coalesce]"
+                      << " [--zc-threshold BYTES] [--credentials FILE]"
+                      << " [--auth-workers N] [--auth-queue N] [--log-dir DIR|none] [--log-sync on|off]"
+                      << " [--state-dir DIR|none] [--snapshot-every N]"
+                      << " [--presence-threshold N] [--presence-window MS]"
+                      << " [--rate-limit SENDS_PER_S] [--rate-burst SENDS]"
+                      << " [--auth-timeout S] [--heartbeat S] [--idle-timeout S]"
+                      << " [--backlog N] [--defer-accept S] [--connection-pool N]"
+                      << " [--metrics on|off] [--metrics-socket PATH] [--admin USER]..."
+                      << " [--upgrade-socket PATH] [--takeover PATH] [--capture FILE]" << std::endl;
+            return false;
+        }
+    }
+    if (config.sndq_low > config.sndq_high) {
+        std::cerr << "Error: --sndq-low must not exceed --sndq-high." << std::endl;
+        return false;
+    }
+    if (!config.upgrade_socket.empty() && config.io_mode == IoMode::THREADS) {
+        std::cerr << "Error: --upgrade-socket needs --io epoll or uring." << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Create a socket listening on the given port, returns -1 on failure.
+// In epoll mode SO_REUSEPORT lets every worker bind its own socket to the same port.
+int create_server_socket(ci port) {
+    int server_socket = socket(AF_INET, SOCK_STREAM, 0);
     if (server_socket < 0) {
         std::cerr << "Error: Cannot create socket." << std::endl;
-        return 1;
+        return -1;
+    }
+
+    int reuse = 1;
+    setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if (config.io_mode != IoMode::THREADS) {
+        setsockopt(server_socket, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse));
     }
 
+    sockaddr_in server_address{};
     server_address.sin_family = AF_INET;
-    server_address.sin_port = htons(PORT);
+    server_address.sin_port = htons(port);
     server_address.sin_addr.s_addr = INADDR_ANY;
 
     if (bind(server_socket, (sockaddr *)&server_address, sizeof(server_address)) < 0) {
         std::cerr << "Error: Cannot bind socket." << std::endl;
         close(server_socket);
-        return 1;
+        return -1;
+    }
+
+    // Clients that send first (PROTO_HELLO) are only accepted once their data is in, so a burst of
+    // connections is accepted and read in one go; silent clients wait until the timeout expires
+    if (config.defer_accept_s > 0) {
+        setsockopt(server_socket, IPPROTO_TCP, TCP_DEFER_ACCEPT, &config.defer_accept_s, sizeof(config.defer_accept_s));
     }
 
-    if (listen(server_socket, 5) < 0) {
+    if (listen(server_socket, config.backlog) < 0) {
         std::cerr << "Error: Cannot listen on socket." << std::endl;
         close(server_socket);
-        return 1;
+        return -1;
+    }
+    return server_socket;
+}
+
+// Accept every pending connection, each served by a thread of its own
+static void accept_clients(ci server_socket) {
+    stats.accept_wakeups.fetch_add(1, std::memory_order_relaxed);
+    while (true) {
+        // Accepted sockets stay blocking: handle_client waits in recv()
+        int client_socket = accept4(server_socket, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client_socket < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                std::cerr << "Error: Cannot accept client connection." << std::endl;
+            }
+            return;
+        }
+        stats.accepted.fetch_add(1, std::memory_order_relaxed);
+        std::thread(handle_client, client_socket).detach();
     }
+}
 
+// Wait for connections with select() and accept them in batches, one thread per client
+int run_thread_server(ci server_socket) {
+    fcntl(server_socket, F_SETFL, fcntl(server_socket, F_GETFL, 0) | O_NONBLOCK);
     fd_set read_fds;
-    std::cout << "Server listening on port " << PORT << std::endl;
-
     while (running) {
+        handle_signal_requests();
         FD_ZERO(&read_fds);
         FD_SET(server_socket, &read_fds);
 
@@ -360,26 +1177,158 @@ int main() {
         int activity = select(server_socket + 1, &read_fds, nullptr, nullptr, &timeout);
 
         if (activity == -1) {
+            if (errno == EINTR) continue;
             if (running)
                 std::cerr << "Error: select error." << std::endl;
             break;
         }
 
         if (FD_ISSET(server_socket, &read_fds)) {
-            sockaddr_in client_address{};
-            socklen_t client_len = sizeof(client_address);
-            int client_socket = accept(server_socket, (sockaddr *)&client_address, &client_len);
-            if (client_socket < 0) {
-                std::cerr << "Error: Cannot accept client connection." << std::endl;
-                continue;
-            }
+            accept_clients(server_socket);
+        }
+    }
+    return 0;
+}
+
+#ifndef UNIT_TEST
+// Serve a connection handed over by the previous server (thread-per-client mode): write the output
+// it had queued, run the input it had read, then go on as for any client
+static void resume_client(HandoffConnection conn) {
+    Session &session = conn.session;
+    session.socket = conn.socket;
+    if (!session_restore(session)) {
+        close(conn.socket);
+        return;
+    }
+    if (!conn.output.empty()) send_message(conn.output, session.socket);
+    if (!session.throttled && !session_resume(session)) {
+        session_close(session);
+        close(session.socket);
+        return;
+    }
+    serve_client(session);
+}
+
+// Give the listening sockets and logged in clients to the server that asked for a takeover.
+// Called once the event loops stopped, instead of the shutdown broadcast.
+static void hand_off(int successor) {
+    auth_shutdown();
+    presence_flush();
+    Handoff handoff;
+    reactor_export(handoff);
+    handoff_save_groups(handoff);
+    // The successor opens the stores once we let go of them
+    log_close();
+    group_store_close();
+
+    std::string error;
+    if (upgrade_send(successor, handoff, error)) {
+        std::cout << "Handed " << handoff.connections.size() << " clients over." << std::endl;
+    } else {
+        std::cerr << "Error: Takeover failed, " << error << "." << std::endl;
+    }
+    close(successor);
+    for (int socket : handoff.listeners) close(socket);
+    for (const HandoffConnection &conn : handoff.connections) close(conn.socket);
+    reactor_shutdown();
+}
+
+int main(int argc, char *argv[]) {
+    if (!parse_args(argc, argv)) return 1;
+    signal(SIGINT, sigint_handler);
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGUSR1, sigusr1_handler);
+    signal(SIGHUP, sighup_handler);
+
+    // Taking over first: the running server only closes its stores once it has stopped
+    Handoff handoff;
+    if (!config.takeover.empty()) {
+        std::string error;
+        if (!upgrade_receive(config.takeover, handoff, error)) {
+            std::cerr << "Error: Cannot take over: " << error << "." << std::endl;
+            return 1;
+        }
+        std::cout << "Took over " << handoff.connections.size() << " clients." << std::endl;
+    }
+
+    load_credentials();
+    if (config.state_dir != "none") {
+        std::string error;
+        if (!group_store_open(config.state_dir, config.log_sync, config.snapshot_every, error)) {
+            std::cerr << "Error: Cannot load the groups: " << error << "." << std::endl;
+            return 1;
+        }
+    }
+    if (config.log_dir != "none") {
+        std::string error;
+        if (!log_open(config.log_dir, config.log_sync, error)) {
+            std::cerr << "Error: Cannot open the message log: " << error << "." << std::endl;
+            return 1;
+        }
+    }
+    handoff_restore_groups(handoff);
+    metrics_enable(config.metrics);
+    if (!config.metrics_socket.empty()) {
+        std::string error;
+        if (!metrics_listen(config.metrics_socket, error)) {
+            std::cerr << "Error: Cannot serve the metrics: " << error << "." << std::endl;
+            return 1;
+        }
+    }
+    if (!config.capture_path.empty()) {
+        std::string error;
+        if (!capture_open(config.capture_path, error)) {
+            std::cerr << "Error: Cannot capture: " << error << "." << std::endl;
+            return 1;
+        }
+    }
+    if (!config.upgrade_socket.empty()) {
+        std::string error;
+        if (!upgrade_listen(config.upgrade_socket, error)) {
+            std::cerr << "Error: Cannot accept takeovers: " << error << "." << std::endl;
+            return 1;
+        }
+    }
+
+    int server_socket = handoff.listeners.empty() ? create_server_socket(config.port) : handoff.listeners[0];
+    if (server_socket < 0) return 1;
 
-            std::thread(handle_client, client_socket).detach();
+    static const char *mode_names[] = {"threads", "epoll", "io_uring"};
+    std::cout << "Server listening on port " << config.port << " (" << mode_names[(int)config.io_mode] << " mode)" << std::endl;
+
+    int status;
+    if (config.io_mode == IoMode::THREADS) {
+        // One listening socket is enough, the connections get blocking I/O
+        for (size_t i = 1; i < handoff.listeners.size(); i++) close(handoff.listeners[i]);
+        for (HandoffConnection &conn : handoff.connections) {
+            fcntl(conn.socket, F_SETFL, fcntl(conn.socket, F_GETFL, 0) & ~O_NONBLOCK);
+            std::thread(resume_client, std::move(conn)).detach();
         }
+        status = run_thread_server(server_socket);
+    } else {
+        reactor_adopt(handoff);
+        status = run_epoll_server(server_socket);
     }
 
+    metrics_close();
+    capture_close();
+    int successor = upgrade_request();
+    if (successor >= 0) {
+        hand_off(successor);
+        print_stats();
+        return status;
+    }
+    upgrade_close();
+
+    auth_shutdown();
+    log_close();
+    group_store_close();
+    presence_flush();
+
     broadcast_message("Server shutting down... Please /exit to close your client.", server_socket);
+    reactor_shutdown();
     close(server_socket);
-    return 0;
+    print_stats();
+    return status;
 }
 #endif
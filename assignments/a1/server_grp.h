@@ -3,10 +3,13 @@
 
 #include <arpa/inet.h>
 #include <sys/select.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include <atomic>
+#include <chrono>
 #include <csignal>
+#include <cstdint>
 #include <cstdlib>
 #include <cstring>
 #include <fstream>
@@ -15,36 +18,298 @@
 #include <mutex>
 #include <sstream>
 #include <string>
+#include <string_view>
 #include <thread>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
+#include "credentials.h"
+#include "history.h"
+#include "ids.h"
+#include "metrics.h"
+#include "payload.h"
+#include "rcu.h"
+
 #define BUFFER_SIZE 1024
+#define READ_CHUNK 16384             // recv() size for framed connections
+#define MAX_LINE_SIZE (64 * 1024)    // Longest command accepted on a framed connection
+#define MAX_DEFERRED 64              // Unframed messages held back while a login is checked or the client is throttled
 #define PORT 12345
+#define PROTO_HELLO "/proto newline\n"  // Sent first by clients that frame commands with '\n'
 
 typedef const std::string &cstr;
 typedef const int &ci;
 
-extern std::mutex clients_mutex;
-extern std::unordered_map<int, std::string> clients;                            // Maps socket to username
-extern std::unordered_map<std::string, std::unordered_set<int>> groups;         // Maps group name to set of client sockets
-extern std::unordered_map<std::string, std::string> user_credentials;           // Stores username-password pairs
-extern std::unordered_map<std::string, std::unordered_set<std::string>> users;  // Maps username to set of groups
+// Connection lifecycle shared by the thread-per-client and the epoll servers.
+// AUTH_WAIT: the password is being checked by the auth pool, input is held back until it answers.
+enum class SessionState { AUTH_USER, AUTH_PASS, AUTH_WAIT, COMMAND, CLOSING };
+
+enum class IoMode { THREADS, EPOLL, URING };
+
+// What to do with a message for a client whose outbound queue is past the high watermark
+enum class OverflowPolicy { DROP, DISCONNECT, COALESCE };
+
+struct ServerConfig {
+    IoMode io_mode = IoMode::THREADS;
+    int port = PORT;
+    int workers = 1;                    // Event loops in epoll mode, 0 for one per core
+    size_t sndq_high = 1 << 20;         // Outbound queue size (bytes) that triggers the overflow policy
+    size_t sndq_low = 256 << 10;        // Queue size at which a congested client accepts messages again
+    OverflowPolicy overflow_policy = OverflowPolicy::DROP;
+    size_t zc_threshold = 16 << 10;     // io_uring mode: messages this large are sent with IORING_OP_SEND_ZC
+    std::string credentials_path = "users.idx";  // Credential index built by build_credentials, reloaded on SIGHUP
+    int auth_workers = 2;               // Threads checking passwords
+    size_t auth_queue = 1024;           // Logins waiting for a check before new ones are turned away
+    std::string log_dir = "msglog";     // Message log of offline deliveries, "none" to keep them in memory only
+    bool log_sync = true;               // fdatasync() every message log batch and group log commit
+    std::string state_dir = "groups";   // Snapshot and write-ahead log of groups, "none" to keep them in memory only
+    size_t snapshot_every = 100000;     // Group operations logged between snapshots
+    size_t presence_threshold = 64;     // Recipients from which join/leave notices are batched into digests, 0 never batches
+    int presence_window_ms = 250;       // How long a digest collects events
+    size_t rate_limit = 10000;          // Sends per second a client may cause (a command costs 1 plus its fan-out), 0 for no limit
+    size_t rate_burst = 20000;          // Sends a client may cause at once after being idle
+    int auth_timeout_s = 30;            // Time to log in before the connection is closed, 0 for no limit
+    int heartbeat_s = 30;               // Silence after which a framed client is sent "/ping", 0 for no heartbeats
+    int idle_timeout_s = 300;           // Silence after which a logged in client is disconnected, 0 for no limit
+    int backlog = 4096;                 // Pending connections the kernel queues per listening socket (capped by somaxconn)
+    int defer_accept_s = 0;             // TCP_DEFER_ACCEPT: wake the acceptor only once a client sent data, 0 for off
+    size_t connection_pool = 1024;      // Connections each event loop preallocates and keeps for reuse
+    std::unordered_set<std::string> admins;  // Users allowed to run /stats
+    std::string metrics_socket;         // Unix socket serving the metrics report, empty for none
+    bool metrics = true;                // Record latency and size distributions (metrics.h)
+    std::string upgrade_socket;         // Unix socket on which a new server may take over, empty for none
+    std::string takeover;               // Unix socket of the running server to take over from, empty to start fresh
+    std::string capture_path;           // File recording client traffic for tests/replay (capture.h), empty for none
+};
+
+// Server counters, printed on SIGUSR1 and at shutdown
+struct ServerStats {
+    std::atomic<uint64_t> overflow_dropped{0};       // Messages discarded by the drop policy
+    std::atomic<uint64_t> overflow_disconnected{0};  // Clients closed by the disconnect policy
+    std::atomic<uint64_t> overflow_coalesced{0};     // Queues collapsed by the coalesce policy
+    std::atomic<uint64_t> messages_queued{0};        // Messages handed to event loop connections
+    std::atomic<uint64_t> io_syscalls{0};            // System calls made by the event loops
+    std::atomic<uint64_t> auth_queue_depth{0};       // Logins waiting for an auth worker
+    std::atomic<uint64_t> auth_queue_peak{0};        // Highest auth_queue_depth seen
+    std::atomic<uint64_t> auth_rejected{0};          // Logins turned away because the auth queue was full
+    std::atomic<uint64_t> logins{0};                 // Password checks done by the auth workers
+    std::atomic<uint64_t> login_latency_us{0};       // Sum of queue wait plus check time of those logins
+    std::atomic<uint64_t> login_latency_max_us{0};
+    std::atomic<uint64_t> offline_stored{0};         // Messages kept for offline recipients (one per recipient)
+    std::atomic<uint64_t> offline_delivered{0};      // Kept messages delivered on login
+    std::atomic<uint64_t> log_records{0};            // Records written to the message log
+    std::atomic<uint64_t> log_batches{0};            // Writes of the log writer, each one group commit
+    std::atomic<uint64_t> log_fsyncs{0};
+    std::atomic<uint64_t> log_bytes{0};
+    std::atomic<uint64_t> group_wal_records{0};      // Group operations appended to the write-ahead log
+    std::atomic<uint64_t> group_wal_fsyncs{0};       // Group commits of those operations
+    std::atomic<uint64_t> group_snapshots{0};
+    std::atomic<uint64_t> presence_digests{0};       // Digests sent in place of join/leave notices
+    std::atomic<uint64_t> presence_sends_saved{0};   // Notices those digests replaced, minus the digests
+    std::atomic<uint64_t> throttled{0};              // Times a client went over its budget and had its input paused
+    std::atomic<uint64_t> throttled_us{0};           // Sum of those pauses
+    std::atomic<uint64_t> read_yields{0};            // Times an event loop moved on from a connection with input left
+    std::atomic<uint64_t> auth_timeouts{0};          // Connections closed for not logging in within --auth-timeout
+    std::atomic<uint64_t> idle_timeouts{0};          // Clients disconnected after --idle-timeout of silence
+    std::atomic<uint64_t> heartbeats{0};             // "/ping" sent to silent framed clients
+    std::atomic<uint64_t> timer_ticks{0};            // Ticks the event loops' timer wheels advanced
+    std::atomic<uint64_t> timers_fired{0};
+    std::atomic<uint64_t> timer_ns{0};               // Time spent advancing the wheels, firing included
+    std::atomic<uint64_t> timer_max_ns{0};           // Longest single advance
+    std::atomic<uint64_t> accepted{0};               // Connections accepted
+    std::atomic<uint64_t> accept_wakeups{0};         // Times an acceptor woke up to accept them
+    std::atomic<uint64_t> pool_misses{0};            // Event loop connections allocated because the pool was empty
+};
+
+struct Session {
+    int socket = -1;
+    SessionState state = SessionState::AUTH_USER;
+    std::string username;
+    bool framed = false;    // Negotiated newline framing, otherwise every recv() is one message
+    std::string inbuf;      // Incomplete line of a framed connection
+    uint64_t auth_ticket = 0;            // Identifies the pending password check, so a late answer cannot reach a new session
+    std::vector<std::string> deferred;   // Unframed messages received during AUTH_WAIT or while throttled
+    // Token bucket of the client, in sends. A command is always run and then charged, a client
+    // that goes into debt is throttled: its input is held back until the debt is paid off.
+    double tokens = 0;
+    std::chrono::steady_clock::time_point refilled;
+    bool throttled = false;
+    std::chrono::steady_clock::time_point throttled_until;
+    std::chrono::steady_clock::time_point opened;      // For --auth-timeout
+    std::chrono::steady_clock::time_point last_input;  // For heartbeats and --idle-timeout
+    bool pinged = false;                               // A heartbeat was sent since the last input
+};
+
+// Who is connected and who is in which group. A published Directory is never modified:
+// writers (holding clients_mutex) copy it, change the copy and publish it with rcu_publish(),
+// readers load `directory` inside an RcuReadGuard without taking any lock.
+struct Directory {
+    CowArray<uint32_t> socket_user{NO_ID};                  // Maps socket to user id of the connected client
+    CowArray<int> user_socket{-1};                          // Maps user id to socket, -1 while offline
+    CowArray<std::shared_ptr<const IdSet>> group_members;   // Maps group id to user ids of its members, null if no such group
+    CowArray<std::shared_ptr<const IdSet>> user_groups;     // Maps user id to ids of its groups
+    CowArray<std::shared_ptr<GroupHistory>> group_history;  // Maps group id to its recent messages (locked internally)
+
+    uint32_t user_of(int socket) const { return socket < 0 ? NO_ID : socket_user.get(socket); }
+    int socket_of(uint32_t user_id) const { return user_socket.get(user_id); }
+    bool has_group(uint32_t group_id) const { return group_id != NO_ID && group_members.get(group_id) != nullptr; }
+    const IdSet &members(uint32_t group_id) const;
+    const IdSet &groups_of(uint32_t user_id) const;
+
+    void attach(int socket, uint32_t user_id);
+    void detach(int socket);
+    void join(uint32_t group_id, uint32_t user_id);
+    bool leave(uint32_t group_id, uint32_t user_id);
+};
+
+// Commands understood by the server, resolved at compile time by parse_command()
+enum class Command {
+    UNKNOWN,
+    BROADCAST,
+    MSG,
+    GROUP_MSG,
+    CREATE_GROUP,
+    JOIN_GROUP,
+    LEAVE_GROUP,
+    LIST_MEMBERS,
+    LIST_GROUPS,
+    LIST_COMMANDS,
+    HISTORY,
+    PONG,
+    STATS,
+    EXIT,
+};
+
+// Switch on the length first, so a lookup costs at most two short comparisons and no hashing
+constexpr Command parse_command(std::string_view cmd) {
+    switch (cmd.size()) {
+    case 4:
+        return cmd == "/msg" ? Command::MSG : Command::UNKNOWN;
+    case 5:
+        return cmd == "/exit" ? Command::EXIT : cmd == "/pong" ? Command::PONG : Command::UNKNOWN;
+    case 6:
+        return cmd == "/stats" ? Command::STATS : Command::UNKNOWN;
+    case 8:
+        return cmd == "/history" ? Command::HISTORY : Command::UNKNOWN;
+    case 10:
+        return cmd == "/broadcast" ? Command::BROADCAST : cmd == "/group_msg" ? Command::GROUP_MSG : Command::UNKNOWN;
+    case 11:
+        return cmd == "/join_group" ? Command::JOIN_GROUP : Command::UNKNOWN;
+    case 12:
+        return cmd == "/leave_group" ? Command::LEAVE_GROUP : cmd == "/list_groups" ? Command::LIST_GROUPS : Command::UNKNOWN;
+    case 13:
+        return cmd == "/create_group" ? Command::CREATE_GROUP : cmd == "/list_members" ? Command::LIST_MEMBERS : Command::UNKNOWN;
+    case 14:
+        return cmd == "/list_commands" ? Command::LIST_COMMANDS : Command::UNKNOWN;
+    default:
+        return Command::UNKNOWN;
+    }
+}
+
+static_assert(parse_command("/group_msg") == Command::GROUP_MSG);
+static_assert(parse_command("/list_members") == Command::LIST_MEMBERS);
+static_assert(parse_command("/list_member") == Command::UNKNOWN);
+
+#define WHITESPACE " \n\r\t"
+
+// Trim leading and trailing whitespaces without copying
+inline std::string_view trim_view(std::string_view str) {
+    size_t first = str.find_first_not_of(WHITESPACE);
+    if (first == std::string_view::npos) return {};
+    return str.substr(first, str.find_last_not_of(WHITESPACE) - first + 1);
+}
+
+// Splits a command in place: next() returns whitespace separated words and rest_of_line()
+// the trimmed remainder of the current line, like `>>` followed by std::getline().
+class Tokenizer {
+   public:
+    explicit Tokenizer(std::string_view input) : rest_(input) {}
+
+    std::string_view next() {
+        size_t start = rest_.find_first_not_of(WHITESPACE "\v\f");
+        if (start == std::string_view::npos) {
+            rest_ = {};
+            return {};
+        }
+        size_t end = rest_.find_first_of(WHITESPACE "\v\f", start);
+        std::string_view word = rest_.substr(start, end == std::string_view::npos ? std::string_view::npos : end - start);
+        rest_.remove_prefix(end == std::string_view::npos ? rest_.size() : end);
+        return word;
+    }
+
+    std::string_view rest_of_line() {
+        std::string_view line = rest_.substr(0, rest_.find('\n'));
+        rest_.remove_prefix(line.size());
+        return trim_view(line);
+    }
+
+   private:
+    std::string_view rest_;
+};
+
+// Takes the messages for client sockets in place of the kernel, in threaded mode, when installed
+// as socket_layer. tests/replay.cpp installs one that keeps no more than a digest per socket.
+struct SocketLayer {
+    virtual ~SocketLayer() = default;
+    // One message, in parts, for every socket of `sockets`
+    virtual void send(const int *sockets, size_t count, const iovec *parts, size_t n) = 0;
+};
+
+extern SocketLayer *socket_layer;                                       // nullptr: the kernel
+extern TimedMutex clients_mutex;                                        // Serializes writers of the directory
+extern Interner user_ids;                                               // Usernames <-> dense user ids
+extern Interner group_ids;                                              // Group names <-> dense group ids
+extern std::atomic<const Directory *> directory;                        // Current snapshot of clients and groups
+extern std::unordered_map<std::string, std::string> user_credentials;   // Stores username-password pairs
+extern std::atomic<const CredentialIndex *> credential_index;          // Mapped credential index, used instead of user_credentials
+extern std::atomic<bool> running;
+extern ServerConfig config;
+extern ServerStats stats;
+extern std::atomic<bool> stats_requested;
+extern std::atomic<bool> reload_requested;
+
+// Publish a copy of the directory changed by edit(Directory &) (caller holds clients_mutex)
+template <typename F>
+void update_directory(F &&edit) {
+    Directory *next = new Directory(*directory.load());
+    edit(*next);
+    rcu_publish<Directory>(directory, next);
+}
 
 std::string trim(cstr str);
 void load_credentials();
+bool reload_credentials();
+bool check_credentials(cstr username, cstr password);
 void send_message(cstr message, ci client_socket);
+void send_payloads(const std::vector<Payload> &messages, ci client_socket);
+void multicast_message(cstr message, const std::vector<int> &recipients);
+void multicast_message(const Payload &message, const std::vector<int> &recipients);
 void broadcast_message(cstr message, ci sender_socket);
 void private_message(cstr recipient, cstr message, ci sender_socket);
 void group_message(cstr group_name, cstr message, ci sender_socket);
 void list_commands(ci client_socket);
 void list_groups(cstr username, ci client_socket);
 void list_members(cstr group_name, ci client_socket);
+void send_history(cstr group_name, size_t count, ci client_socket);
 void create_group(cstr group_name, cstr username, ci client_socket);
 void join_group(cstr group_name, cstr username, ci client_socket);
 void leave_group(cstr group_name, cstr username, ci client_socket);
+void session_open(Session &session);
+bool session_input(Session &session, const char *data, size_t len);
+bool session_receive(Session &session, const char *data, size_t len);
+bool session_resume(Session &session);
+bool session_restore(Session &session);
+bool session_check_timeouts(Session &session, std::chrono::steady_clock::time_point now, std::chrono::steady_clock::time_point &next);
+void session_close(Session &session);
 void handle_client(ci client_socket);
 void sigint_handler(int signum);
+void sigusr1_handler(int signum);
+void sighup_handler(int signum);
+void handle_signal_requests();
+void print_stats();
+bool parse_args(int argc, char *argv[]);
+int create_server_socket(ci port);
+int run_thread_server(ci server_socket);
 
 #endif // SERVER_GRP_H
\ No newline at end of file
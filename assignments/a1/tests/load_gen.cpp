@@ -0,0 +1,673 @@
+// Load generator for the chat server. Logs in the users made by make_dummy_users.sh
+// (user<n>/password<n>), puts them in groups and has every client send a mix of broadcast,
+// private and group messages at a fixed rate, from a few epoll threads.
+//
+// Every message carries the time it was due to be sent (~T<kind><nanoseconds>~), so receivers
+// measure end-to-end delivery latency, including any time the generator fell behind its schedule.
+// The times are steady_clock readings, so run it on the server's host. The report is JSON on
+// stdout (or --json FILE), with a one-line summary on stderr.
+//
+//   ./load_gen --clients 200 --rate 20 --mix 1:8:1 --group-sizes 5x30,50x2 --duration 10
+
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <queue>
+#include <random>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "../metrics.h"
+
+#define PROTO_HELLO "/proto newline\n"
+#define MARKER "~T"              // Starts the due time embedded in a message: ~T<kind tag><nanoseconds>~
+#define MAX_UNPARSED (64 << 10)  // Input kept while waiting for a marker or a newline
+#define SETUP_TIMEOUT_S 30       // Time allowed for the logins, and for the groups to be made
+
+enum Kind { BROADCAST, PRIVATE, GROUP, KINDS };
+static const char *kind_names[KINDS] = {"broadcast", "private", "group"};
+static const char kind_tags[KINDS] = {'b', 'p', 'g'};
+
+struct Options {
+    std::string host = "127.0.0.1";
+    int port = 12345;
+    int clients = 50;
+    int first_user = 1;              // The clients are user<first_user> onwards
+    double login_rate = 0;           // Connections opened per second, 0 for all at once
+    double rate = 10;                // Messages per second per client
+    double duration_s = 10;
+    double drain_s = 5;              // Time allowed for the deliveries in flight after the last send
+    double mix[KINDS] = {1, 8, 1};   // Relative weights of the message kinds
+    std::vector<int> group_sizes = std::vector<int>(5, 10);  // One entry per group
+    size_t size = 64;                // Message text size in bytes, including the marker
+    int threads = 0;                 // 0 for one per core
+    std::string json_path;           // Report file, stdout if empty
+};
+
+static Options options;
+
+// The main thread moves all workers through the phases together
+enum class Phase { LOGIN, CREATE, JOIN, LOAD, DRAIN, DONE };
+static std::atomic<Phase> phase{Phase::LOGIN};
+
+struct Client {
+    int fd = -1;
+    int user = 0;
+    std::string in, out;
+    bool writable = true;            // false while waiting for EPOLLOUT
+    bool closed = false, failed = false;
+    std::atomic<bool> logged_in{false};
+    uint64_t connect_ns = 0;
+    std::vector<int> groups;         // Indexes into `groups`
+};
+
+// A group of the run, created by its first member and joined by the others
+struct Group {
+    std::string name;
+    std::vector<int> members;        // Client indexes
+    int online = 0;                  // Members logged in when the load started
+};
+
+struct Worker {
+    std::vector<int> mine;           // Client indexes served by this thread
+    int epoll_fd = -1;
+    std::mt19937_64 rng;
+    std::discrete_distribution<int> kinds;
+    Histogram latency[KINDS];        // Nanoseconds from due time to delivery
+    Histogram login_latency;         // Nanoseconds from connect() to the welcome message
+    uint64_t sent[KINDS] = {}, delivered[KINDS] = {}, expected[KINDS] = {};
+    uint64_t offline_notices = 0, pings = 0, disconnects = 0;
+    std::map<std::string, uint64_t> errors;  // By message, digits folded to '#'
+    // Read by the main thread to move on between phases
+    std::atomic<int> logins{0}, login_failures{0}, replies{0};
+    std::atomic<uint64_t> delivered_total{0}, expected_total{0};
+    std::thread thread;
+};
+
+static std::vector<Client> clients;
+static std::vector<Group> groups;
+static std::vector<std::unique_ptr<Worker>> workers;
+static sockaddr_in server_address{};
+static int logged_in_total = 0;      // Set before the load starts
+
+static uint64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Error messages differ by user and group names, fold the digits so they add up
+static std::string error_key(std::string_view text) {
+    std::string key;
+    for (char c : text.substr(0, 80)) {
+        if (!isdigit((unsigned char)c)) {
+            key += c;
+        } else if (key.empty() || key.back() != '#') {
+            key += '#';
+        }
+    }
+    return key;
+}
+
+static void watch(Worker &worker, Client &client, bool writable) {
+    epoll_event event{};
+    event.events = writable ? EPOLLIN : EPOLLIN | EPOLLOUT;
+    event.data.u32 = &client - clients.data();
+    epoll_ctl(worker.epoll_fd, EPOLL_CTL_MOD, client.fd, &event);
+    client.writable = writable;
+}
+
+static void close_client(Worker &worker, Client &client) {
+    if (client.closed) return;
+    epoll_ctl(worker.epoll_fd, EPOLL_CTL_DEL, client.fd, nullptr);
+    close(client.fd);
+    client.closed = true;
+    if (client.logged_in) {
+        worker.disconnects++;
+    } else if (!client.failed) {
+        client.failed = true;
+        worker.login_failures++;
+    }
+}
+
+// Write as much queued output as the socket takes
+static void flush(Worker &worker, Client &client) {
+    size_t done = 0;
+    while (done < client.out.size()) {
+        ssize_t n = send(client.fd, client.out.data() + done, client.out.size() - done, MSG_NOSIGNAL);
+        if (n > 0) {
+            done += n;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && errno == EAGAIN) {
+            break;
+        } else {
+            worker.errors[std::string("send: ") + strerror(errno)]++;
+            close_client(worker, client);
+            return;
+        }
+    }
+    client.out.erase(0, done);
+    if (client.writable != client.out.empty()) watch(worker, client, client.out.empty());
+}
+
+static void queue(Worker &worker, Client &client, std::string_view text) {
+    if (client.closed) return;
+    client.out += text;
+    if (client.writable) flush(worker, client);
+}
+
+static void open_client(Worker &worker, int index) {
+    Client &client = clients[index];
+    client.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (client.fd < 0) {
+        worker.errors[std::string("socket: ") + strerror(errno)]++;
+        client.closed = client.failed = true;
+        worker.login_failures++;
+        return;
+    }
+    int one = 1;
+    setsockopt(client.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    client.connect_ns = now_ns();
+    if (connect(client.fd, (sockaddr *)&server_address, sizeof(server_address)) < 0 && errno != EINPROGRESS) {
+        worker.errors[std::string("connect: ") + strerror(errno)]++;
+        close(client.fd);
+        client.closed = client.failed = true;
+        worker.login_failures++;
+        return;
+    }
+    epoll_event event{};
+    event.events = EPOLLIN | EPOLLOUT;
+    event.data.u32 = index;
+    epoll_ctl(worker.epoll_fd, EPOLL_CTL_ADD, client.fd, &event);
+    client.writable = false;  // Until the connection is established
+    std::string user = std::to_string(client.user);
+    client.out = PROTO_HELLO "user" + user + "\npassword" + user + "\n";
+}
+
+// A server reply; chat messages have no newline, so a line may start with the tail of one
+static void handle_line(Worker &worker, Client &client, std::string_view line) {
+    if (line.find("/ping") != std::string_view::npos) {
+        worker.pings++;
+        queue(worker, client, "/pong\n");
+    }
+    if (!client.logged_in && line.find("Welcome to the server") != std::string_view::npos) {
+        client.logged_in = true;
+        worker.login_latency.record(now_ns() - client.connect_ns);
+        worker.logins++;
+        return;
+    }
+    size_t error = line.find("Error: ");
+    if (error == std::string_view::npos) error = line.find("Authentication failed");
+    if (error != std::string_view::npos) {
+        worker.errors[error_key(line.substr(error))]++;
+        if (!client.logged_in && !client.failed) {
+            client.failed = true;
+            worker.login_failures++;
+        }
+    }
+    Phase current = phase.load(std::memory_order_relaxed);
+    bool setup_reply = line.find(" created.") != std::string_view::npos || line.find("Joined group ") != std::string_view::npos;
+    if ((current == Phase::CREATE || current == Phase::JOIN) && client.logged_in && (setup_reply || error != std::string_view::npos)) {
+        worker.replies++;
+    }
+    if (line.find(" is offline, the message") != std::string_view::npos) worker.offline_notices++;
+}
+
+// Take the deliveries and replies out of a client's input, keeping an incomplete tail
+static void parse_input(Worker &worker, Client &client) {
+    std::string_view in = client.in;
+    size_t pos = 0;
+    while (pos < in.size()) {
+        size_t marker = in.find(MARKER, pos);
+        size_t newline = in.find('\n', pos);
+        if (newline < marker) {
+            handle_line(worker, client, in.substr(pos, newline - pos));
+            pos = newline + 1;
+            continue;
+        }
+        if (marker == std::string_view::npos) break;
+        size_t end = in.find('~', marker + 2);
+        if (end == std::string_view::npos || end < marker + 4) {
+            if (end == std::string_view::npos) break;
+            pos = end + 1;  // Not one of ours
+            continue;
+        }
+        const char *tag = std::find(kind_tags, kind_tags + KINDS, in[marker + 2]);
+        uint64_t due = std::strtoull(std::string(in.substr(marker + 3, end - marker - 3)).c_str(), nullptr, 10);
+        if (tag != kind_tags + KINDS && due != 0) {
+            int kind = tag - kind_tags;
+            uint64_t now = now_ns();
+            worker.latency[kind].record(now > due ? now - due : 0);
+            worker.delivered[kind]++;
+            worker.delivered_total.fetch_add(1, std::memory_order_relaxed);
+        }
+        pos = end + 1;
+    }
+    client.in.erase(0, pos);
+    // Nothing of interest in a long run without newline or marker, keep what could start a marker
+    if (client.in.size() > MAX_UNPARSED && client.in.find(MARKER) == std::string::npos) {
+        client.in.erase(0, client.in.size() - 1);
+    }
+}
+
+static void read_client(Worker &worker, Client &client) {
+    char buffer[64 << 10];
+    while (!client.closed) {
+        ssize_t n = recv(client.fd, buffer, sizeof(buffer), 0);
+        if (n > 0) {
+            client.in.append(buffer, n);
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno == EAGAIN) break;
+        if (n < 0) worker.errors[std::string("recv: ") + strerror(errno)]++;
+        parse_input(worker, client);
+        close_client(worker, client);
+        return;
+    }
+    parse_input(worker, client);
+}
+
+// One message of a random kind, stamped with the time it was due
+static void send_load(Worker &worker, int index, uint64_t due) {
+    Client &client = clients[index];
+    if (client.closed || !client.logged_in) return;
+    int kind = worker.kinds(worker.rng);
+    if (kind == GROUP && client.groups.empty()) kind = PRIVATE;  // Not a member of any group
+
+    std::string line;
+    uint64_t expected = 0;
+    if (kind == BROADCAST) {
+        line = "/broadcast ";
+        expected = logged_in_total - 1;
+    } else if (kind == PRIVATE) {
+        int n = clients.size();
+        const Client &to = clients[n > 1 ? (index + 1 + worker.rng() % (n - 1)) % n : index];
+        line = "/msg user" + std::to_string(to.user) + " ";
+        expected = to.logged_in ? 1 : 0;  // Kept for later otherwise
+    } else {
+        const Group &group = groups[client.groups[worker.rng() % client.groups.size()]];
+        line = "/group_msg " + group.name + " ";
+        expected = group.online - 1;
+    }
+    std::string text = MARKER + std::string(1, kind_tags[kind]) + std::to_string(due) + "~";
+    if (text.size() < options.size) text.append(options.size - text.size(), 'x');
+    line += text + "\n";
+
+    worker.sent[kind]++;
+    worker.expected[kind] += expected;
+    worker.expected_total.fetch_add(expected, std::memory_order_relaxed);
+    queue(worker, client, line);
+}
+
+static void enter_phase(Worker &worker, Phase current, uint64_t now, auto &schedule) {
+    for (int index : worker.mine) {
+        Client &client = clients[index];
+        if (!client.logged_in) continue;
+        for (int g : client.groups) {
+            bool owner = groups[g].members[0] == index;
+            if (current == Phase::CREATE && owner) queue(worker, client, "/create_group " + groups[g].name + "\n");
+            if (current == Phase::JOIN && !owner) queue(worker, client, "/join_group " + groups[g].name + "\n");
+        }
+        if (current == Phase::LOAD && options.rate > 0) {
+            // Spread the first sends over one interval so the clients do not send in lockstep
+            uint64_t interval = 1e9 / options.rate;
+            schedule.push({now + worker.rng() % std::max<uint64_t>(interval, 1), index});
+        }
+    }
+}
+
+static void run_worker(Worker &worker) {
+    using Due = std::pair<uint64_t, int>;
+    std::priority_queue<Due, std::vector<Due>, std::greater<Due>> schedule;
+    uint64_t start = now_ns();
+    uint64_t interval = options.rate > 0 ? 1e9 / options.rate : 0;
+    size_t opened = 0;
+    Phase seen = Phase::LOGIN;
+    epoll_event events[256];
+
+    while (seen != Phase::DONE) {
+        uint64_t now = now_ns();
+        Phase current = phase.load();
+        if (current != seen) {
+            enter_phase(worker, current, now, schedule);
+            seen = current;
+        }
+        uint64_t wake = now + 10'000'000;
+        // Open the connections that are due, at --login-rate over all workers
+        while (current == Phase::LOGIN && opened < worker.mine.size()) {
+            int index = worker.mine[opened];
+            uint64_t at = options.login_rate > 0 ? start + index * 1e9 / options.login_rate : start;
+            if (at > now) {
+                wake = std::min(wake, at);
+                break;
+            }
+            open_client(worker, index);
+            opened++;
+        }
+        while (current == Phase::LOAD && !schedule.empty() && schedule.top().first <= now) {
+            auto [due, index] = schedule.top();
+            schedule.pop();
+            send_load(worker, index, due);
+            schedule.push({due + interval, index});
+        }
+        if (current == Phase::LOAD && !schedule.empty()) wake = std::min(wake, schedule.top().first);
+
+        int timeout = (wake > now) ? (wake - now + 999'999) / 1'000'000 : 0;
+        int n = epoll_wait(worker.epoll_fd, events, 256, timeout);
+        for (int i = 0; i < n; i++) {
+            Client &client = clients[events[i].data.u32];
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) read_client(worker, client);
+            if (!client.closed && (events[i].events & EPOLLOUT)) {
+                if (!client.writable) client.writable = true;
+                flush(worker, client);
+            }
+        }
+    }
+
+    for (int index : worker.mine) {
+        Client &client = clients[index];
+        if (client.closed) continue;
+        send(client.fd, "/exit\n", 6, MSG_NOSIGNAL);
+        close(client.fd);
+        client.closed = true;
+    }
+    close(worker.epoll_fd);
+}
+
+// Sum of a worker counter over all workers
+static uint64_t total(const std::function<uint64_t(const Worker &)> &counter) {
+    uint64_t sum = 0;
+    for (auto &worker : workers) sum += counter(*worker);
+    return sum;
+}
+
+// Wait until done() holds or `seconds` passed, returns whether it holds
+static bool wait_for(const std::function<bool()> &done, double seconds) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::duration<double>(seconds);
+    while (!done()) {
+        if (std::chrono::steady_clock::now() >= deadline) return false;
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    return true;
+}
+
+// Percentiles of a merged histogram, in microseconds
+static std::string json_latency(const HistogramSnapshot &snapshot) {
+    std::ostringstream out;
+    out.setf(std::ios::fixed);
+    out.precision(1);
+    out << "{\"count\": " << snapshot.count << ", \"mean\": " << (snapshot.count ? snapshot.sum / 1e3 / snapshot.count : 0.0);
+    static const std::pair<const char *, double> quantiles[] = {{"p50", 0.5}, {"p90", 0.9}, {"p99", 0.99}, {"p999", 0.999}};
+    for (auto [name, q] : quantiles) out << ", \"" << name << "\": " << (snapshot.count ? snapshot.quantile(q) / 1e3 : 0.0);
+    out << ", \"max\": " << snapshot.max / 1e3 << "}";
+    return out.str();
+}
+
+static std::string json_string(std::string_view text) {
+    std::string quoted = "\"";
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            quoted += '\\';
+            quoted += c;
+        } else if ((unsigned char)c < 0x20) {
+            quoted += ' ';
+        } else {
+            quoted += c;
+        }
+    }
+    return quoted + "\"";
+}
+
+static std::string report(double load_s, double drain_s, bool drained) {
+    auto merged = std::make_unique<HistogramSnapshot[]>(KINDS + 2);  // Kinds, all, logins
+    uint64_t sent[KINDS] = {}, delivered[KINDS] = {}, expected[KINDS] = {};
+    std::map<std::string, uint64_t> errors;
+    for (auto &worker : workers) {
+        for (int k = 0; k < KINDS; k++) {
+            merged[k].add(worker->latency[k]);
+            merged[KINDS].add(worker->latency[k]);
+            sent[k] += worker->sent[k];
+            delivered[k] += worker->delivered[k];
+            expected[k] += worker->expected[k];
+        }
+        merged[KINDS + 1].add(worker->login_latency);
+        for (auto &[text, n] : worker->errors) errors[text] += n;
+    }
+    uint64_t sent_total = sent[0] + sent[1] + sent[2], delivered_total = delivered[0] + delivered[1] + delivered[2];
+
+    std::ostringstream out;
+    out.setf(std::ios::fixed);
+    out.precision(3);
+    out << "{\n  \"config\": {\"host\": " << json_string(options.host) << ", \"port\": " << options.port
+        << ", \"clients\": " << options.clients << ", \"first_user\": " << options.first_user << ", \"threads\": " << workers.size()
+        << ", \"login_rate\": " << options.login_rate << ", \"rate\": " << options.rate << ", \"duration_s\": " << options.duration_s
+        << ", \"size\": " << options.size << ", \"mix\": {";
+    for (int k = 0; k < KINDS; k++) out << (k ? ", " : "") << "\"" << kind_names[k] << "\": " << options.mix[k];
+    out << "}, \"group_sizes\": [";
+    for (size_t g = 0; g < groups.size(); g++) out << (g ? ", " : "") << groups[g].members.size();
+    out << "]},\n";
+    out << "  \"logins\": " << logged_in_total << ", \"login_failures\": " << total([](const Worker &w) { return w.login_failures.load(); })
+        << ", \"disconnects\": " << total([](const Worker &w) { return w.disconnects; }) << ",\n";
+    out << "  \"load_s\": " << load_s << ", \"drain_s\": " << drain_s << ", \"drained\": " << (drained ? "true" : "false") << ",\n";
+    for (const char *field : {"sent", "delivered", "expected"}) {
+        const uint64_t *counts = field[0] == 's' ? sent : field[0] == 'd' ? delivered : expected;
+        out << "  \"" << field << "\": {";
+        for (int k = 0; k < KINDS; k++) out << "\"" << kind_names[k] << "\": " << counts[k] << ", ";
+        out << "\"total\": " << counts[0] + counts[1] + counts[2] << "},\n";
+    }
+    uint64_t expected_total = expected[0] + expected[1] + expected[2];
+    out << "  \"lost\": " << (expected_total > delivered_total ? expected_total - delivered_total : 0)
+        << ", \"offline_notices\": " << total([](const Worker &w) { return w.offline_notices; })
+        << ", \"pings\": " << total([](const Worker &w) { return w.pings; }) << ",\n";
+    out << "  \"throughput\": {\"sent_per_s\": " << (load_s > 0 ? sent_total / load_s : 0)
+        << ", \"delivered_per_s\": " << (load_s + drain_s > 0 ? delivered_total / (load_s + drain_s) : 0) << "},\n";
+    out << "  \"latency_us\": {";
+    for (int k = 0; k <= KINDS; k++) out << "\"" << (k < KINDS ? kind_names[k] : "all") << "\": " << json_latency(merged[k]) << (k < KINDS ? ",\n                 " : "");
+    out << "},\n  \"login_latency_us\": " << json_latency(merged[KINDS + 1]) << ",\n";
+    out << "  \"errors\": {";
+    bool first = true;
+    for (auto &[text, n] : errors) {
+        out << (first ? "" : ", ") << json_string(text) << ": " << n;
+        first = false;
+    }
+    out << "}\n}\n";
+
+    std::cerr << "load_gen: " << logged_in_total << "/" << options.clients << " logged in, sent " << sent_total << ", delivered "
+              << delivered_total << "/" << expected_total << ", p99 " << merged[KINDS].quantile(0.99) / 1e3 << " us, errors "
+              << total([](const Worker &w) {
+                     uint64_t n = 0;
+                     for (auto &[text, count] : w.errors) n += count;
+                     return n;
+                 })
+              << std::endl;
+    return out.str();
+}
+
+// "B:P:G" weights of the message kinds
+static bool parse_mix(const std::string &text) {
+    std::istringstream in(text);
+    char colon1 = 0, colon2 = 0;
+    double b, p, g;
+    if (!(in >> b >> colon1 >> p >> colon2 >> g) || colon1 != ':' || colon2 != ':' || b < 0 || p < 0 || g < 0 || b + p + g <= 0) return false;
+    options.mix[BROADCAST] = b;
+    options.mix[PRIVATE] = p;
+    options.mix[GROUP] = g;
+    return true;
+}
+
+// "SIZE[xCOUNT],...", e.g. 5x20,50x2 for twenty groups of 5 and two of 50
+static bool parse_group_sizes(const std::string &text) {
+    options.group_sizes.clear();
+    std::istringstream in(text);
+    std::string item;
+    while (std::getline(in, item, ',')) {
+        char *end;
+        long size = std::strtol(item.c_str(), &end, 10), count = 1;
+        if (*end == 'x') count = std::strtol(end + 1, &end, 10);
+        if (*end != '\0' || size < 1 || count < 1) return false;
+        options.group_sizes.insert(options.group_sizes.end(), count, size);
+    }
+    return true;
+}
+
+static bool parse_args(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool value = i + 1 < argc;
+        if (arg == "--host" && value) {
+            options.host = argv[++i];
+        } else if (arg == "--port" && value) {
+            options.port = std::atoi(argv[++i]);
+        } else if (arg == "--clients" && value) {
+            options.clients = std::atoi(argv[++i]);
+        } else if (arg == "--first-user" && value) {
+            options.first_user = std::atoi(argv[++i]);
+        } else if (arg == "--login-rate" && value) {
+            options.login_rate = std::atof(argv[++i]);
+        } else if (arg == "--rate" && value) {
+            options.rate = std::atof(argv[++i]);
+        } else if (arg == "--duration" && value) {
+            options.duration_s = std::atof(argv[++i]);
+        } else if (arg == "--drain" && value) {
+            options.drain_s = std::atof(argv[++i]);
+        } else if (arg == "--mix" && value) {
+            if (!parse_mix(argv[++i])) {
+                std::cerr << "Error: --mix takes B:P:G weights." << std::endl;
+                return false;
+            }
+        } else if (arg == "--group-sizes" && value) {
+            if (!parse_group_sizes(argv[++i])) {
+                std::cerr << "Error: --group-sizes takes SIZE[xCOUNT],..." << std::endl;
+                return false;
+            }
+        } else if (arg == "--no-groups") {
+            options.group_sizes.clear();
+        } else if (arg == "--size" && value) {
+            options.size = std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--threads" && value) {
+            options.threads = std::atoi(argv[++i]);
+        } else if (arg == "--json" && value) {
+            options.json_path = argv[++i];
+        } else {
+            std::cerr << "Usage: " << argv[0]
+                      << " [--host IP] [--port N] [--clients N] [--first-user N] [--login-rate N] [--rate N] [--duration S] [--drain S]"
+                         " [--mix B:P:G] [--group-sizes SIZE[xCOUNT],... | --no-groups] [--size BYTES] [--threads N] [--json FILE]"
+                      << std::endl;
+            return false;
+        }
+    }
+    if (options.clients < 1 || options.port <= 0 || options.rate < 0 || options.login_rate < 0) {
+        std::cerr << "Error: --clients and --port must be positive, --rate and --login-rate not negative." << std::endl;
+        return false;
+    }
+    if (inet_pton(AF_INET, options.host.c_str(), &server_address.sin_addr) != 1) {
+        std::cerr << "Error: --host takes an IPv4 address." << std::endl;
+        return false;
+    }
+    server_address.sin_family = AF_INET;
+    server_address.sin_port = htons(options.port);
+    return true;
+}
+
+// Lay the groups over the clients one after the other, wrapping around
+static void make_groups() {
+    int n = clients.size(), next = 0;
+    for (size_t g = 0; g < options.group_sizes.size(); g++) {
+        Group group;
+        group.name = "load" + std::to_string(getpid()) + "_" + std::to_string(g);
+        for (int k = 0; k < std::min(options.group_sizes[g], n); k++) {
+            group.members.push_back((next + k) % n);
+            clients[(next + k) % n].groups.push_back(g);
+        }
+        next = (next + group.members.size()) % n;
+        groups.push_back(std::move(group));
+    }
+}
+
+int main(int argc, char *argv[]) {
+    if (!parse_args(argc, argv)) return 1;
+
+    // One descriptor per client
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    clients = std::vector<Client>(options.clients);
+    for (int i = 0; i < options.clients; i++) clients[i].user = options.first_user + i;
+    make_groups();
+
+    int threads = options.threads > 0 ? options.threads : std::max(1u, std::thread::hardware_concurrency());
+    threads = std::min(threads, options.clients);
+    std::random_device seed;
+    for (int t = 0; t < threads; t++) {
+        auto worker = std::make_unique<Worker>();
+        for (int i = t; i < options.clients; i += threads) worker->mine.push_back(i);
+        worker->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        worker->rng.seed(seed());
+        worker->kinds = std::discrete_distribution<int>(options.mix, options.mix + KINDS);
+        workers.push_back(std::move(worker));
+    }
+    for (auto &worker : workers) worker->thread = std::thread(run_worker, std::ref(*worker));
+
+    auto logins = [] { return total([](const Worker &w) { return w.logins.load(); }); };
+    auto replies = [] { return total([](const Worker &w) { return w.replies.load(); }); };
+    double login_s = (options.login_rate > 0 ? options.clients / options.login_rate : 0) + SETUP_TIMEOUT_S;
+    if (!wait_for([&] { return logins() + total([](const Worker &w) { return w.login_failures.load(); }) >= (uint64_t)options.clients; }, login_s)) {
+        std::cerr << "load_gen: only " << logins() << " of " << options.clients << " clients logged in, going on" << std::endl;
+    }
+    logged_in_total = logins();
+
+    // Only the members that logged in ask, so only their replies are awaited
+    uint64_t creates = 0, joins = 0;
+    for (auto &group : groups) {
+        for (int index : group.members) {
+            if (!clients[index].logged_in) continue;
+            group.online++;
+            (index == group.members[0] ? creates : joins)++;
+        }
+    }
+    phase = Phase::CREATE;
+    wait_for([&] { return replies() >= creates; }, SETUP_TIMEOUT_S);
+    phase = Phase::JOIN;
+    wait_for([&] { return replies() >= creates + joins; }, SETUP_TIMEOUT_S);
+
+    auto load_start = std::chrono::steady_clock::now();
+    phase = Phase::LOAD;
+    std::this_thread::sleep_for(std::chrono::duration<double>(options.duration_s));
+    auto load_end = std::chrono::steady_clock::now();
+    phase = Phase::DRAIN;
+    bool drained = wait_for([] {
+        return total([](const Worker &w) { return w.delivered_total.load(); }) >= total([](const Worker &w) { return w.expected_total.load(); });
+    }, options.drain_s);
+    auto drain_end = std::chrono::steady_clock::now();
+    phase = Phase::DONE;
+    for (auto &worker : workers) worker->thread.join();
+
+    std::string json = report(std::chrono::duration<double>(load_end - load_start).count(),
+                              std::chrono::duration<double>(drain_end - load_end).count(), drained);
+    if (options.json_path.empty()) {
+        std::cout << json;
+    } else {
+        std::ofstream(options.json_path) << json;
+    }
+    return logged_in_total > 0 ? 0 : 1;
+}
@@ -1,9 +1,12 @@
 #!/bin/bash
 
-# Create 50 dummy users
+# Create dummy users user1..userN with passwords password1..passwordN (default 50),
+# e.g. ./make_dummy_users.sh 1000 before running load_gen --clients 1000
+
+COUNT=${1:-50}
 
 # read from users.txt.bak line by line
-# restore original and then add 50
+# restore original and then add the dummy users
 
 # empty the file
 > ../users.txt
@@ -13,9 +16,14 @@ do
     echo "$line" >> ../users.txt
 done < users.txt.bak
 
-for i in {1..50}
+for ((i = 1; i <= COUNT; i++))
 do
     echo "user$i:password$i" >> ../users.txt 
 done
 
-echo "Added 50 Dummy Users!"
+# The server prefers the credential index, keep it in step
+if [ -f ../users.idx ] && [ -x ../build_credentials ]; then
+    (cd .. && ./build_credentials)
+fi
+
+echo "Added $COUNT Dummy Users!"
@@ -0,0 +1,285 @@
+// Replays a capture written by server_grp --capture (capture.h) through the server code in this
+// process, with no network: every connection becomes a Session on a made-up socket number, its
+// inputs run through session_input() in the captured order, and what the server sends is kept
+// as a per-connection OutputDigest and checked against the one in the capture. The groups and
+// offline messages recorded after the header are put back first, as the server had them.
+//
+// Passwords are not in a capture, so every user that logged in gets the password "replay" and
+// a failed login is fed a wrong one. A login the server turned away because its auth queue was
+// full is turned away again, by an auth queue of 0. Users of ./users.txt are known, as they were
+// to the server.
+//
+//   ./replay capture.trace                  # as fast as possible, exit status 1 on a mismatch
+//   ./replay --speed 1 capture.trace        # with the captured pacing (2 for twice as fast)
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+
+#include "../auth.h"
+#include "../capture.h"
+#include "../credentials.h"
+#include "../msglog.h"
+#include "../record.h"
+#include "../server_grp.h"
+#include "../upgrade.h"
+
+#define REPLAY_PASSWORD "replay"
+#define WRONG_PASSWORD "replay-wrong"
+
+// Takes the messages for the replayed connections, keeping only their digests
+class ReplaySockets : public SocketLayer {
+   public:
+    void send(const int *sockets, size_t count, const iovec *parts, size_t n) override {
+        if (capture_in_timer()) return;  // Left out of the captured digests too
+        uint64_t hash = OutputDigest::hash_of(parts, n);
+        size_t bytes = 0;
+        for (size_t i = 0; i < n; i++) bytes += parts[i].iov_len;
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (size_t i = 0; i < count; i++) {
+            auto it = output_.find(sockets[i]);
+            if (it != output_.end()) it->second.add(hash, bytes);
+        }
+    }
+
+    void open(int socket) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        output_[socket] = OutputDigest();
+    }
+
+    OutputDigest close(int socket) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        OutputDigest output = output_[socket];
+        output_.erase(socket);
+        return output;
+    }
+
+   private:
+    std::mutex mutex_;
+    std::unordered_map<int, OutputDigest> output_;  // By socket
+};
+
+struct ReplayConnection {
+    std::unique_ptr<Session> session;
+    bool open = true;
+};
+
+struct Report {
+    uint64_t records = 0;
+    uint64_t inputs = 0;
+    uint64_t connections = 0;
+    uint64_t matched = 0;
+    uint64_t mismatched = 0;
+    uint64_t busy_logins = 0;  // Turned away by a full auth queue when captured, and when replayed
+    uint64_t messages = 0;     // Sent by the server during the replay
+    uint64_t bytes = 0;
+};
+
+static void usage(const char *name) {
+    std::cerr << "Usage: " << name << " [--speed X] [--verbose] CAPTURE" << std::endl
+              << "  --speed X   replay at X times the captured pace, 0 (default) for as fast as possible" << std::endl
+              << "  --verbose   print every connection whose output differs" << std::endl;
+}
+
+// A count followed by that many strings
+static bool get_strings(RecordReader &reader, std::vector<std::string> &out) {
+    uint32_t count;
+    if (!reader.get(count)) return false;
+    for (uint32_t i = 0; i < count; i++) {
+        std::string_view value;
+        if (!reader.get(value)) return false;
+        out.emplace_back(value);
+    }
+    return true;
+}
+
+static bool read_file(const std::string &path, std::string &data) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) return false;
+    std::ostringstream contents;
+    contents << file.rdbuf();
+    data = contents.str();
+    return true;
+}
+
+int main(int argc, char **argv) {
+    double speed = 0;
+    bool verbose = false;
+    std::string path;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--speed" && i + 1 < argc) {
+            speed = std::atof(argv[++i]);
+        } else if (arg == "--verbose") {
+            verbose = true;
+        } else if (path.empty() && arg[0] != '-') {
+            path = arg;
+        } else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (path.empty() || speed < 0) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    std::string data;
+    if (!read_file(path, data)) {
+        std::cerr << "Error: Cannot read " << path << "." << std::endl;
+        return 2;
+    }
+
+    // The server as a capture needs it: no throttles and no timers, whose output is not captured
+    config.credentials_path = "";
+    config.rate_limit = 0;
+    config.auth_timeout_s = 0;
+    config.heartbeat_s = 0;
+    config.idle_timeout_s = 0;
+    for (auto &[username, password] : read_credentials_file("users.txt")) {
+        user_credentials[username] = password;
+    }
+    ReplaySockets sockets;
+    socket_layer = &sockets;
+
+    Report report;
+    std::unordered_map<uint32_t, ReplayConnection> connections;  // By captured connection id
+    std::priority_queue<int, std::vector<int>, std::greater<int>> free_sockets;  // Lowest first, as the kernel does
+    int next_socket = 3;
+    bool header = false, bad = false;
+    auto start = std::chrono::steady_clock::now();
+    auto due = start;
+
+    size_t consumed = scan_records(data, [&](std::string_view body) {
+        RecordReader reader{body};
+        uint8_t type;
+        uint32_t id, delta_us;
+        if (!reader.get(type) || !reader.get(id) || !reader.get(delta_us)) return !(bad = true);
+        report.records++;
+        if (speed > 0) {
+            due += std::chrono::microseconds((uint64_t)(delta_us / speed));
+            std::this_thread::sleep_until(due);
+        }
+
+        if (type == CAPTURE_HEADER) {
+            uint32_t version, threshold;
+            if (!reader.get(version) || !reader.get(threshold) || version != CAPTURE_VERSION) return !(bad = true);
+            config.presence_threshold = threshold;
+            return header = true;
+        }
+        if (!header) return !(bad = true);
+        if (type == CAPTURE_GROUP) {
+            Handoff state;
+            HandoffGroup &group = state.groups.emplace_back();
+            std::string_view name;
+            if (!reader.get(name) || !get_strings(reader, group.members) || !get_strings(reader, group.messages)) {
+                return !(bad = true);
+            }
+            group.name = name;
+            handoff_restore_groups(state);
+            return true;
+        }
+        if (type == CAPTURE_BACKLOG) {
+            std::string_view username;
+            std::vector<std::string> messages;
+            if (!reader.get(username) || !get_strings(reader, messages)) return !(bad = true);
+            for (const std::string &message : messages) store_offline({std::string(username)}, message);
+            return true;
+        }
+        if (type == CAPTURE_OPEN) {
+            ReplayConnection &connection = connections[id];
+            connection.session = std::make_unique<Session>();
+            if (free_sockets.empty()) {
+                connection.session->socket = next_socket++;
+            } else {
+                connection.session->socket = free_sockets.top();
+                free_sockets.pop();
+            }
+            sockets.open(connection.session->socket);
+            session_open(*connection.session);
+            report.connections++;
+            return true;
+        }
+
+        auto it = connections.find(id);
+        if (it == connections.end()) return !(bad = true);
+        ReplayConnection &connection = it->second;
+        Session &session = *connection.session;
+        switch (type) {
+        case CAPTURE_FRAMED:
+            session.framed = true;
+            break;
+        case CAPTURE_INPUT: {
+            std::string_view message;
+            if (!reader.get(message)) return !(bad = true);
+            report.inputs++;
+            // A connection the server closed keeps its records until the client noticed
+            if (connection.open && !session_input(session, message.data(), message.size())) {
+                session_close(session);
+                connection.open = false;
+            }
+            break;
+        }
+        case CAPTURE_LOGIN: {
+            uint8_t outcome;
+            if (!reader.get(outcome)) return !(bad = true);
+            if (outcome == LOGIN_BUSY) report.busy_logins++;
+            if (outcome == LOGIN_OK) user_credentials[session.username] = REPLAY_PASSWORD;
+            std::string password = outcome == LOGIN_OK ? REPLAY_PASSWORD : WRONG_PASSWORD;
+            size_t auth_queue = config.auth_queue;
+            if (outcome == LOGIN_BUSY) config.auth_queue = 0;  // Sends the same "Server busy" reply
+            if (connection.open && !session_input(session, password.data(), password.size())) {
+                session_close(session);
+                connection.open = false;
+            }
+            config.auth_queue = auth_queue;
+            break;
+        }
+        case CAPTURE_CLOSE: {
+            OutputDigest captured;
+            if (!reader.get(captured.messages) || !reader.get(captured.bytes) || !reader.get(captured.hash)) return !(bad = true);
+            if (connection.open) session_close(session);
+            OutputDigest replayed = sockets.close(session.socket);
+            free_sockets.push(session.socket);
+            report.messages += replayed.messages;
+            report.bytes += replayed.bytes;
+            if (replayed == captured) {
+                report.matched++;
+            } else {
+                report.mismatched++;
+                if (verbose) {
+                    std::cerr << "Connection " << id << " (" << session.username << "): captured "
+                              << captured.messages << " messages, " << captured.bytes << " bytes, replayed "
+                              << replayed.messages << " messages, " << replayed.bytes << " bytes" << std::endl;
+                }
+            }
+            connections.erase(it);
+            break;
+        }
+        default:
+            return !(bad = true);
+        }
+        return true;
+    });
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    auth_shutdown();
+
+    if (bad || consumed < data.size()) {
+        std::cerr << "Warning: Stopped at a bad record after " << report.records << " records." << std::endl;
+    }
+    std::cout << "{\"records\":" << report.records << ",\"inputs\":" << report.inputs
+              << ",\"connections\":" << report.connections << ",\"unclosed\":" << connections.size()
+              << ",\"elapsed_s\":" << elapsed << ",\"inputs_per_s\":" << (elapsed > 0 ? report.inputs / elapsed : 0)
+              << ",\"messages\":" << report.messages << ",\"bytes\":" << report.bytes
+              << ",\"matched\":" << report.matched << ",\"mismatched\":" << report.mismatched
+              << ",\"busy_logins\":" << report.busy_logins << "}" << std::endl;
+    return report.mismatched == 0 && !bad ? 0 : 1;
+}
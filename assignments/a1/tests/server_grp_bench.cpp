@@ -0,0 +1,529 @@
+#ifndef SERVER_GRP_H
+#include "../server_grp.h"
+#endif
+
+#include "../msglog.h"
+#include "../groupstore.h"
+#include "../timer_wheel.h"
+#include "../reactor.h"
+
+#include <benchmark/benchmark.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <functional>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// Representative client commands, one of each kind
+static const std::vector<std::string> commands = {
+    "/broadcast hello everyone, how is it going?\n",
+    "/msg user2 are you joining the call later?\n",
+    "/group_msg test_group the build is green again\n",
+    "/create_group test_group\n",
+    "/join_group test_group\n",
+    "/leave_group test_group\n",
+    "/list_members test_group\n",
+    "/list_groups\n",
+    "/list_commands\n",
+    "/history test_group 20\n",
+    "/pong\n",
+    "/stats\n",
+    "/exit\n",
+};
+
+static void noop(cstr, cstr, ci) {}
+
+// The parser used before the tokenizer: trim() copy, istringstream and a std::function map
+static std::unordered_map<std::string, std::function<void(cstr, cstr, ci)>> legacy_grpcmd = {
+    {"/group_msg", noop},
+    {"/create_group", noop},
+    {"/join_group", noop},
+    {"/leave_group", noop},
+};
+
+static size_t legacy_parse(cstr input) {
+    std::string command = trim(input);
+    std::istringstream iss(command);
+    std::string cmd;
+    iss >> cmd;
+
+    if (cmd == "/broadcast") {
+        std::string message;
+        std::getline(iss, message);
+        return trim(message).size();
+    } else if (cmd == "/msg") {
+        std::string recipient, message;
+        iss >> recipient;
+        std::getline(iss, message);
+        return recipient.size() + trim(message).size();
+    } else if (legacy_grpcmd.find(cmd) != legacy_grpcmd.end() || cmd == "/list_members") {
+        std::string group_name, message;
+        iss >> group_name;
+        std::getline(iss, message);
+        message = trim(message);
+        if (cmd != "/list_members") legacy_grpcmd[cmd](group_name, message, 0);
+        return group_name.size() + message.size();
+    } else if (cmd == "/list_groups" || cmd == "/list_commands" || cmd == "/exit") {
+        return cmd.size();
+    }
+    return 0;
+}
+
+static size_t tokenizer_parse(cstr input) {
+    Tokenizer tokens(trim_view(input));
+    std::string_view cmd = tokens.next();
+
+    switch (parse_command(cmd)) {
+    case Command::BROADCAST:
+        return tokens.rest_of_line().size();
+    case Command::MSG: {
+        std::string_view recipient = tokens.next();
+        return recipient.size() + tokens.rest_of_line().size();
+    }
+    case Command::GROUP_MSG:
+    case Command::CREATE_GROUP:
+    case Command::JOIN_GROUP:
+    case Command::LEAVE_GROUP:
+    case Command::LIST_MEMBERS: {
+        std::string_view group_name = tokens.next();
+        return group_name.size() + tokens.rest_of_line().size();
+    }
+    case Command::HISTORY: {
+        std::string_view group_name = tokens.next();
+        return group_name.size() + tokens.next().size();
+    }
+    case Command::LIST_GROUPS:
+    case Command::LIST_COMMANDS:
+    case Command::PONG:
+    case Command::STATS:
+    case Command::EXIT:
+        return cmd.size();
+    case Command::UNKNOWN:
+        break;
+    }
+    return 0;
+}
+
+static void BM_ParseCommandLegacy(benchmark::State &state) {
+    const std::string &command = commands[state.range(0)];
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(legacy_parse(command));
+    }
+    state.SetLabel(std::string(trim_view(command).substr(0, trim_view(command).find(' '))));
+}
+BENCHMARK(BM_ParseCommandLegacy)->DenseRange(0, commands.size() - 1);
+
+static void BM_ParseCommandTokenizer(benchmark::State &state) {
+    const std::string &command = commands[state.range(0)];
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(tokenizer_parse(command));
+    }
+    state.SetLabel(std::string(trim_view(command).substr(0, trim_view(command).find(' '))));
+}
+BENCHMARK(BM_ParseCommandTokenizer)->DenseRange(0, commands.size() - 1);
+
+// trim() copies the trimmed command, trim_view() only narrows it
+static void BM_Trim(benchmark::State &state) {
+    const std::string command = "  \t/msg user2 are you joining the call later?  \r\n";
+    for (auto _ : state) {
+        if (state.range(0) == 0) {
+            benchmark::DoNotOptimize(trim(command));
+        } else {
+            benchmark::DoNotOptimize(trim_view(command));
+        }
+    }
+    state.SetLabel(state.range(0) == 0 ? "trim" : "trim_view");
+}
+BENCHMARK(BM_Trim)->Arg(0)->Arg(1);
+
+// N client sockets that all lead to one reader: dups of one end of a socketpair, drained by a
+// thread so that sends never block. The dups are distinct sockets for the directory while
+// 10k of them stay within the descriptor limit.
+struct ClientSockets {
+    int pair[2] = {-1, -1};
+    std::vector<int> sockets;
+    std::thread reader;
+
+    explicit ClientSockets(size_t n) {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0) return;
+        for (size_t i = 0; i < n; i++) sockets.push_back(dup(pair[0]));
+        reader = std::thread([fd = pair[1]] {
+            std::vector<char> buffer(1 << 20);
+            while (recv(fd, buffer.data(), buffer.size(), 0) > 0) {
+            }
+        });
+    }
+
+    ~ClientSockets() {
+        for (int fd : sockets) close(fd);
+        close(pair[0]);  // The reader gets EOF once every dup is closed
+        if (reader.joinable()) reader.join();
+        close(pair[1]);
+    }
+};
+
+// Log in user0..user<n-1>, taking the sockets in turn when there are fewer sockets than users
+static void attach_users(size_t n, const std::vector<int> &sockets) {
+    std::lock_guard<TimedMutex> lock(clients_mutex);
+    for (size_t i = 0; i < n; i++) user_ids.intern("user" + std::to_string(i));
+    update_directory([&](Directory &dir) {
+        for (size_t i = 0; i < n; i++) dir.attach(sockets[i % sockets.size()], user_ids.find("user" + std::to_string(i)));
+    });
+}
+
+// Put user0..user<n-1> in a group
+static void join_users(cstr group_name, size_t n) {
+    std::lock_guard<TimedMutex> lock(clients_mutex);
+    uint32_t group_id = group_ids.intern(group_name);
+    update_directory([&](Directory &dir) {
+        for (size_t i = 0; i < n; i++) dir.join(group_id, user_ids.find("user" + std::to_string(i)));
+    });
+}
+
+static void reset_directory() {
+    rcu_publish<Directory>(directory, new Directory);
+    rcu_barrier();
+    user_ids.clear();
+    group_ids.clear();
+}
+
+// One command through session_input(): the parse_command() switch that replaced the grpcmd map,
+// then the handler, with user0 and user1 online and in group g1
+static const std::vector<std::string> dispatched = {
+    "/broadcast hello everyone, how is it going?",
+    "/msg user1 are you joining the call later?",
+    "/group_msg g1 the build is green again",
+    "/list_members g1",
+    "/list_groups",
+    "/list_commands",
+    "/history g1",
+    "/bogus command",
+};
+
+static void BM_DispatchCommand(benchmark::State &state) {
+    const std::string &command = dispatched[state.range(0)];
+    ClientSockets clients(2);
+    attach_users(2, clients.sockets);
+    join_users("g1", 2);
+    config.rate_limit = 0;
+    Session session;
+    session.socket = clients.sockets[0];
+    session.username = "user0";
+    session.state = SessionState::COMMAND;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(session_input(session, command.data(), command.size()));
+    }
+    state.SetLabel(command.substr(0, command.find(' ')));
+    config.rate_limit = ServerConfig().rate_limit;
+    reset_directory();
+}
+BENCHMARK(BM_DispatchCommand)->DenseRange(0, dispatched.size() - 1);
+
+// One group message to N online members, each on its own socket
+static void BM_GroupMessageFanOut(benchmark::State &state) {
+    size_t n = state.range(0);
+    ClientSockets clients(n);
+    attach_users(n, clients.sockets);
+    join_users("bench", n);
+    std::string message = "the build is green again";
+    for (auto _ : state) {
+        group_message("bench", message, clients.sockets[0]);
+    }
+    state.SetItemsProcessed(state.iterations() * (n - 1));
+    reset_directory();
+}
+BENCHMARK(BM_GroupMessageFanOut)->RangeMultiplier(10)->Range(10, 10000);
+
+// One broadcast to N online clients, each on its own socket
+static void BM_BroadcastFanOut(benchmark::State &state) {
+    size_t n = state.range(0);
+    ClientSockets clients(n);
+    attach_users(n, clients.sockets);
+    std::string message = "(broadcast) @user0 : hello everyone, how is it going?";
+    for (auto _ : state) {
+        broadcast_message(message, clients.sockets[0]);
+    }
+    state.SetItemsProcessed(state.iterations() * (n - 1));
+    reset_directory();
+}
+BENCHMARK(BM_BroadcastFanOut)->RangeMultiplier(10)->Range(10, 10000);
+
+// A private message to a random one of N online users (second argument 0), or only its lookup:
+// the name's id and the recipient's socket in the current directory (1). The users share 64
+// sockets so that 100k of them fit the descriptor limit.
+static void BM_PrivateMessageLookup(benchmark::State &state) {
+    size_t n = state.range(0);
+    ClientSockets clients(64);
+    attach_users(n, clients.sockets);
+    std::mt19937 rng(42);
+    std::vector<std::string> recipients(4096);
+    for (auto &recipient : recipients) recipient = "user" + std::to_string(rng() % n);
+    std::string message = "(private) @user0 : are you joining the call later?";
+    size_t i = 0;
+    for (auto _ : state) {
+        cstr recipient = recipients[i++ % recipients.size()];
+        if (state.range(1) == 0) {
+            private_message(recipient, message, clients.sockets[0]);
+        } else {
+            RcuReadGuard guard;
+            benchmark::DoNotOptimize(directory.load()->socket_of(user_ids.find(recipient)));
+        }
+    }
+    state.SetLabel(state.range(1) == 0 ? "private_message" : "lookup");
+    reset_directory();
+}
+BENCHMARK(BM_PrivateMessageLookup)->ArgsProduct({{1000, 10000, 100000}, {0, 1}});
+
+// Startup with N users: reading users.txt into user_credentials (0), or mapping the index that
+// build_credentials makes from it (1). Runs in the working directory, which must have no users.txt.
+static void BM_LoadCredentials(benchmark::State &state) {
+    if (access("users.txt", F_OK) == 0) {
+        state.SkipWithError("users.txt exists in the working directory");
+        return;
+    }
+    std::vector<std::pair<std::string, std::string>> users;
+    for (int64_t i = 0; i < state.range(0); i++) users.emplace_back("user" + std::to_string(i), "password" + std::to_string(i));
+    {
+        std::ofstream file("users.txt");
+        for (auto &[username, password] : users) file << username << ":" << password << "\n";
+    }
+    config.credentials_path = "bench_users.idx";
+    std::string error;
+    if (state.range(1) == 1 && !write_credential_index(users, config.credentials_path, 1, error)) state.SkipWithError(error.c_str());
+
+    std::streambuf *out = std::cout.rdbuf(nullptr);  // reload_credentials() reports every load
+    for (auto _ : state) {
+        load_credentials();
+        state.PauseTiming();
+        user_credentials.clear();
+        state.ResumeTiming();
+    }
+    std::cout.rdbuf(out);
+    // Mapping the index does not depend on its size, only reading the file is per user
+    if (state.range(1) == 0) state.SetItemsProcessed(state.iterations() * users.size());
+    state.SetLabel(state.range(1) == 0 ? "users.txt" : "users.idx");
+
+    rcu_publish<CredentialIndex>(credential_index, nullptr);
+    rcu_barrier();
+    std::remove("users.txt");
+    std::remove(config.credentials_path.c_str());
+    config.credentials_path = ServerConfig().credentials_path;
+}
+BENCHMARK(BM_LoadCredentials)->ArgsProduct({{10000, 100000, 1000000}, {0, 1}})->Unit(benchmark::kMillisecond);
+
+// Counts the bytes a container holds on the heap
+static size_t counted_bytes = 0;
+
+template <typename T>
+struct CountingAllocator {
+    using value_type = T;
+    CountingAllocator() = default;
+    template <typename U>
+    CountingAllocator(const CountingAllocator<U> &) {}
+    T *allocate(size_t n) {
+        counted_bytes += n * sizeof(T);
+        return std::allocator<T>().allocate(n);
+    }
+    void deallocate(T *p, size_t n) {
+        counted_bytes -= n * sizeof(T);
+        std::allocator<T>().deallocate(p, n);
+    }
+    template <typename U>
+    bool operator==(const CountingAllocator<U> &) const { return true; }
+};
+
+using SocketSet = std::unordered_set<int, std::hash<int>, std::equal_to<int>, CountingAllocator<int>>;
+
+// Fan-out walk over a group stored the old way: a hash set of sockets
+static void BM_GroupIterateHashSet(benchmark::State &state) {
+    counted_bytes = 0;
+    SocketSet members;
+    for (int i = 0; i < state.range(0); i++) members.insert(i * 3);
+    size_t bytes = counted_bytes;
+    for (auto _ : state) {
+        long sum = 0;
+        for (int socket : members) sum += socket;
+        benchmark::DoNotOptimize(sum);
+    }
+    state.counters["bytes_per_member"] = (double)bytes / members.size();
+}
+BENCHMARK(BM_GroupIterateHashSet)->RangeMultiplier(10)->Range(10, 10000);
+
+// Same walk over an IdSet of dense user ids
+static void BM_GroupIterateIdSet(benchmark::State &state) {
+    IdSet members;
+    for (int i = 0; i < state.range(0); i++) members.insert(i * 3);
+    for (auto _ : state) {
+        long sum = 0;
+        members.for_each([&](uint32_t id) { sum += id; });
+        benchmark::DoNotOptimize(sum);
+    }
+    state.counters["bytes_per_member"] = (double)members.memory_usage() / members.size();
+}
+BENCHMARK(BM_GroupIterateIdSet)->RangeMultiplier(10)->Range(10, 10000);
+
+// A sender that waits until its offline message is on disk, with fdatasync on (1) or off (0).
+// Concurrent senders share the writer's batches, so with sync on their throughput grows with
+// the number of threads while fsyncs stay one per batch.
+static void BM_OfflineStoreDurable(benchmark::State &state) {
+    std::string dir = "/tmp/server_grp_bench_log";
+    if (state.thread_index() == 0) {
+        std::system(("rm -rf " + dir).c_str());
+        std::string error;
+        if (!log_open(dir, state.range(0) != 0, error)) state.SkipWithError(error.c_str());
+        stats.log_batches = 0;
+    }
+    std::vector<std::string> recipient = {"user" + std::to_string(state.thread_index())};
+    std::string message = "(private) @user0 : are you joining the call later?";
+    for (auto _ : state) {
+        store_offline(recipient, message);
+        log_flush();
+    }
+    state.SetItemsProcessed(state.iterations());
+    if (state.thread_index() == 0) {
+        log_close();
+        state.counters["records_per_batch"] = benchmark::Counter((double)stats.log_records / std::max<uint64_t>(1, stats.log_batches));
+        stats.log_records = 0;
+        std::system(("rm -rf " + dir).c_str());
+    }
+}
+BENCHMARK(BM_OfflineStoreDurable)->Arg(0)->Arg(1)->Threads(1)->Threads(8)->UseRealTime();
+
+// Restart with 1M memberships: 1000 groups of 1000 members out of 100k users, each user in
+// 10 groups. Maps the snapshot, rebuilds every member set and publishes the directory.
+static void BM_GroupStoreRecovery(benchmark::State &state) {
+    std::string dir = "/tmp/server_grp_bench_groups", error;
+    std::system(("rm -rf " + dir).c_str());
+    if (!group_store_open(dir, false, SIZE_MAX, error)) state.SkipWithError(error.c_str());
+    {
+        std::lock_guard<TimedMutex> lock(clients_mutex);
+        Directory *next = new Directory;
+        std::vector<std::vector<uint32_t>> user_groups(100000);
+        for (uint32_t user = 0; user < user_groups.size(); user++) {
+            user_ids.intern("user" + std::to_string(user));
+        }
+        for (uint32_t group = 0; group < 1000; group++) {
+            uint32_t group_id = group_ids.intern("group" + std::to_string(group));
+            std::vector<uint32_t> members;
+            for (uint32_t i = 0; i < 1000; i++) {
+                members.push_back(i * 100 + group % 100);
+                user_groups[members.back()].push_back(group_id);
+            }
+            next->group_members.set(group_id, std::make_shared<const IdSet>(IdSet::from_sorted(std::move(members))));
+        }
+        for (uint32_t user = 0; user < user_groups.size(); user++) {
+            next->user_groups.set(user, std::make_shared<const IdSet>(IdSet::from_sorted(std::move(user_groups[user]))));
+        }
+        rcu_publish<Directory>(directory, next);
+    }
+    group_store_snapshot();
+    group_store_close();
+
+    for (auto _ : state) {
+        state.PauseTiming();
+        rcu_publish<Directory>(directory, new Directory);
+        rcu_barrier();
+        user_ids.clear();
+        group_ids.clear();
+        state.ResumeTiming();
+        group_store_open(dir, false, SIZE_MAX, error);
+        state.PauseTiming();
+        group_store_close();
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * 1000000);
+    std::system(("rm -rf " + dir).c_str());
+}
+BENCHMARK(BM_GroupStoreRecovery)->Unit(benchmark::kMillisecond);
+
+// One 10 ms tick of an event loop's timer wheel with N connections whose checks are spread over
+// a 30 s heartbeat (3000 ticks): each fired timer is scheduled again one heartbeat later.
+static void BM_TimerWheelTick(benchmark::State &state) {
+    const uint64_t period = 3000;
+    std::vector<TimerNode> timers(state.range(0));
+    TimerWheel wheel;
+    for (size_t i = 0; i < timers.size(); i++) wheel.schedule(&timers[i], 1 + i % period);
+    uint64_t tick = 0, fired = 0;
+    for (auto _ : state) {
+        fired += wheel.advance(++tick, [&](TimerNode *node) { wheel.schedule(node, wheel.now() + period); });
+    }
+    state.counters["fired/tick"] = benchmark::Counter((double)fired / state.iterations());
+}
+BENCHMARK(BM_TimerWheelTick)->RangeMultiplier(10)->Range(1000, 100000);
+
+// What metrics add to one command: its timer (two clock reads and a histogram record) and the
+// fan-out record of its one send, to compare with the microseconds a command costs
+static void BM_CommandMetrics(benchmark::State &state) {
+    metrics_enable(state.range(0));
+    for (auto _ : state) {
+        auto start = std::chrono::steady_clock::now();
+        metrics_sent(1, 64);
+        metrics_command(1, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+    }
+    metrics_enable(true);
+}
+BENCHMARK(BM_CommandMetrics)->Arg(0)->Arg(1);
+
+// Reconnect storm against an epoll event loop listening with a backlog of N: each iteration connects
+// 500 clients at once, waits for every username prompt (accepted and set up) and resets them all,
+// so no TIME_WAIT is left to use up the client ports. 100 iterations are 50k reconnects.
+static std::thread accept_server;
+
+static void start_accept_server(const benchmark::State &state) {
+    config.io_mode = IoMode::EPOLL;
+    config.workers = 1;
+    config.backlog = state.range(0);
+    config.port = 20000 + getpid() % 20000;
+    int server_socket = create_server_socket(config.port);
+    running = true;
+    accept_server = std::thread([server_socket] {
+        run_epoll_server(server_socket);
+        reactor_shutdown();
+        close(server_socket);
+    });
+}
+
+static void stop_accept_server(const benchmark::State &) {
+    running = false;
+    accept_server.join();
+    config = ServerConfig();
+}
+
+static void BM_AcceptReconnects(benchmark::State &state) {
+    const int window = 500;
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(config.port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    linger reset{1, 0};
+    char prompt[64];
+    for (auto _ : state) {
+        std::vector<int> clients;
+        for (int i = 0; i < window; i++) {
+            int fd = socket(AF_INET, SOCK_STREAM, 0);
+            setsockopt(fd, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+            if (connect(fd, (sockaddr *)&addr, sizeof(addr)) < 0) {
+                state.SkipWithError("connect failed");
+                close(fd);
+                break;
+            }
+            clients.push_back(fd);
+        }
+        for (int fd : clients) {
+            benchmark::DoNotOptimize(recv(fd, prompt, sizeof(prompt), 0));
+            close(fd);
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * window);
+}
+BENCHMARK(BM_AcceptReconnects)->Arg(4096)->Iterations(100)->Setup(start_accept_server)->Teardown(stop_accept_server)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+BENCHMARK_MAIN();
@@ -1,12 +1,23 @@
 #ifndef SERVER_GRP_H
 #include "../server_grp.h"
 #endif
+#include "../payload.h"
+#include "../msglog.h"
+#include "../groupstore.h"
+#include "../presence.h"
+#include "../reactor.h"
+#include "../sendq.h"
+#include "../timer_wheel.h"
+#include "../upgrade.h"
+#include "../capture.h"
+#include "../record.h"
 
 #include <arpa/inet.h>
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 #include <netinet/in.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <unistd.h>
 
 #include <cstdlib>
@@ -14,6 +25,8 @@
 #include <ctime>
 #include <fstream>
 #include <iostream>
+#include <map>
+#include <mutex>
 #include <random>
 #include <thread>
 
@@ -64,7 +77,8 @@ void setup_client_socket(int& client_socket, int port, struct sockaddr_in& serve
     server_addr.sin_port = htons(port);
 
     ASSERT_EQ(connect(client_socket, (struct sockaddr*)&server_addr, sizeof(server_addr)), 0) << "Failed to connect client socket";
-    clients[client_socket] = username;
+    uint32_t user_id = user_ids.intern(username);
+    update_directory([&](Directory& dir) { dir.attach(client_socket, user_id); });
 }
 
 inline void accept_and_handle(int server_socket, struct sockaddr_in* client_addr, std::function<void(int)> handler) {
@@ -75,18 +89,32 @@ inline void accept_and_handle(int server_socket, struct sockaddr_in* client_addr
     close(connection_socket);
 }
 
-void add_user_to_group(const std::string& group_name, int client_socket, const std::string& username) {
-    groups[group_name].insert(client_socket);
-    users[username].insert(group_name);
+void add_user_to_group(const std::string& group_name, const std::string& username) {
+    uint32_t group_id = group_ids.intern(group_name);
+    uint32_t user_id = user_ids.intern(username);
+    update_directory([&](Directory& dir) { dir.join(group_id, user_id); });
+}
+
+bool is_member(const std::string& group_name, const std::string& username) {
+    uint32_t group_id = group_ids.find(group_name);
+    uint32_t user_id = user_ids.find(username);
+    const Directory& dir = *directory.load();
+    EXPECT_EQ(dir.members(group_id).contains(user_id), dir.groups_of(user_id).contains(group_id));
+    return dir.members(group_id).contains(user_id);
+}
+
+void reset_state() {
+    rcu_publish<Directory>(directory, new Directory);
+    rcu_barrier();
+    user_ids.clear();
+    group_ids.clear();
 }
 
 void cleanup() {
     close(server_socket);
     close(client_socket[0]);
     close(client_socket[1]);
-    clients.clear();
-    groups.clear();
-    users.clear();
+    reset_state();
 }
 
 TEST(ServerGrpTest, LoadCredentials) {
@@ -103,6 +131,38 @@ TEST(ServerGrpTest, LoadCredentials) {
     std::remove("users.txt");
 }
 
+TEST(ServerGrpTest, CredentialIndexReload) {
+    std::string error;
+    config.credentials_path = "test_users.idx";
+    ASSERT_TRUE(write_credential_index({{"user1", "password1"}, {"user2", "password2"}}, config.credentials_path, 16, error));
+    ASSERT_TRUE(reload_credentials());
+    EXPECT_TRUE(check_credentials("user1", "password1"));
+    EXPECT_FALSE(check_credentials("user1", "password2"));
+    EXPECT_FALSE(check_credentials("user3", "password3"));
+
+    // The new file replaces the mapped one while a reader still holds it
+    {
+        RcuReadGuard guard;
+        const CredentialIndex* old_index = credential_index.load();
+        ASSERT_TRUE(write_credential_index({{"user3", "password3"}}, config.credentials_path, 16, error));
+        ASSERT_TRUE(reload_credentials());
+        EXPECT_TRUE(old_index->verify("user1", "password1"));
+    }
+    EXPECT_FALSE(check_credentials("user1", "password1"));
+    EXPECT_TRUE(check_credentials("user3", "password3"));
+
+    // A broken file keeps the current index. Files are replaced by rename(), truncating a mapped one would fault.
+    std::ofstream("test_users.idx.tmp") << "not an index";
+    std::rename("test_users.idx.tmp", "test_users.idx");
+    EXPECT_FALSE(reload_credentials());
+    EXPECT_TRUE(check_credentials("user3", "password3"));
+
+    rcu_publish<CredentialIndex>(credential_index, nullptr);
+    rcu_barrier();
+    std::remove("test_users.idx");
+    config.credentials_path = "users.idx";
+}
+
 TEST(ServerGrpTest, SendAndReceiveMessage) {
     init();
 
@@ -136,9 +196,8 @@ TEST(ServerGrpTest, CreateGroup) {
 
     if (client_thread.joinable()) client_thread.join();
 
-    EXPECT_TRUE(groups.find(group_name) != groups.end());
-    EXPECT_TRUE(groups[group_name].find(client_socket[0]) != groups[group_name].end());
-    EXPECT_TRUE(users[username[0]].find(group_name) != users[username[0]].end());
+    EXPECT_TRUE(directory.load()->has_group(group_ids.find(group_name)));
+    EXPECT_TRUE(is_member(group_name, username[0]));
 
     cleanup();
 }
@@ -146,7 +205,7 @@ TEST(ServerGrpTest, CreateGroup) {
 TEST(ServerGrpTest, JoinGroup) {
     init();
 
-    add_user_to_group(group_name, client_socket[0], username[0]);
+    add_user_to_group(group_name, username[0]);
 
     std::thread client_thread([&]() {
         join_group(group_name, username[1], client_socket[1]);
@@ -166,8 +225,7 @@ TEST(ServerGrpTest, JoinGroup) {
 
     if (client_thread.joinable()) client_thread.join();
 
-    EXPECT_TRUE(groups[group_name].find(client_socket[1]) != groups[group_name].end());
-    EXPECT_TRUE(users[username[1]].find(group_name) != users[username[1]].end());
+    EXPECT_TRUE(is_member(group_name, username[1]));
 
     cleanup();
 }
@@ -175,8 +233,8 @@ TEST(ServerGrpTest, JoinGroup) {
 TEST(ServerGrpTest, LeaveGroup) {
     init();
 
-    add_user_to_group(group_name, client_socket[0], username[0]);
-    add_user_to_group(group_name, client_socket[1], username[1]);
+    add_user_to_group(group_name, username[0]);
+    add_user_to_group(group_name, username[1]);
 
     std::thread client_thread([&]() {
         leave_group(group_name, username[1], client_socket[1]);
@@ -192,8 +250,7 @@ TEST(ServerGrpTest, LeaveGroup) {
 
     if (client_thread.joinable()) client_thread.join();
 
-    EXPECT_TRUE(groups[group_name].find(client_socket[1]) == groups[group_name].end());
-    EXPECT_TRUE(users[username[1]].find(group_name) == users[username[1]].end());
+    EXPECT_FALSE(is_member(group_name, username[1]));
 
     cleanup();
 }
@@ -240,8 +297,8 @@ TEST(ServerGrpTest, PrivateMessage) {
 TEST(ServerGrpTest, GroupMessage) {
     init();
 
-    add_user_to_group(group_name, client_socket[0], username[0]);
-    add_user_to_group(group_name, client_socket[1], username[1]);
+    add_user_to_group(group_name, username[0]);
+    add_user_to_group(group_name, username[1]);
 
     std::thread client_thread([&]() {
         group_message(group_name, "Group message", client_socket[0]);
@@ -279,6 +336,7 @@ TEST(ServerGrpTest, ListCommands) {
         EXPECT_TRUE(std::string(buffer).find("/list_members") != std::string::npos);
         EXPECT_TRUE(std::string(buffer).find("/list_groups") != std::string::npos);
         EXPECT_TRUE(std::string(buffer).find("/list_commands") != std::string::npos);
+        EXPECT_TRUE(std::string(buffer).find("/history") != std::string::npos);
         EXPECT_TRUE(std::string(buffer).find("/exit") != std::string::npos);
     });
 
@@ -290,8 +348,8 @@ TEST(ServerGrpTest, ListCommands) {
 TEST(ServerGrpTest, ListGroups) {
     init();
 
-    add_user_to_group("group1", client_socket[0], username[0]);
-    add_user_to_group("group2", client_socket[0], username[0]);
+    add_user_to_group("group1", username[0]);
+    add_user_to_group("group2", username[0]);
 
     std::thread client_thread([&]() {
         list_groups(username[0], client_socket[0]);
@@ -312,8 +370,8 @@ TEST(ServerGrpTest, ListGroups) {
 TEST(ServerGrpTest, ListMembers) {
     init();
 
-    add_user_to_group(group_name, client_socket[0], username[0]);
-    add_user_to_group(group_name, client_socket[1], username[1]);
+    add_user_to_group(group_name, username[0]);
+    add_user_to_group(group_name, username[1]);
 
     std::thread client_thread([&]() {
         list_members(group_name, client_socket[0]);
@@ -331,6 +389,793 @@ TEST(ServerGrpTest, ListMembers) {
     cleanup();
 }
 
+TEST(ServerGrpTest, SendQueueOverflowPolicies) {
+    const size_t high = 100, low = 40;
+    Payload message(std::string(30, 'x'));
+    auto fill = [&](SendQueue& queue, OverflowPolicy policy) {
+        for (int i = 0; i < 3; i++) EXPECT_EQ(queue.push(&message, 1, high, policy), Admit::QUEUED);
+        EXPECT_EQ(queue.bytes, 90u);
+        EXPECT_FALSE(queue.congested);
+    };
+
+    // Drop: everything past the high watermark until the socket drained the queue to the low one
+    SendQueue dropping;
+    fill(dropping, OverflowPolicy::DROP);
+    int dropped = 0;
+    for (int i = 0; i < 5; i++) dropped += dropping.push(&message, 1, high, OverflowPolicy::DROP) == Admit::DROPPED;
+    EXPECT_EQ(dropped, 5);
+    EXPECT_EQ(dropping.bytes, 90u);
+    dropping.consume(40);
+    dropping.flushed(low);
+    EXPECT_TRUE(dropping.congested);  // 50 bytes left, still above the low watermark
+    EXPECT_EQ(dropping.push(&message, 1, high, OverflowPolicy::DROP), Admit::DROPPED);
+    dropping.consume(10);
+    dropping.flushed(low);
+    EXPECT_FALSE(dropping.congested);
+    EXPECT_EQ(dropping.push(&message, 1, high, OverflowPolicy::DROP), Admit::QUEUED);
+    EXPECT_EQ(dropping.bytes, 70u);
+
+    // Disconnect: the caller closes the connection, the queue is left alone
+    SendQueue disconnecting;
+    fill(disconnecting, OverflowPolicy::DISCONNECT);
+    EXPECT_EQ(disconnecting.push(&message, 1, high, OverflowPolicy::DISCONNECT), Admit::DISCONNECT);
+    EXPECT_EQ(disconnecting.messages.size(), 3u);
+
+    // Coalesce: the part-written front stays, the rest becomes one notice that keeps counting
+    SendQueue coalescing;
+    fill(coalescing, OverflowPolicy::COALESCE);
+    coalescing.consume(10);
+    EXPECT_EQ(coalescing.push(&message, 1, high, OverflowPolicy::COALESCE), Admit::COALESCED);
+    EXPECT_EQ(coalescing.push(&message, 1, high, OverflowPolicy::COALESCE), Admit::COALESCED);
+    ASSERT_EQ(coalescing.messages.size(), 3u);
+    EXPECT_EQ(coalescing.offset, 10u);
+    int notices = 0;
+    for (const OutMessage& queued : coalescing.messages) notices += queued.notice;
+    EXPECT_EQ(notices, 1);
+    const Payload& notice = coalescing.messages[1].data;
+    EXPECT_EQ(std::string(notice.data(), notice.size()), "... 3 messages skipped, connection too slow ...\n");
+    size_t bytes = 0;
+    for (const OutMessage& queued : coalescing.messages) bytes += queued.data.size();
+    EXPECT_EQ(coalescing.bytes, bytes - coalescing.offset);
+    coalescing.consume(coalescing.bytes);
+    coalescing.flushed(low);
+    EXPECT_TRUE(coalescing.empty());
+    EXPECT_FALSE(coalescing.congested);
+    EXPECT_EQ(coalescing.skipped, 0u);
+    EXPECT_EQ(coalescing.push(&message, 1, high, OverflowPolicy::COALESCE), Admit::QUEUED);
+}
+
+TEST(ServerGrpTest, FramedPipelinedCommands) {
+    int pair[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, pair), 0);
+    user_credentials["user1"] = "password1";
+
+    Session session;
+    session.socket = pair[0];
+    std::string first = PROTO_HELLO "us";
+    std::string rest = "er1\npassword1\n/create_group g1\n/list_groups\n/list_comm";
+    EXPECT_TRUE(session_receive(session, first.data(), first.size()));
+    EXPECT_TRUE(session.framed);
+    EXPECT_TRUE(session_receive(session, rest.data(), rest.size()));
+    EXPECT_EQ(session.state, SessionState::COMMAND);
+    EXPECT_EQ(session.inbuf, "/list_comm");
+    EXPECT_EQ(directory.load()->socket_of(user_ids.find("user1")), pair[0]);
+
+    char buffer[BUFFER_SIZE] = {0};
+    recv(pair[1], buffer, sizeof(buffer) - 1, 0);
+    std::string received = buffer;
+    EXPECT_EQ(received, "Enter password: Welcome to the server, user1!\nGroup g1 created.\nYou are in the following groups:\ng1\n");
+
+    std::string exit = "ands\n/exit\n";
+    EXPECT_FALSE(session_receive(session, exit.data(), exit.size()));
+    EXPECT_EQ(session.state, SessionState::CLOSING);
+    EXPECT_EQ(directory.load()->socket_of(user_ids.find("user1")), -1);
+    EXPECT_EQ(directory.load()->user_of(pair[0]), NO_ID);
+    EXPECT_TRUE(is_member("g1", "user1"));
+
+    session_close(session);
+    close(pair[0]);
+    close(pair[1]);
+    reset_state();
+}
+
+TEST(ServerGrpTest, AuthQueueFullRejectsLogin) {
+    int pair[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, pair), 0);
+    user_credentials["user1"] = "password1";
+    uint64_t rejected = stats.auth_rejected;
+    config.auth_queue = 0;
+
+    Session session;
+    session.socket = pair[0];
+    std::string login = PROTO_HELLO "user1\npassword1\n";
+    EXPECT_FALSE(session_receive(session, login.data(), login.size()));
+    EXPECT_EQ(session.state, SessionState::CLOSING);
+    EXPECT_EQ(stats.auth_rejected, rejected + 1);
+    EXPECT_EQ(directory.load()->user_of(pair[0]), NO_ID);
+
+    char buffer[BUFFER_SIZE] = {0};
+    recv(pair[1], buffer, sizeof(buffer) - 1, 0);
+    EXPECT_STREQ(buffer, "Enter password: Error: Server busy, try again later.\n");
+
+    config.auth_queue = ServerConfig().auth_queue;
+    close(pair[0]);
+    close(pair[1]);
+    reset_state();
+}
+
+TEST(ServerGrpTest, OfflineMessagesSurviveRestart) {
+    std::string error;
+    std::string dir = "test_msglog";
+    ASSERT_TRUE(log_open(dir, true, error)) << error;
+    bool durable = false;
+    store_offline({"user1"}, "(private) @user2 : first", [&]() { durable = true; });
+    store_offline({"user1", "user2"}, "[g1] @user3 : second");
+    log_flush();
+    EXPECT_TRUE(durable);
+    log_close();
+
+    // Replayed from disk, then marked delivered
+    ASSERT_TRUE(log_open(dir, true, error)) << error;
+    EXPECT_EQ(take_backlog("user1"), "(private) @user2 : first\n[g1] @user3 : second\n");
+    EXPECT_EQ(take_backlog("user1"), "");
+    log_close();
+
+    // A torn record at the end is dropped, the rest stays
+    ASSERT_TRUE(log_open(dir, true, error)) << error;
+    EXPECT_EQ(take_backlog("user1"), "");
+    log_close();
+    std::ofstream(dir + "/00000000000000000009.log", std::ios::binary) << std::string("\x20\0\0\0garbage", 11);
+    ASSERT_TRUE(log_open(dir, true, error)) << error;
+    EXPECT_EQ(take_backlog("user2"), "[g1] @user3 : second\n");
+    log_close();
+
+    std::system(("rm -rf " + dir).c_str());
+}
+
+TEST(ServerGrpTest, GroupsSurviveRestart) {
+    std::string error;
+    std::string dir = "test_groups", crashed = "test_groups_crashed";
+    int sink[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, sink), 0);
+    ASSERT_TRUE(group_store_open(dir, true, 1000, error)) << error;
+    create_group("g1", "user1", sink[0]);
+    join_group("g1", "user2", sink[0]);
+    create_group("g2", "user2", sink[0]);
+    ASSERT_TRUE(group_store_snapshot());
+    join_group("g2", "user3", sink[0]);
+    leave_group("g1", "user1", sink[0]);
+
+    // A crash now leaves the snapshot, a WAL with the last two operations and a torn record
+    std::system(("rm -rf " + crashed + " && cp -r " + dir + " " + crashed).c_str());
+    std::ofstream(crashed + "/00000000000000000002.wal", std::ios::binary | std::ios::app) << std::string("\x20\0\0\0garbage", 11);
+    group_store_close();
+
+    for (const std::string& state_dir : {crashed, dir}) {
+        reset_state();
+        ASSERT_TRUE(group_store_open(state_dir, true, 1000, error)) << error;
+        EXPECT_FALSE(is_member("g1", "user1"));
+        EXPECT_TRUE(is_member("g1", "user2"));
+        EXPECT_TRUE(is_member("g2", "user2"));
+        EXPECT_TRUE(is_member("g2", "user3"));
+        group_store_close();
+    }
+
+    reset_state();
+    close(sink[0]);
+    close(sink[1]);
+    std::system(("rm -rf " + dir + " " + crashed).c_str());
+}
+
+TEST(ServerGrpTest, PayloadSharedAndRecycled) {
+    std::string message = "[test_group] @user1 : Group message";
+    Payload payload(message);
+    Payload copy = payload;
+    EXPECT_EQ(copy.data(), payload.data());
+    EXPECT_EQ(std::string(copy.data(), copy.size()), message);
+
+    const char* released = payload.data();
+    payload = Payload();
+    copy = Payload();
+    Payload reused(message);
+    EXPECT_EQ(reused.data(), released);
+
+    std::string large(100000, 'x');
+    Payload unpooled(large);
+    EXPECT_EQ(std::string(unpooled.data(), unpooled.size()), large);
+
+    Payload empty(nullptr, 0);
+    EXPECT_EQ(empty.size(), 0u);
+    EXPECT_EQ(Payload(std::string()).size(), 0u);
+}
+
+TEST(ServerGrpTest, GroupHistoryBoundedAndReplayed) {
+    GroupHistory history;
+    for (int i = 0; i < HISTORY_MESSAGES + 50; i++) {
+        history.append(Payload("message " + std::to_string(i)));
+    }
+    EXPECT_EQ(history.size(), (size_t)HISTORY_MESSAGES);
+    std::vector<Payload> last = history.recent(2);
+    ASSERT_EQ(last.size(), 2u);
+    EXPECT_EQ(std::string(last[0].data(), last[0].size()), "message " + std::to_string(HISTORY_MESSAGES + 48));
+    history.append(Payload(std::string(HISTORY_BYTES - 10, 'x')));
+    EXPECT_LE(history.bytes(), (size_t)HISTORY_BYTES);
+    EXPECT_EQ(history.size(), 1u);
+
+    // Members read the messages of their group in one reply
+    int sockets[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets), 0);
+    add_user_to_group("g1", username[0]);
+    update_directory([&](Directory& dir) { dir.attach(sockets[0], user_ids.find(username[0])); });
+    group_message("g1", "first", sockets[0]);
+    group_message("g1", "second", sockets[0]);
+    send_history("g1", 1, sockets[0]);
+    char buffer[BUFFER_SIZE] = {0};
+    recv(sockets[1], buffer, sizeof(buffer) - 1, 0);
+    EXPECT_STREQ(buffer, "History of group g1 (1 messages):\n[g1] @user1 : second\n");
+
+    close(sockets[0]);
+    close(sockets[1]);
+    reset_state();
+}
+
+TEST(ServerGrpTest, PresenceNoticesCoalesced) {
+    config.presence_threshold = 2;
+    uint64_t saved = stats.presence_sends_saved;
+    int members[2][2], sink[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, sink), 0);
+    for (int i = 0; i < 2; i++) {
+        ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, members[i]), 0);
+        add_user_to_group("g1", username[i]);
+        update_directory([&](Directory& dir) { dir.attach(members[i][0], user_ids.find(username[i])); });
+    }
+
+    // Three events for two online members: one digest each instead of six notices
+    join_group("g1", "user3", sink[0]);
+    join_group("g1", "user4", sink[0]);
+    leave_group("g1", "user3", sink[0]);
+    presence_flush();
+    for (int i = 0; i < 2; i++) {
+        char buffer[BUFFER_SIZE] = {0};
+        recv(members[i][1], buffer, sizeof(buffer) - 1, 0);
+        EXPECT_STREQ(buffer, "Group g1: 2 users joined, 1 left.");
+    }
+    EXPECT_EQ(stats.presence_sends_saved - saved, 4u);
+
+    config.presence_threshold = ServerConfig().presence_threshold;
+    for (int fd : {sink[0], sink[1], members[0][0], members[0][1], members[1][0], members[1][1]}) close(fd);
+    reset_state();
+}
+
+TEST(ServerGrpTest, RateLimitChargesFanOut) {
+    config.rate_limit = 10;
+    config.rate_burst = 10;
+    uint64_t throttled = stats.throttled;
+    int pairs[10][2];
+    for (int i = 0; i < 10; i++) {
+        ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, pairs[i]), 0);
+        uint32_t user_id = user_ids.intern("user" + std::to_string(i + 1));
+        update_directory([&](Directory& dir) { dir.attach(pairs[i][0], user_id); });
+    }
+
+    Session session;
+    session.socket = pairs[0][0];
+    session_open(session);
+    session.username = "user1";
+    session.state = SessionState::COMMAND;
+    session.framed = true;
+
+    // A broadcast to 9 clients costs 10, the whole burst: the second one puts the client in debt
+    std::string input = "/broadcast a\n/broadcast b\n/list_groups\n";
+    EXPECT_TRUE(session_receive(session, input.data(), input.size()));
+    EXPECT_TRUE(session.throttled);
+    EXPECT_EQ(session.inbuf, "/list_groups\n");
+    EXPECT_GT(session.throttled_until, std::chrono::steady_clock::now() + std::chrono::milliseconds(500));
+    EXPECT_EQ(stats.throttled - throttled, 1u);
+
+    // Resuming runs what was held back, which costs 2 and stays in debt
+    EXPECT_TRUE(session_resume(session));
+    EXPECT_TRUE(session.inbuf.empty());
+    EXPECT_TRUE(session.throttled);
+    EXPECT_EQ(stats.throttled - throttled, 2u);
+
+    config.rate_limit = ServerConfig().rate_limit;
+    config.rate_burst = ServerConfig().rate_burst;
+    for (auto& pair : pairs) {
+        close(pair[0]);
+        close(pair[1]);
+    }
+    reset_state();
+}
+
+TEST(ServerGrpTest, TimerWheelFiresOnTime) {
+    // Delays on every level, beyond the last one, and some cancelled
+    std::vector<uint64_t> delays = {1, 5, 63, 64, 65, 100, 4095, 4096, 5000, 262143, 262144, 300000, 16777215, 20000000};
+    std::vector<TimerNode> timers(delays.size() * 2);
+    TimerWheel wheel;
+    wheel.advance(7, [](TimerNode*) {});
+    for (size_t i = 0; i < timers.size(); i++) wheel.schedule(&timers[i], 7 + delays[i / 2]);
+    for (size_t i = 1; i < timers.size(); i += 2) wheel.cancel(&timers[i]);
+    EXPECT_EQ(wheel.size(), delays.size());
+
+    std::vector<uint64_t> fired_at(timers.size(), 0);
+    auto fire = [&](TimerNode* node) { fired_at[node - timers.data()] = wheel.now(); };
+    for (uint64_t tick = 8; tick <= 7 + delays.back(); tick += 1 + tick / 1000) {
+        EXPECT_GE(wheel.next_tick(), wheel.now() + 1);
+        wheel.advance(tick, fire);
+    }
+    wheel.advance(7 + delays.back(), fire);
+    for (size_t i = 0; i < timers.size(); i++) {
+        EXPECT_EQ(fired_at[i], i % 2 == 0 ? 7 + delays[i / 2] : 0) << "delay " << delays[i / 2];
+    }
+    EXPECT_EQ(wheel.size(), 0u);
+}
+
+TEST(ServerGrpTest, SessionTimeoutsAndHeartbeat) {
+    int pair[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, pair), 0);
+    Session session;
+    session.socket = pair[0];
+    session_open(session);
+    std::chrono::steady_clock::time_point next;
+    auto opened = session.opened;
+
+    // Not logged in: only the auth deadline counts
+    EXPECT_TRUE(session_check_timeouts(session, opened, next));
+    EXPECT_EQ(next, opened + std::chrono::seconds(config.auth_timeout_s));
+    EXPECT_FALSE(session_check_timeouts(session, next, next));
+
+    // Logged in and framed: a heartbeat after --heartbeat of silence, disconnected after --idle-timeout
+    session.state = SessionState::COMMAND;
+    session.framed = true;
+    auto quiet = session.last_input;
+    EXPECT_TRUE(session_check_timeouts(session, quiet, next));
+    EXPECT_EQ(next, quiet + std::chrono::seconds(config.heartbeat_s));
+    EXPECT_TRUE(session_check_timeouts(session, next, next));
+    EXPECT_TRUE(session.pinged);
+    EXPECT_EQ(next, quiet + std::chrono::seconds(config.idle_timeout_s));
+    EXPECT_FALSE(session_check_timeouts(session, next, next));
+
+    char buffer[BUFFER_SIZE] = {0};
+    recv(pair[1], buffer, sizeof(buffer) - 1, 0);
+    EXPECT_EQ(std::string(buffer), "Enter username: Error: Login timed out.\n/ping\nError: Disconnected after " +
+                                       std::to_string(config.idle_timeout_s) + " seconds of inactivity.\n");
+    close(pair[0]);
+    close(pair[1]);
+}
+
+TEST(ServerGrpTest, HandoffCarriesSessionsAndSockets) {
+    int client[2], listener[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, client), 0);
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, listener), 0);
+    add_user_to_group("g1", "user1");
+    add_user_to_group("g1", "user2");
+    directory.load()->group_history.get(group_ids.find("g1"))->append(Payload(std::string("[g1] @user2 : hi\n")));
+
+    Handoff sent;
+    sent.listeners.push_back(listener[0]);
+    HandoffConnection &conn = sent.connections.emplace_back();
+    conn.socket = client[0];
+    conn.session.username = "user1";
+    conn.session.framed = true;
+    conn.session.inbuf = "/broadcast half a li";
+    conn.session.tokens = 5;
+    conn.session.last_input = std::chrono::steady_clock::now() - std::chrono::seconds(2);
+    conn.output = "not written yet\n";
+    handoff_save_groups(sent);
+
+    // The old server's side of the Unix socket
+    std::string path = "test_upgrade.sock", error;
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path.c_str());
+    int control = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path.c_str());
+    ASSERT_EQ(bind(control, (sockaddr*)&addr, sizeof(addr)), 0);
+    ASSERT_EQ(listen(control, 1), 0);
+    std::thread old_server([&] {
+        int successor = accept(control, nullptr, nullptr);
+        EXPECT_TRUE(upgrade_send(successor, sent, error)) << error;
+        close(successor);
+    });
+    Handoff received;
+    ASSERT_TRUE(upgrade_receive(path, received, error)) << error;
+    old_server.join();
+    close(control);
+    unlink(path.c_str());
+
+    ASSERT_EQ(received.listeners.size(), 1u);
+    ASSERT_EQ(received.connections.size(), 1u);
+    HandoffConnection &got = received.connections[0];
+    EXPECT_EQ(got.session.username, "user1");
+    EXPECT_TRUE(got.session.framed);
+    EXPECT_EQ(got.session.inbuf, "/broadcast half a li");
+    EXPECT_EQ(got.session.tokens, 5);
+    EXPECT_FALSE(got.session.throttled);
+    EXPECT_GE(std::chrono::steady_clock::now() - got.session.last_input, std::chrono::seconds(2));
+    EXPECT_EQ(got.output, "not written yet\n");
+
+    // The descriptors are new ones for the same sockets
+    char buffer[BUFFER_SIZE] = {0};
+    ASSERT_EQ(write(got.socket, "moved", 5), 5);
+    EXPECT_EQ(recv(client[1], buffer, sizeof(buffer) - 1, 0), 5);
+    ASSERT_EQ(write(received.listeners[0], "too", 3), 3);
+    EXPECT_EQ(recv(listener[1], buffer, sizeof(buffer) - 1, 0), 3);
+
+    // A new server without a group store gets the groups from the handoff
+    reset_state();
+    handoff_restore_groups(received);
+    EXPECT_TRUE(is_member("g1", "user1"));
+    EXPECT_TRUE(is_member("g1", "user2"));
+    std::vector<Payload> history = directory.load()->group_history.get(group_ids.find("g1"))->recent(0);
+    ASSERT_EQ(history.size(), 1u);
+    EXPECT_EQ(std::string(history[0].data(), history[0].size()), "[g1] @user2 : hi\n");
+
+    got.session.socket = got.socket;
+    EXPECT_TRUE(session_restore(got.session));
+    EXPECT_EQ(directory.load()->socket_of(user_ids.find("user1")), got.socket);
+    Session again = got.session;
+    again.socket = client[1];
+    EXPECT_FALSE(session_restore(again));
+
+    reset_state();
+    for (int fd : {client[0], client[1], listener[0], listener[1], got.socket, received.listeners[0]}) close(fd);
+}
+
+TEST(ServerGrpTest, MetricsHistogramAndStatsCommand) {
+    for (uint64_t value : {0ull, 7ull, 8ull, 9ull, 1000ull, 123456789ull, ~0ull}) {
+        uint64_t bound = Histogram::bucket_max(Histogram::bucket(value));
+        EXPECT_GE(bound, value);
+        EXPECT_LE(bound - value, value / 8);
+    }
+    Histogram histogram;
+    for (uint64_t value = 1; value <= 1000; value++) histogram.record(value);
+    HistogramSnapshot snapshot;
+    snapshot.add(histogram);
+    EXPECT_EQ(snapshot.count, 1000u);
+    EXPECT_EQ(snapshot.sum, 500500u);
+    EXPECT_NEAR((double)snapshot.quantile(0.5), 500, 500 / 8.0);
+    EXPECT_NEAR((double)snapshot.quantile(0.99), 990, 990 / 8.0);
+    EXPECT_EQ(snapshot.quantile(1), 1000u);
+
+    int pair[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, pair), 0);
+    Session session;
+    session.socket = pair[0];
+    session.state = SessionState::COMMAND;
+    session.username = "user1";
+    std::string stats = "/stats";
+    EXPECT_TRUE(session_input(session, stats.data(), stats.size()));
+    char buffer[16384] = {0};
+    recv(pair[1], buffer, sizeof(buffer) - 1, 0);
+    EXPECT_EQ(std::string(buffer), "Error: /stats is for administrators only.\n");
+
+    config.admins.insert("user1");
+    EXPECT_TRUE(session_input(session, stats.data(), stats.size()));
+    ssize_t len = recv(pair[1], buffer, sizeof(buffer) - 1, 0);
+    std::string report(buffer, len > 0 ? len : 0);
+    EXPECT_THAT(report, HasSubstr("server_command_ns{command=\"/stats\",quantile=\"0.5\"}"));
+    EXPECT_THAT(report, HasSubstr("server_fanout_recipients_count "));
+    EXPECT_THAT(report, HasSubstr("server_clients_mutex_hold_ns{quantile=\"1\"}"));
+    config.admins.clear();
+    close(pair[0]);
+    close(pair[1]);
+
+    // What threads recorded stays in the report after they exit and their slot is reused
+    auto recorded = [] {
+        std::string report = metrics_report();
+        std::string key = "server_command_ns_count{command=\"unknown\"} ";
+        size_t at = report.find(key);
+        return at == std::string::npos ? 0ull : std::stoull(report.substr(at + key.size()));
+    };
+    unsigned long long before = recorded();
+    for (int n : {3, 2}) {
+        std::thread([n] {
+            for (int i = 0; i < n; i++) metrics_command((unsigned)Command::UNKNOWN, 1000);
+        }).join();
+    }
+    EXPECT_EQ(recorded(), before + 5);
+}
+
+TEST(ServerGrpTest, InternerStopsWhenFull) {
+    Interner names(3);
+    EXPECT_EQ(names.intern("g1"), 0u);
+    EXPECT_EQ(names.intern("g2"), 1u);
+    EXPECT_EQ(names.intern("g3"), 2u);
+    // Known names keep their ids, new ones get none
+    EXPECT_EQ(names.intern("g4"), NO_ID);
+    EXPECT_EQ(names.intern("g2"), 1u);
+    EXPECT_EQ(names.find("g4"), NO_ID);
+    EXPECT_EQ(names.size(), 3u);
+    EXPECT_EQ(names.name(2), "g3");
+    names.clear();
+    EXPECT_EQ(names.intern("g4"), 0u);
+    EXPECT_EQ(Interner(Interner::MAX_NAMES + 1).intern("x"), 0u);  // Capped at MAX_NAMES
+}
+
+TEST(ServerGrpTest, IdSetSwitchesRepresentation) {
+    IdSet set;
+    for (uint32_t id = 2000; id-- > 0;) EXPECT_TRUE(set.insert(id));
+    EXPECT_FALSE(set.insert(7));
+    EXPECT_TRUE(set.is_bitmap());
+    EXPECT_EQ(set.size(), 2000u);
+
+    for (uint32_t id = 0; id < 2000; id += 2) EXPECT_TRUE(set.erase(id));
+    EXPECT_FALSE(set.erase(0));
+    EXPECT_FALSE(set.contains(4));
+    EXPECT_TRUE(set.contains(5));
+
+    while (set.size() >= IdSet::BITMAP_MIN / 2) set.erase(set.size() * 2 - 1);
+    EXPECT_FALSE(set.is_bitmap());
+    uint32_t previous = 0, visited = 0;
+    set.for_each([&](uint32_t id) {
+        EXPECT_TRUE(visited == 0 || id > previous);
+        EXPECT_EQ(id % 2, 1u);
+        previous = id;
+        visited++;
+    });
+    EXPECT_EQ(visited, set.size());
+}
+
+TEST(ServerGrpTest, SnapshotReadersDuringWrites) {
+    uint32_t group_id = group_ids.intern("busy");
+    for (int i = 0; i < 100; i++) {
+        uint32_t user_id = user_ids.intern("member" + std::to_string(i));
+        update_directory([&](Directory& dir) { dir.join(group_id, user_id); });
+    }
+
+    std::atomic<bool> done(false);
+    std::atomic<int> bad(0);
+    std::vector<std::thread> readers;
+    for (int r = 0; r < 2; r++) {
+        readers.emplace_back([&]() {
+            while (!done) {
+                RcuReadGuard guard;
+                const IdSet& members = directory.load()->members(group_id);
+                size_t seen = 0;
+                members.for_each([&](uint32_t user_id) {
+                    if (user_ids.name(user_id).rfind("member", 0) != 0) bad++;
+                    seen++;
+                });
+                if (seen != members.size() || seen < 100 || seen > 101) bad++;
+            }
+        });
+    }
+
+    // Churn one extra member and intern new names while the readers walk the group
+    for (int i = 0; i < 2000; i++) {
+        std::lock_guard<TimedMutex> lock(clients_mutex);
+        uint32_t user_id = user_ids.intern("member_extra" + std::to_string(i));
+        update_directory([&](Directory& dir) { dir.join(group_id, user_id); });
+        update_directory([&](Directory& dir) { dir.leave(group_id, user_id); });
+    }
+    done = true;
+    for (auto& reader : readers) reader.join();
+
+    EXPECT_EQ(bad, 0);
+    EXPECT_EQ(directory.load()->members(group_id).size(), 100u);
+    EXPECT_EQ(user_ids.find("member_extra1999"), 2099u);
+    EXPECT_EQ(rcu_reclaim(), 0u);
+    reset_state();
+}
+
+// Keeps what the server sends in place of a socket
+struct RecordingSockets : SocketLayer {
+    OutputDigest output;
+    std::string text;
+    void send(const int*, size_t count, const iovec* parts, size_t n) override {
+        size_t bytes = 0;
+        for (size_t i = 0; i < n; i++) {
+            text.append((const char*)parts[i].iov_base, parts[i].iov_len);
+            bytes += parts[i].iov_len;
+        }
+        if (capture_in_timer()) return;
+        uint64_t hash = OutputDigest::hash_of(parts, n);
+        for (size_t i = 0; i < count; i++) output.add(hash, bytes);
+    }
+};
+
+TEST(ServerGrpTest, CaptureRecordsSessionWithoutPassword) {
+    const std::string path = "capture_test.trace";
+    RecordingSockets sockets;
+    socket_layer = &sockets;
+    user_credentials["capture_user"] = "capture_secret";
+    // State the server had before, which the capture starts with
+    Handoff state;
+    state.groups.push_back({"capture_group", {"capture_member"}, {"[capture_member]: earlier"}});
+    handoff_restore_groups(state);
+    store_offline({"capture_member"}, "kept while offline");
+    std::string error;
+    ASSERT_TRUE(capture_open(path, error)) << error;
+
+    Session session;
+    session.socket = 900;  // Never reaches the kernel
+    session_open(session);
+    std::string input = PROTO_HELLO "capture_user\ncapture_secret\n/list_groups\n";
+    EXPECT_TRUE(session_receive(session, input.data(), input.size()));
+    EXPECT_EQ(session.state, SessionState::COMMAND);
+    // A heartbeat is sent on a timer, which a replay does not reproduce
+    std::chrono::steady_clock::time_point next;
+    EXPECT_TRUE(session_check_timeouts(session, session.last_input + std::chrono::seconds(config.heartbeat_s), next));
+    EXPECT_NE(sockets.text.find("/ping\n"), std::string::npos);
+    session_close(session);
+    capture_close();
+    socket_layer = nullptr;
+
+    std::ifstream file(path, std::ios::binary);
+    std::string data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    EXPECT_EQ(data.find("capture_secret"), std::string::npos);
+    std::vector<uint8_t> types;
+    std::vector<std::string> inputs, restored;
+    uint8_t outcome = 0xff;
+    OutputDigest captured;
+    EXPECT_EQ(scan_records(data, [&](std::string_view body) {
+        RecordReader reader{body};
+        uint8_t type;
+        uint32_t connection, delta_us;
+        EXPECT_TRUE(reader.get(type) && reader.get(connection) && reader.get(delta_us));
+        bool global = type == CAPTURE_HEADER || type == CAPTURE_GROUP || type == CAPTURE_BACKLOG;
+        EXPECT_EQ(connection, global ? 0u : 1u);
+        types.push_back(type);
+        std::string_view message;
+        if ((type == CAPTURE_GROUP || type == CAPTURE_BACKLOG) && reader.get(message)) restored.emplace_back(message);
+        if (type == CAPTURE_INPUT && reader.get(message)) inputs.emplace_back(message);
+        if (type == CAPTURE_LOGIN) reader.get(outcome);
+        if (type == CAPTURE_CLOSE) reader.get(captured.messages) && reader.get(captured.bytes) && reader.get(captured.hash);
+        return true;
+    }), data.size());
+    EXPECT_THAT(types, ElementsAre(CAPTURE_HEADER, CAPTURE_GROUP, CAPTURE_BACKLOG, CAPTURE_OPEN, CAPTURE_FRAMED, CAPTURE_INPUT, CAPTURE_LOGIN, CAPTURE_INPUT, CAPTURE_CLOSE));
+    EXPECT_THAT(inputs, ElementsAre("capture_user", "/list_groups"));
+    EXPECT_THAT(restored, ElementsAre("capture_group", "capture_member"));
+    EXPECT_EQ(outcome, LOGIN_OK);
+    // Prompts, welcome and group list, without the heartbeat
+    EXPECT_EQ(captured.messages, 4u);
+    EXPECT_EQ(captured, sockets.output);
+
+    take_backlog("capture_member");
+    user_credentials.erase("capture_user");
+    std::remove(path.c_str());
+    reset_state();
+}
+
+// Keeps what the server sends per socket, and can log a session in from inside a send
+struct LoginDuringSend : SocketLayer {
+    std::mutex mutex;
+    std::map<int, std::string> text;
+    Session* login = nullptr;  // Logged in by the next send, with `input`
+    std::string input;
+    void send(const int* sockets, size_t count, const iovec* parts, size_t n) override {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (size_t i = 0; i < count; i++) {
+                for (size_t j = 0; j < n; j++) text[sockets[i]].append((const char*)parts[j].iov_base, parts[j].iov_len);
+            }
+        }
+        Session* session = std::exchange(login, nullptr);
+        if (session != nullptr) session_receive(*session, input.data(), input.size());
+    }
+    std::string of(int socket) {
+        std::lock_guard<std::mutex> lock(mutex);
+        return text[socket];
+    }
+};
+
+TEST(ServerGrpTest, OfflineMessageRacesLogin) {
+    reset_state();
+    LoginDuringSend sockets;
+    socket_layer = &sockets;
+    user_credentials["late_user"] = "late_secret";
+    sockets.input = PROTO_HELLO "late_user\nlate_secret\n";
+    add_user_to_group("g1", username[0]);
+    add_user_to_group("g1", username[1]);
+    add_user_to_group("g1", "late_user");
+    update_directory([&](Directory& dir) {
+        dir.attach(901, user_ids.find(username[0]));
+        dir.attach(902, user_ids.find(username[1]));
+    });
+
+    // late_user logs in while the group message is sent to user2: after the sender saw them
+    // offline, before the message is kept for them
+    Session late;
+    late.socket = 903;
+    session_open(late);
+    sockets.login = &late;
+    group_message("g1", "while logging in", 901);
+    EXPECT_EQ(late.state, SessionState::COMMAND);
+    EXPECT_THAT(sockets.of(903), HasSubstr("[g1] @user1 : while logging in"));
+    EXPECT_EQ(take_backlog("late_user"), "");
+    session_close(late);
+
+    // A private message racing the login reaches late_user exactly once, by the backlog or directly
+    for (int i = 0; i < 200; i++) {
+        Session session;
+        session.socket = 904 + i;
+        session_open(session);
+        std::string message = "(private) @user1 : race " + std::to_string(i) + "\n";
+        std::thread login([&] { session_receive(session, sockets.input.data(), sockets.input.size()); });
+        private_message("late_user", message, 901);
+        login.join();
+        std::string received = sockets.of(session.socket);
+        size_t at = received.find(message);
+        EXPECT_NE(at, std::string::npos) << i;
+        EXPECT_EQ(received.find(message, at + 1), std::string::npos) << i;
+        EXPECT_EQ(take_backlog("late_user"), "") << i;
+        session_close(session);
+    }
+
+    socket_layer = nullptr;
+    user_credentials.erase("late_user");
+    reset_state();
+}
+
+// Read from a client socket until `needle` arrived or a read timed out, returns what was read
+static std::string read_until(int socket, const std::string& needle) {
+    timeval timeout{2, 0};
+    setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    std::string received;
+    char buffer[BUFFER_SIZE];
+    while (received.find(needle) == std::string::npos) {
+        ssize_t n = recv(socket, buffer, sizeof(buffer), 0);
+        if (n <= 0) break;
+        received.append(buffer, n);
+    }
+    return received;
+}
+
+// Log two clients in over TCP through the event loops of `mode` and pass a broadcast between them
+static void event_loop_round_trip(IoMode mode) {
+    reset_state();
+    config.io_mode = mode;
+    config.workers = 1;
+    user_credentials["user1"] = "password1";
+    user_credentials["user2"] = "password2";
+    int port = generate_random_port();
+    int server = create_server_socket(port);
+    ASSERT_GE(server, 0);
+    running = true;
+    std::thread loop([server] {
+        run_epoll_server(server);
+        reactor_shutdown();
+        close(server);
+    });
+
+    int clients[2];
+    for (int i = 0; i < 2; i++) {
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+        clients[i] = socket(AF_INET, SOCK_STREAM, 0);
+        EXPECT_EQ(connect(clients[i], (sockaddr*)&addr, sizeof(addr)), 0);
+        std::string user = "user" + std::to_string(i + 1);
+        std::string login = PROTO_HELLO + user + "\npassword" + std::to_string(i + 1) + "\n";
+        EXPECT_EQ(send(clients[i], login.data(), login.size(), 0), (ssize_t)login.size());
+        std::string welcome = "Welcome to the server, " + user + "!\n";
+        EXPECT_THAT(read_until(clients[i], welcome), HasSubstr("Enter username: Enter password: " + welcome));
+    }
+    std::string broadcast = "/broadcast over the loop\n";
+    EXPECT_EQ(send(clients[0], broadcast.data(), broadcast.size(), 0), (ssize_t)broadcast.size());
+    EXPECT_THAT(read_until(clients[1], "over the loop"), HasSubstr("(broadcast) @user1 : over the loop"));
+
+    for (int client : clients) close(client);
+    running = false;
+    loop.join();
+    config.workers = ServerConfig().workers;
+    reset_state();
+}
+
+TEST(ServerGrpTest, EpollSessionRoundTrip) {
+    event_loop_round_trip(IoMode::EPOLL);
+    config.io_mode = ServerConfig().io_mode;
+}
+
+TEST(ServerGrpTest, UringSessionRoundTrip) {
+    event_loop_round_trip(IoMode::URING);
+    bool fell_back = config.io_mode != IoMode::URING;
+    config.io_mode = ServerConfig().io_mode;
+    if (fell_back) GTEST_SKIP() << "io_uring is not available, the round trip ran on epoll";
+}
+
 int main(int argc, char** argv) {
     ::testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();
@@ -17,6 +17,9 @@
 #include <thread>
 #include <unordered_map>
 #include <unordered_set>
+#include <vector>
+
+#include "../server_grp.h"
 
 using namespace testing;
 
@@ -28,16 +31,17 @@ extern struct sockaddr_in server_addr, client_addr[2];
 extern socklen_t addr_len;
 extern int port;
 
-extern std::unordered_map<std::string, std::unordered_set<int>> groups;
-extern std::unordered_map<std::string, std::unordered_set<std::string>> users;
-extern std::unordered_map<int, std::string> clients;
+extern Interner user_ids, group_ids;
+extern std::atomic<const Directory*> directory;
 
 void init();
 int generate_random_port();
 void setup_server_socket(int& server_socket, int port, struct sockaddr_in& server_addr);
 void setup_client_socket(int& client_socket, int port, struct sockaddr_in& server_addr, const std::string& username);
 inline void accept_and_handle(int server_socket, struct sockaddr_in* client_addr, std::function<void(int)> handler);
-void add_user_to_group(const std::string& group_name, int client_socket, const std::string& username);
+void add_user_to_group(const std::string& group_name, const std::string& username);
+bool is_member(const std::string& group_name, const std::string& username);
+void reset_state();
 void cleanup();
 
 #endif // SERVER_GRP_TEST_H
\ No newline at end of file
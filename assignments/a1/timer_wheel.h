@@ -0,0 +1,136 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+
+// Intrusive timer, linked into one slot of a TimerWheel while armed
+struct TimerNode {
+    TimerNode *prev = nullptr;
+    TimerNode *next = nullptr;
+    uint64_t expires = 0;  // Tick at which the timer fires
+
+    bool armed() const { return next != nullptr; }
+};
+
+// Hierarchical timer wheel: 4 levels of 64 slots, level L covering 64^(L+1) ticks. A timer goes
+// into the slot of the coarsest level its delay needs and moves down a level each time that slot
+// comes round (a cascade), so scheduling and cancelling are O(1) list operations and a tick only
+// touches the timers that are due or cascade. Not thread-safe: each event loop owns its wheel.
+class TimerWheel {
+   public:
+    static constexpr int LEVELS = 4;
+    static constexpr int SLOT_BITS = 6;
+    static constexpr uint64_t SLOTS = 1 << SLOT_BITS;
+    static constexpr uint64_t MAX_DELAY = (1ull << (SLOT_BITS * LEVELS)) - 1;  // Longer delays are cascaded again
+
+    TimerWheel() {
+        for (auto &level : slots_) {
+            for (TimerNode &slot : level) slot.prev = slot.next = &slot;
+        }
+    }
+    TimerWheel(const TimerWheel &) = delete;
+    TimerWheel &operator=(const TimerWheel &) = delete;
+
+    // Arm (or re-arm) a timer for the given tick, at the earliest the next one
+    void schedule(TimerNode *node, uint64_t expires) {
+        cancel(node);
+        node->expires = expires > now_ ? expires : now_ + 1;
+        place(node);
+        size_++;
+    }
+
+    void cancel(TimerNode *node) {
+        if (!node->armed()) return;
+        node->prev->next = node->next;
+        node->next->prev = node->prev;
+        node->prev = node->next = nullptr;
+        size_--;
+    }
+
+    // Move to tick `now`, calling fire(TimerNode *) for every timer that expired on the way.
+    // The timer is disarmed before the call, which may schedule it again. Returns the timers fired.
+    template <typename F>
+    size_t advance(uint64_t now, F &&fire) {
+        size_t fired = 0;
+        while (now_ < now) {
+            if (size_ == 0) {
+                now_ = now;
+                break;
+            }
+            now_++;
+            for (int level = 1; level < LEVELS && (now_ & ((1ull << (SLOT_BITS * level)) - 1)) == 0; level++) {
+                TimerNode due;
+                take(&slots_[level][(now_ >> (SLOT_BITS * level)) % SLOTS], &due);
+                while (due.next != &due) {
+                    TimerNode *node = due.next;
+                    unlink(node);
+                    place(node);
+                }
+            }
+            TimerNode due;
+            take(&slots_[0][now_ % SLOTS], &due);
+            while (due.next != &due) {
+                TimerNode *node = due.next;
+                unlink(node);
+                node->prev = node->next = nullptr;
+                size_--;
+                fired++;
+                fire(node);
+            }
+        }
+        return fired;
+    }
+
+    // Earliest tick at which advance() may fire a timer (or cascade one that could be due soon),
+    // UINT64_MAX if nothing is armed. Looks at the 64 slots of the first level at most.
+    uint64_t next_tick() const {
+        if (size_ == 0) return UINT64_MAX;
+        for (uint64_t tick = now_ + 1;; tick++) {
+            if (tick % SLOTS == 0) return tick;
+            const TimerNode &slot = slots_[0][tick % SLOTS];
+            if (slot.next != &slot) return tick;
+        }
+    }
+
+    uint64_t now() const { return now_; }
+    size_t size() const { return size_; }
+
+   private:
+    void place(TimerNode *node) {
+        uint64_t delay = node->expires - now_;
+        uint64_t at = delay > MAX_DELAY ? now_ + MAX_DELAY : node->expires;
+        int level = 0;
+        while (level < LEVELS - 1 && (std::min(delay, MAX_DELAY) >> (SLOT_BITS * (level + 1))) != 0) level++;
+        TimerNode *slot = &slots_[level][(at >> (SLOT_BITS * level)) % SLOTS];
+        node->prev = slot->prev;
+        node->next = slot;
+        slot->prev->next = node;
+        slot->prev = node;
+    }
+
+    static void unlink(TimerNode *node) {
+        node->prev->next = node->next;
+        node->next->prev = node->prev;
+    }
+
+    // Move the whole list of a slot onto the empty sentinel `to`
+    static void take(TimerNode *slot, TimerNode *to) {
+        if (slot->next == slot) {
+            to->prev = to->next = to;
+            return;
+        }
+        to->next = slot->next;
+        to->prev = slot->prev;
+        to->next->prev = to;
+        to->prev->next = to;
+        slot->prev = slot->next = slot;
+    }
+
+    TimerNode slots_[LEVELS][SLOTS];  // Sentinels of circular lists
+    uint64_t now_ = 0;
+    size_t size_ = 0;
+};
+
+#endif // TIMER_WHEEL_H
@@ -0,0 +1,348 @@
+#include "upgrade.h"
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstring>
+#include <iostream>
+#include <thread>
+
+#include "payload.h"
+#include "record.h"
+
+enum HandoffRecord : uint8_t { HANDOFF_HEADER = 1, HANDOFF_CONNECTION = 2, HANDOFF_GROUP = 3 };
+
+// The control thread stays blocked in accept() until a successor connects, so its state is never destroyed
+struct UpgradeControl {
+    int listen_fd = -1;
+    std::string path;
+    std::atomic<int> request{-1};  // Connection of the successor
+};
+
+static UpgradeControl &control = *new UpgradeControl;
+
+static bool unix_address(const std::string &path, sockaddr_un &addr, std::string &error) {
+    if (path.size() >= sizeof(addr.sun_path)) {
+        error = "socket path " + path + " is too long";
+        return false;
+    }
+    addr = sockaddr_un{};
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    return true;
+}
+
+// Wait for a successor of the same user, then stop the event loops so that main() hands over
+static void await_successor() {
+    while (true) {
+        int fd = accept4(control.listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            return;  // Closed by upgrade_close()
+        }
+        ucred peer{};
+        socklen_t len = sizeof(peer);
+        if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &len) < 0 || peer.uid != geteuid()) {
+            close(fd);
+            continue;
+        }
+        std::cout << "Takeover requested by process " << peer.pid << ", handing over." << std::endl;
+        // The successor binds the same path once it has taken over
+        unlink(control.path.c_str());
+        control.path.clear();
+        control.request = fd;
+        running = false;
+        return;
+    }
+}
+
+bool upgrade_listen(const std::string &path, std::string &error) {
+    sockaddr_un addr;
+    if (!unix_address(path, addr, error)) return false;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    unlink(path.c_str());
+    // Only the owner may connect: whoever does is given every client connection
+    mode_t mask = umask(0077);
+    bool bound = fd >= 0 && bind(fd, (sockaddr *)&addr, sizeof(addr)) == 0;
+    umask(mask);
+    if (!bound || listen(fd, 1) < 0) {
+        error = "cannot listen on " + path + ": " + strerror(errno);
+        if (fd >= 0) close(fd);
+        return false;
+    }
+    control.listen_fd = fd;
+    control.path = path;
+    std::thread(await_successor).detach();
+    return true;
+}
+
+int upgrade_request() {
+    return control.request.load();
+}
+
+void upgrade_close() {
+    if (control.listen_fd < 0) return;
+    shutdown(control.listen_fd, SHUT_RDWR);  // Wakes the control thread
+    close(control.listen_fd);
+    control.listen_fd = -1;
+    if (!control.path.empty()) unlink(control.path.c_str());
+}
+
+void handoff_save_groups(Handoff &handoff) {
+    RcuReadGuard guard;
+    const Directory &dir = *directory.load();
+    dir.group_members.for_each([&](size_t group_id, const std::shared_ptr<const IdSet> &members) {
+        HandoffGroup group{group_ids.name(group_id), {}, {}};
+        members->for_each([&](uint32_t user_id) { group.members.push_back(user_ids.name(user_id)); });
+        if (std::shared_ptr<GroupHistory> history = dir.group_history.get(group_id)) {
+            for (const Payload &message : history->recent(0)) group.messages.emplace_back(message.data(), message.size());
+        }
+        handoff.groups.push_back(std::move(group));
+    });
+}
+
+void handoff_restore_groups(const Handoff &handoff) {
+    std::lock_guard<TimedMutex> lock(clients_mutex);
+    update_directory([&](Directory &dir) {
+        for (const HandoffGroup &group : handoff.groups) {
+            uint32_t group_id = group_ids.find(group.name);
+            if (!dir.has_group(group_id)) {
+                group_id = group_ids.intern(group.name);
+                if (group_id == NO_ID) {
+                    std::cerr << "Warning: No room for group " << group.name << " of the previous server." << std::endl;
+                    continue;
+                }
+                dir.group_members.set(group_id, std::make_shared<const IdSet>());
+                dir.group_history.set(group_id, std::make_shared<GroupHistory>());
+                for (const std::string &member : group.members) {
+                    uint32_t user_id = user_ids.intern(member);
+                    if (user_id != NO_ID) dir.join(group_id, user_id);
+                }
+            }
+            std::shared_ptr<GroupHistory> history = dir.group_history.get(group_id);
+            for (const std::string &message : group.messages) history->append(Payload(message));
+        }
+    });
+}
+
+// A count followed by that many strings
+static bool get_strings(RecordReader &reader, std::vector<std::string> &out) {
+    uint32_t count;
+    if (!reader.get(count)) return false;
+    for (uint32_t i = 0; i < count; i++) {
+        std::string_view value;
+        if (!reader.get(value)) return false;
+        out.emplace_back(value);
+    }
+    return true;
+}
+
+static std::string connection_record(const HandoffConnection &conn, std::chrono::steady_clock::time_point now) {
+    const Session &session = conn.session;
+    std::string body(1, (char)HANDOFF_CONNECTION);
+    put_string(body, session.username);
+    body.push_back((char)session.framed);
+    put_string(body, session.inbuf);
+    put_u32(body, session.deferred.size());
+    for (const std::string &message : session.deferred) put_string(body, message);
+    put_u32(body, (uint32_t)(int32_t)std::clamp<double>(session.tokens, INT32_MIN, INT32_MAX));
+    auto idle = std::chrono::duration_cast<std::chrono::milliseconds>(now - session.last_input).count();
+    put_u32(body, (uint32_t)std::clamp<long long>(idle, 0, UINT32_MAX));
+    body.push_back((char)session.pinged);
+    put_string(body, conn.output);
+    return frame_record(body);
+}
+
+static bool parse_connection(RecordReader &reader, HandoffConnection &conn, std::chrono::steady_clock::time_point now) {
+    Session &session = conn.session;
+    std::string_view username, inbuf, output;
+    uint8_t framed, pinged;
+    uint32_t tokens, idle_ms;
+    if (!reader.get(username) || !reader.get(framed) || !reader.get(inbuf) || !get_strings(reader, session.deferred) ||
+        !reader.get(tokens) || !reader.get(idle_ms) || !reader.get(pinged) || !reader.get(output)) return false;
+
+    session.state = SessionState::COMMAND;
+    session.username = username;
+    session.framed = framed;
+    session.inbuf = inbuf;
+    session.opened = session.refilled = now;
+    session.last_input = now - std::chrono::milliseconds(idle_ms);
+    session.pinged = pinged;
+    session.tokens = (int32_t)tokens;
+    if (session.tokens < 0 && config.rate_limit > 0) {
+        // Still paying off a throttle
+        session.throttled = true;
+        session.throttled_until = now + std::chrono::duration_cast<std::chrono::microseconds>(
+                                            std::chrono::duration<double>(-session.tokens / config.rate_limit));
+    }
+    conn.output = output;
+    return true;
+}
+
+static bool send_fds(int fd, const int *fds, size_t count) {
+    char byte = 'F';
+    iovec iov{&byte, 1};
+    union {
+        char buf[CMSG_SPACE(HANDOFF_MAX_FDS * sizeof(int))];
+        cmsghdr align;
+    } control_data{};
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control_data.buf;
+    msg.msg_controllen = CMSG_SPACE(count * sizeof(int));
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, count * sizeof(int));
+    ssize_t sent;
+    while ((sent = sendmsg(fd, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR) {
+    }
+    return sent == 1;
+}
+
+// Receive one batch of descriptors, appending them to fds
+static bool receive_fds(int fd, std::vector<int> &fds) {
+    char byte;
+    iovec iov{&byte, 1};
+    union {
+        char buf[CMSG_SPACE(HANDOFF_MAX_FDS * sizeof(int))];
+        cmsghdr align;
+    } control_data{};
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control_data.buf;
+    msg.msg_controllen = sizeof(control_data.buf);
+    ssize_t received;
+    while ((received = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR) {
+    }
+    if (received != 1) return false;
+    for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+        size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        size_t first = fds.size();
+        fds.resize(first + count);
+        memcpy(fds.data() + first, CMSG_DATA(cmsg), count * sizeof(int));
+    }
+    return !(msg.msg_flags & MSG_CTRUNC);
+}
+
+static bool read_all(int fd, char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = read(fd, data, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool upgrade_send(int fd, const Handoff &handoff, std::string &error) {
+    auto now = std::chrono::steady_clock::now();
+    std::string header(1, (char)HANDOFF_HEADER);
+    put_u32(header, HANDOFF_VERSION);
+    put_u32(header, handoff.listeners.size());
+    put_u32(header, handoff.connections.size());
+    std::string records = frame_record(header);
+    std::vector<int> fds = handoff.listeners;
+    for (const HandoffConnection &conn : handoff.connections) {
+        records += connection_record(conn, now);
+        fds.push_back(conn.socket);
+    }
+    for (const HandoffGroup &group : handoff.groups) {
+        std::string body(1, (char)HANDOFF_GROUP);
+        put_string(body, group.name);
+        put_u32(body, group.members.size());
+        for (const std::string &member : group.members) put_string(body, member);
+        put_u32(body, group.messages.size());
+        for (const std::string &message : group.messages) put_string(body, message);
+        records += frame_record(body);
+    }
+
+    std::string lengths;
+    put_u32(lengths, records.size());
+    put_u32(lengths, fds.size());
+    if (!write_all(fd, lengths) || !write_all(fd, records)) {
+        error = std::string("cannot send the sessions: ") + strerror(errno);
+        return false;
+    }
+    for (size_t first = 0; first < fds.size(); first += HANDOFF_MAX_FDS) {
+        if (!send_fds(fd, fds.data() + first, std::min<size_t>(HANDOFF_MAX_FDS, fds.size() - first))) {
+            error = std::string("cannot send the sockets: ") + strerror(errno);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool upgrade_receive(const std::string &path, Handoff &handoff, std::string &error) {
+    sockaddr_un addr;
+    if (!unix_address(path, addr, error)) return false;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (sockaddr *)&addr, sizeof(addr)) < 0) {
+        error = "cannot connect to " + path + ": " + strerror(errno);
+        if (fd >= 0) close(fd);
+        return false;
+    }
+
+    uint32_t lengths[2];
+    std::string records;
+    std::vector<int> fds;
+    bool ok = read_all(fd, (char *)lengths, sizeof(lengths));
+    if (ok) {
+        records.resize(lengths[0]);
+        ok = read_all(fd, records.data(), records.size());
+    }
+    while (ok && fds.size() < lengths[1]) {
+        ok = receive_fds(fd, fds);
+    }
+    close(fd);
+    if (!ok) {
+        for (int socket : fds) close(socket);
+        error = "the running server did not hand over";
+        return false;
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    uint32_t version = 0, listeners = 0, connections = 0;
+    size_t parsed = scan_records(records, [&](std::string_view body) {
+        RecordReader reader{body};
+        uint8_t type;
+        if (!reader.get(type)) return false;
+        switch (type) {
+        case HANDOFF_HEADER:
+            return reader.get(version) && version == HANDOFF_VERSION && reader.get(listeners) && reader.get(connections);
+        case HANDOFF_CONNECTION:
+            handoff.connections.emplace_back();
+            return parse_connection(reader, handoff.connections.back(), now);
+        case HANDOFF_GROUP: {
+            HandoffGroup &group = handoff.groups.emplace_back();
+            std::string_view name;
+            if (!reader.get(name)) return false;
+            group.name = name;
+            return get_strings(reader, group.members) && get_strings(reader, group.messages);
+        }
+        }
+        return false;
+    });
+    if (parsed != records.size() || version != HANDOFF_VERSION || handoff.connections.size() != connections ||
+        fds.size() != (size_t)listeners + connections) {
+        for (int socket : fds) close(socket);
+        handoff = Handoff();
+        error = "the handoff is corrupt or from an incompatible version";
+        return false;
+    }
+    handoff.listeners.assign(fds.begin(), fds.begin() + listeners);
+    for (uint32_t i = 0; i < connections; i++) handoff.connections[i].socket = fds[listeners + i];
+    return true;
+}
@@ -0,0 +1,71 @@
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+#include <string>
+#include <vector>
+
+#include "server_grp.h"
+
+// Hot restart. A server started with --upgrade-socket PATH listens on that Unix socket; a new
+// server started with --takeover PATH connects to it. The old server stops its event loops,
+// closes its stores and sends the new one, over the Unix socket:
+//
+//   uint32_t length, uint32_t descriptor count, then `length` bytes of records (record.h framing):
+//       HANDOFF_HEADER      uint32_t version, uint32_t listeners, uint32_t connections
+//       HANDOFF_CONNECTION  username, uint8_t framed, inbuf, uint32_t n, n deferred messages,
+//                           uint32_t tokens (signed), uint32_t idle ms, uint8_t pinged, queued output
+//       HANDOFF_GROUP       group, uint32_t n, n member usernames, uint32_t m, m recent messages
+//   then the descriptors with SCM_RIGHTS: the listening sockets, then one per connection, in order
+//
+// The new server takes over the listening sockets, so no connection attempt is refused, and
+// serves the logged in clients from where the old one stopped: the bytes it had read but not run
+// yet and the output it had not written yet travel with the session, and whatever is still in the
+// kernel's socket buffers is read by the new server. Clients that had not logged in are asked to
+// reconnect. Groups the new server did not load from --state-dir are created from the handoff.
+
+#define HANDOFF_VERSION 1
+#define HANDOFF_MAX_FDS 250  // Descriptors per SCM_RIGHTS message (the kernel takes up to 253)
+
+// A logged in connection of the old server
+struct HandoffConnection {
+    int socket = -1;
+    Session session;     // socket is not valid in the new process, use HandoffConnection::socket
+    std::string output;  // Queued output that was not written yet
+};
+
+struct HandoffGroup {
+    std::string name;
+    std::vector<std::string> members;
+    std::vector<std::string> messages;  // Recent messages, oldest first
+};
+
+struct Handoff {
+    std::vector<int> listeners;  // Listening socket of every event loop, the first one is main()'s
+    std::vector<HandoffConnection> connections;
+    std::vector<HandoffGroup> groups;
+};
+
+// Old server: listen on the Unix socket for a takeover (event loop modes only). A successor that
+// connects makes the event loops stop; upgrade_request() then returns its connection.
+bool upgrade_listen(const std::string &path, std::string &error);
+
+// The connection of the successor, -1 if none asked for a takeover
+int upgrade_request();
+
+// Stop listening for a takeover and remove the Unix socket
+void upgrade_close();
+
+// Old server: copy every group, its members and its recent messages into the handoff
+void handoff_save_groups(Handoff &handoff);
+
+// Old server: send the handoff and its descriptors to the successor
+bool upgrade_send(int fd, const Handoff &handoff, std::string &error);
+
+// New server: connect to the running server's Unix socket and receive its handoff
+bool upgrade_receive(const std::string &path, Handoff &handoff, std::string &error);
+
+// New server: once the group store is loaded, create the groups it did not have and put the
+// recent messages back
+void handoff_restore_groups(const Handoff &handoff);
+
+#endif // UPGRADE_H
@@ -0,0 +1,159 @@
+#include "uring.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <vector>
+
+static int io_uring_setup(unsigned entries, io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+Uring::~Uring() {
+    if (buf_ring_ != nullptr) munmap(buf_ring_, buf_ring_size_);
+    if (buffers_ != nullptr) munmap(buffers_, (size_t)buffer_count_ * buffer_size_);
+    if (sqes_ != nullptr) munmap(sqes_, sqes_size_);
+    if (cq_ring_ != nullptr && cq_ring_ != sq_ring_) munmap(cq_ring_, cq_ring_size_);
+    if (sq_ring_ != nullptr) munmap(sq_ring_, sq_ring_size_);
+    if (fd_ >= 0) close(fd_);
+}
+
+bool Uring::init(unsigned entries) {
+    io_uring_params params{};
+    // Multishot accept and recv post many completions per submission, so give the CQ headroom
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+    params.cq_entries = entries * 8;
+    fd_ = io_uring_setup(entries, &params);
+    if (fd_ < 0) return false;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG) ||
+        !(params.features & IORING_FEAT_NODROP)) {
+        return false;
+    }
+
+    sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+    sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+    if (sq_ring_ == MAP_FAILED) {
+        sq_ring_ = nullptr;
+        return false;
+    }
+    cq_ring_ = sq_ring_;
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    sqes_ = (io_uring_sqe *)mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+    if (sqes_ == MAP_FAILED) {
+        sqes_ = nullptr;
+        return false;
+    }
+
+    char *sq = (char *)sq_ring_;
+    sq_head_ = (unsigned *)(sq + params.sq_off.head);
+    sq_tail_ = (unsigned *)(sq + params.sq_off.tail);
+    sq_mask_ = (unsigned *)(sq + params.sq_off.ring_mask);
+    sq_array_ = (unsigned *)(sq + params.sq_off.array);
+    char *cq = (char *)cq_ring_;
+    cq_head_ = (unsigned *)(cq + params.cq_off.head);
+    cq_tail_ = (unsigned *)(cq + params.cq_off.tail);
+    cq_mask_ = (unsigned *)(cq + params.cq_off.ring_mask);
+    cqes_ = (io_uring_cqe *)(cq + params.cq_off.cqes);
+    sq_entries_ = params.sq_entries;
+    sq_local_tail_ = submitted_ = *sq_tail_;
+
+    std::vector<char> probe(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op), 0);
+    io_uring_probe *ops = (io_uring_probe *)probe.data();
+    if (io_uring_register(fd_, IORING_REGISTER_PROBE, ops, 256) == 0) {
+        for (unsigned i = 0; i < ops->ops_len; i++) {
+            if (ops->ops[i].flags & IO_URING_OP_SUPPORTED) probe_[ops->ops[i].op] = 1;
+        }
+    }
+    return true;
+}
+
+bool Uring::supports(uint8_t opcode) const {
+    return probe_[opcode] != 0;
+}
+
+bool Uring::setup_buffers(uint16_t group, unsigned count, unsigned size) {
+    buf_ring_size_ = count * sizeof(io_uring_buf);
+    void *ring = mmap(nullptr, buf_ring_size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    void *data = mmap(nullptr, (size_t)count * size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED || data == MAP_FAILED) {
+        if (ring != MAP_FAILED) munmap(ring, buf_ring_size_);
+        if (data != MAP_FAILED) munmap(data, (size_t)count * size);
+        return false;
+    }
+    buf_ring_ = (io_uring_buf *)ring;
+    buffers_ = (char *)data;
+    buffer_count_ = count;
+    buffer_size_ = size;
+
+    io_uring_buf_reg reg{};
+    reg.ring_addr = (uint64_t)buf_ring_;
+    reg.ring_entries = count;
+    reg.bgid = group;
+    if (io_uring_register(fd_, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) return false;
+    for (unsigned id = 0; id < count; id++) {
+        recycle_buffer(id);
+    }
+    return true;
+}
+
+void Uring::recycle_buffer(uint16_t id) {
+    // The tail overlays bufs[0].resv. The ring is indexed by hand because some uapi headers give
+    // io_uring_buf_ring a different layout when compiled as C++.
+    uint16_t *tail = &buf_ring_[0].resv;
+    uint16_t next = __atomic_load_n(tail, __ATOMIC_RELAXED);
+    io_uring_buf &buf = buf_ring_[next & (buffer_count_ - 1)];
+    buf.addr = (uint64_t)buffer(id);
+    buf.len = buffer_size_;
+    buf.bid = id;
+    __atomic_store_n(tail, (uint16_t)(next + 1), __ATOMIC_RELEASE);
+}
+
+io_uring_sqe *Uring::get_sqe() {
+    if (sq_local_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_) {
+        submit_and_wait(0);
+    }
+    unsigned index = sq_local_tail_ & *sq_mask_;
+    io_uring_sqe *sqe = &sqes_[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sq_array_[index] = index;
+    sq_local_tail_++;
+    return sqe;
+}
+
+int Uring::enter(unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t arg_size) {
+    enter_calls_++;
+    return (int)syscall(__NR_io_uring_enter, fd_, to_submit, min_complete, flags, arg, arg_size);
+}
+
+int Uring::submit_and_wait(int timeout_ms) {
+    __atomic_store_n(sq_tail_, sq_local_tail_, __ATOMIC_RELEASE);
+    unsigned to_submit = sq_local_tail_ - submitted_;
+    submitted_ = sq_local_tail_;
+
+    __kernel_timespec ts{};
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+    io_uring_getevents_arg arg{};
+    arg.ts = (uint64_t)&ts;
+
+    unsigned flags = IORING_ENTER_EXT_ARG;
+    unsigned min_complete = 0;
+    if (timeout_ms > 0 && *cq_head_ == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+        flags |= IORING_ENTER_GETEVENTS;
+        min_complete = 1;
+    }
+    int ret = enter(to_submit, min_complete, flags, &arg, sizeof(arg));
+    if (ret < 0 && (errno == ETIME || errno == EINTR)) return 0;
+    return ret;
+}
@@ -0,0 +1,79 @@
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+
+#include <cstddef>
+#include <cstdint>
+
+// Minimal io_uring wrapper on the raw system calls (no liburing): one submission and one
+// completion queue mapped into the process, plus a ring of provided receive buffers.
+// A Uring is used by a single thread.
+class Uring {
+   public:
+    Uring() = default;
+    ~Uring();
+    Uring(const Uring &) = delete;
+    Uring &operator=(const Uring &) = delete;
+
+    // Create the rings, returns false if io_uring is unavailable
+    bool init(unsigned entries);
+
+    // Register `count` receive buffers of `size` bytes as buffer group `group`
+    bool setup_buffers(uint16_t group, unsigned count, unsigned size);
+
+    // True if the kernel supports an opcode
+    bool supports(uint8_t opcode) const;
+
+    // A zeroed submission entry, flushing the queue first if it is full
+    io_uring_sqe *get_sqe();
+
+    // Submit pending entries and wait up to timeout_ms for at least one completion
+    int submit_and_wait(int timeout_ms);
+
+    // Call f(const io_uring_cqe &) for every available completion
+    template <typename F>
+    unsigned for_each_cqe(F &&f) {
+        unsigned head = *cq_head_;
+        unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+        unsigned count = 0;
+        for (; head != tail; head++, count++) {
+            f(cqes_[head & *cq_mask_]);
+        }
+        __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+        return count;
+    }
+
+    // Data of a provided buffer picked by the kernel
+    char *buffer(uint16_t id) const { return buffers_ + (size_t)id * buffer_size_; }
+
+    // Hand a provided buffer back to the kernel
+    void recycle_buffer(uint16_t id);
+
+    // io_uring_enter() calls made so far
+    uint64_t enter_calls() const { return enter_calls_; }
+
+   private:
+    int fd_ = -1;
+    void *sq_ring_ = nullptr, *cq_ring_ = nullptr;
+    size_t sq_ring_size_ = 0, cq_ring_size_ = 0;
+    io_uring_sqe *sqes_ = nullptr;
+    size_t sqes_size_ = 0;
+    unsigned *sq_head_ = nullptr, *sq_tail_ = nullptr, *sq_mask_ = nullptr, *sq_array_ = nullptr;
+    unsigned *cq_head_ = nullptr, *cq_tail_ = nullptr, *cq_mask_ = nullptr;
+    io_uring_cqe *cqes_ = nullptr;
+    unsigned sq_entries_ = 0;
+    unsigned sq_local_tail_ = 0;  // Entries handed out by get_sqe()
+    unsigned submitted_ = 0;      // Entries already passed to the kernel
+    uint64_t enter_calls_ = 0;
+
+    io_uring_buf *buf_ring_ = nullptr;  // Provided buffer ring, bufs[0].resv is its tail
+    size_t buf_ring_size_ = 0;
+    char *buffers_ = nullptr;
+    unsigned buffer_count_ = 0, buffer_size_ = 0;
+    uint8_t probe_[256] = {};  // Nonzero for supported opcodes
+
+    int enter(unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t arg_size);
+};
+
+#endif // URING_H